@@ -0,0 +1,146 @@
+#include "bake_job.h"
+
+MeshBakeJob::MeshBakeJob(Desc desc)
+    : desc_(std::move(desc))
+{
+    thread_ = std::thread([this] { run(); });
+}
+
+MeshBakeJob::~MeshBakeJob()
+{
+    cancel();
+    thread_.join();
+}
+
+void MeshBakeJob::cancel()
+{
+    progress_.cancel();
+}
+
+bool MeshBakeJob::isFinished() const
+{
+    return finished_;
+}
+
+std::exception_ptr MeshBakeJob::getException() const
+{
+    return finished_ ? exception_ : nullptr;
+}
+
+bool MeshBakeJob::bakes(LightingMode mode) const
+{
+    return (desc_.modeMask & modeBit(mode)) != 0;
+}
+
+const Progress &MeshBakeJob::getProgress() const
+{
+    return progress_;
+}
+
+bool MeshBakeJob::fetchPass(SHCoefsOfModes &coefs, int &samplesPerVertex)
+{
+    std::lock_guard lock(mutex_);
+    if(!hasPass_)
+        return false;
+
+    coefs            = std::move(pass_);
+    samplesPerVertex = passSamples_;
+    hasPass_         = false;
+    return true;
+}
+
+std::shared_ptr<const BVH> MeshBakeJob::getBVH(uint64_t &key) const
+{
+    std::lock_guard lock(mutex_);
+    key = bvhKey_;
+    return bvh_;
+}
+
+std::vector<int> MeshBakeJob::getSampleCounts() const
+{
+    std::lock_guard lock(mutex_);
+    return sampleCounts_;
+}
+
+void MeshBakeJob::run()
+{
+    // an exception leaving the thread would terminate the application.
+    // the owner reports it instead
+
+    try
+    {
+        bake();
+    }
+    catch(...)
+    {
+        exception_ = std::current_exception();
+    }
+
+    finished_ = true;
+}
+
+void MeshBakeJob::bake()
+{
+    const int vertexCount   = static_cast<int>(desc_.vertices.size());
+    const int triangleCount = static_cast<int>(desc_.indices.size() / 3);
+
+    // NoShadow traces no rays and bakes with an empty BVH
+
+    auto bvh = std::make_shared<const BVH>();
+    if(desc_.modeMask != modeBit(LightingMode::NoShadow))
+    {
+        // the build cannot be interrupted, so this is the last chance to
+        // skip it
+
+        if(progress_.isCancelled())
+            return;
+
+        std::vector<Float3> positions(vertexCount);
+        for(int vi = 0; vi < vertexCount; ++vi)
+            positions[vi] = desc_.vertices[vi].position;
+
+        const BVH::BuildSettings settings;
+        const uint64_t key = BVH::computeCacheKey(
+            positions.data(), vertexCount, desc_.indices.data(), triangleCount,
+            settings);
+
+        if(desc_.bvh && desc_.bvhKey == key)
+            bvh = desc_.bvh;
+        else
+        {
+            bvh = std::make_shared<const BVH>(BVH::createCached(
+                positions.data(), vertexCount, desc_.indices.data(),
+                triangleCount, settings, desc_.bvhCacheFilename));
+        }
+
+        std::lock_guard lock(mutex_);
+        bvh_    = bvh;
+        bvhKey_ = key;
+    }
+
+    auto publish = [&](const SHCoefsOfModes &coefs, int samplesPerVertex)
+    {
+        std::lock_guard lock(mutex_);
+        pass_        = coefs;
+        passSamples_ = samplesPerVertex;
+        hasPass_     = true;
+    };
+
+    if(progress_.isCancelled())
+        return;
+
+    std::vector<int> sampleCounts;
+    const auto result = computeVertexSHCoefsProgressive(
+        desc_.vertices.data(), vertexCount, desc_.indices.data(),
+        desc_.vertexAlbedo, desc_.maxOrder, desc_.samplesPerVertex,
+        desc_.firstPassSamples, desc_.modeMask, *bvh, publish,
+        desc_.targetError, &progress_, &sampleCounts);
+
+    {
+        std::lock_guard lock(mutex_);
+        sampleCounts_ = std::move(sampleCounts);
+    }
+
+    if(!progress_.isCancelled() && desc_.onFinished)
+        desc_.onFinished(result, progress_);
+}
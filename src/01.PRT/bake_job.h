@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "pre_mesh.h"
+
+// bakes the transfer vectors of a welded mesh on a thread of its own, so
+// that the caller stays responsive. the BVH is loaded or built there too,
+// the vertices are traced on the shared TaskScheduler and each pass of the
+// progressive bake is published as soon as it is done. the owner polls
+// the passes with fetchPass and may cancel the job at any time.
+//
+// cancellation is checked before the BVH is loaded or built and then once
+// per vertex. a build that has started runs to its end, so on a large mesh
+// without a cached BVH cancel() can take as long as the whole build
+class MeshBakeJob
+{
+public:
+
+    struct Desc
+    {
+        std::vector<SHVertex> vertices;
+        std::vector<uint32_t> indices;
+
+        // as in computeVertexSHCoefsProgressive
+        float    vertexAlbedo     = 0;
+        int      maxOrder         = 0;
+        int      samplesPerVertex = 0;
+        int      firstPassSamples = 0;
+        float    targetError      = 0;
+        uint32_t modeMask         = ALL_LIGHTING_MODES;
+
+        // bvh is reused when bvhKey is the BVH::computeCacheKey of the
+        // vertices and indices with default settings. otherwise the BVH is
+        // loaded from or saved to bvhCacheFilename
+        std::shared_ptr<const BVH> bvh;
+        uint64_t                   bvhKey = 0;
+        std::string                bvhCacheFilename;
+
+        // called on the job thread with the result of the last pass,
+        // unless the job is cancelled before. the job may still be
+        // cancelled meanwhile, which progress tells
+        std::function<void(
+            const SHCoefsOfModes &coefs, const Progress &progress)> onFinished;
+    };
+
+    explicit MeshBakeJob(Desc desc);
+
+    MeshBakeJob(const MeshBakeJob &) = delete;
+
+    MeshBakeJob &operator=(const MeshBakeJob &) = delete;
+
+    // cancels the job and waits for its thread
+    ~MeshBakeJob();
+
+    // returns at once. the job stops before the BVH build or at the next
+    // vertex
+    void cancel();
+
+    // the job thread has returned, whether the bake completed or not
+    bool isFinished() const;
+
+    // what the job thread threw, or nullptr. set once isFinished()
+    std::exception_ptr getException() const;
+
+    bool bakes(LightingMode mode) const;
+
+    // samples traced over all passes and an ETA. empty while the BVH is
+    // loaded or built
+    const Progress &getProgress() const;
+
+    // moves the result of the latest pass that was not fetched yet into
+    // coefs. returns false when there is none
+    bool fetchPass(SHCoefsOfModes &coefs, int &samplesPerVertex);
+
+    // the BVH the job bakes with and its key, or nullptr while it is not
+    // ready or not needed by the baked modes
+    std::shared_ptr<const BVH> getBVH(uint64_t &key) const;
+
+    // how many samples each vertex took, as computeVertexSHCoefsProgressive
+    // returns them. empty until the bake completes
+    std::vector<int> getSampleCounts() const;
+
+private:
+
+    void run();
+
+    void bake();
+
+    Desc     desc_;
+    Progress progress_;
+
+    mutable std::mutex         mutex_;
+    SHCoefsOfModes             pass_;
+    int                        passSamples_ = 0;
+    bool                       hasPass_     = false;
+    std::shared_ptr<const BVH> bvh_;
+    uint64_t                   bvhKey_      = 0;
+    std::vector<int>           sampleCounts_;
+
+    // exception_ is written before finished_ is set
+    std::exception_ptr exception_;
+    std::atomic<bool>  finished_ = false;
+
+    // started last, once the members above are initialized
+    std::thread thread_;
+};
@@ -10,3 +10,5 @@ enum class LightingMode
     Shadow,
     InterRefl
 };
+
+constexpr int LIGHTING_MODE_COUNT = 3;
@@ -1,13 +1,20 @@
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+
 #include <agz-utils/image.h>
 #include <agz-utils/mesh.h>
 #include <agz-utils/string.h>
 #include <agz-utils/time.h>
 
 #include <common/camera.h>
+#include <common/indexed_mesh.h>
 
+#include "bake_job.h"
 #include "pre_env.h"
 #include "pre_mesh.h"
 #include "renderer.h"
+#include "sh.h"
 
 class PRTApplication : public Demo
 {
@@ -23,11 +30,31 @@ protected:
 
 private:
 
-    static constexpr int MAX_SH_ORDER  = 4;
-    static constexpr int FULL_SH_COUNT = (MAX_SH_ORDER + 1) * (MAX_SH_ORDER + 1);
+    static constexpr int MAX_SH_ORDER  = SH_MAX_ORDER;
+    static constexpr int FULL_SH_COUNT = SH_COUNT<MAX_SH_ORDER>;
+
+    // a power of two, so that the first bounce samples of a vertex form a
+    // (0, m, 2)-net of the Owen-scrambled Sobol sequence
+    static constexpr int SAMPLES_PER_VERTEX = 256;
+
+    // a positive value bakes adaptively until the standard error of the
+    // transfer vectors reaches it, with SAMPLES_PER_VERTEX as the budget
+    static constexpr float TARGET_TRANSFER_ERROR = 0;
+
+    // samples per vertex of the first pass of a background bake. each
+    // later pass refines the shown result until SAMPLES_PER_VERTEX
+    static constexpr int FIRST_PASS_SAMPLES = 16;
+
+    // the Monte Carlo projection uses Owen-scrambled Sobol points, whose
+    // power of two prefixes are the best stratified
+    static constexpr int SAMPLES_FOR_LIGHT = 1 << 16;
+
+    static constexpr EnvProjection ENV_PROJECTION = EnvProjection::Texel;
 
-    static constexpr int SAMPLES_PER_VERTEX = 1024;
-    static constexpr int SAMPLES_FOR_LIGHT  = 1000000;
+    // a missing mesh cache bakes and caches all lighting modes at once, so
+    // that later mode switches show the running bake or load their
+    // coefficients from the cache
+    static constexpr bool BAKE_ALL_MODES = true;
 
     static constexpr float VERTEX_ALBEDO = 0.8f;
 
@@ -37,17 +64,30 @@ private:
 
     std::string getCacheFilename(const std::string &filename) const;
 
+    void setLightingMode(LightingMode mode);
+
     void loadMesh(const std::string &filename);
 
+    void startBake(std::vector<SHVertex> vertices, const std::string &filename);
+
+    void cancelBake();
+
+    // shows the passes finished by the bake job since the last frame, what
+    // it threw when it failed and how many samples an adaptive bake took
+    void pollBake();
+
+    // min, mean and max of the samples the vertices of an adaptive bake
+    // took, and how many vertices fall into each power of two bucket
+    static std::string getSampleCountSummary(
+        const std::vector<int> &sampleCounts, int maxSamples);
+
     void loadEnv(const std::string &filename);
 
     std::vector<float> loadCachedMeshCoefs(
         size_t vertexCount, const std::string &cacheFilename) const;
 
-    std::vector<float> generateMeshCoefs(
-        const SHVertex     *vertices,
-        size_t              vertexCount,
-        const std::string  &cacheFilename) const;
+    std::string getMeshCacheFilename(
+        const std::string &filename, LightingMode mode) const;
 
     std::vector<Float3> loadCachedLightCoefs(
         const std::string &cacheFilename) const;
@@ -56,7 +96,7 @@ private:
         const agz::texture::texture2d_t<Float3> &env,
         const std::string                       &cacheFilename) const;
 
-    const char *getLightingModeName() const;
+    static const char *getLightingModeName(LightingMode mode);
 
     ImGui::FileBrowser meshFileBrowser_;
     ImGui::FileBrowser envFileBrowser_;
@@ -74,9 +114,26 @@ private:
     Camera   camera_;
     Renderer renderer_;
 
-    std::vector<Float3> vertices_;
-    std::vector<float>  fullMeshSHCoefs_;
-    std::vector<Float3> envSHCoefs_;
+    // welded mesh: each vertex is baked and stored once
+    std::vector<Float3>   vertices_;
+    std::vector<uint32_t> indices_;
+    std::vector<float>    fullMeshSHCoefs_;
+    std::vector<Float3>   envSHCoefs_;
+
+    // kept across lighting mode switches and handed to later bakes of the
+    // same mesh. bvhKey_ identifies the vertices and indices it was built from
+    std::shared_ptr<const BVH> bvh_;
+    uint64_t                   bvhKey_ = 0;
+
+    // the bake of the current mesh, and the latest pass of it. cancelled
+    // jobs finish their current vertices in the background and are
+    // destroyed by pollBake
+    std::unique_ptr<MeshBakeJob>              bakeJob_;
+    std::vector<std::unique_ptr<MeshBakeJob>> cancelledBakeJobs_;
+    SHCoefsOfModes                            bakedSHCoefs_;
+    int                                       bakedSamplesPerVertex_ = 0;
+    std::string                               bakeError_;
+    std::string                               bakeSampleCounts_;
 
     agz::time::fps_counter_t fps_;
 };
@@ -122,6 +179,8 @@ void PRTApplication::frame()
 
     updateCamera();
 
+    pollBake();
+
     // gui
 
     if(ImGui::Begin("Settings", nullptr, ImGuiWindowFlags_AlwaysAutoResize))
@@ -131,25 +190,13 @@ void PRTApplication::frame()
         ImGui::Text("FPS: %d", fps_.fps());
 
         if(ImGui::RadioButton("NoShadow", lightingMode_ == LightingMode::NoShadow))
-        {
-            lightingMode_ = LightingMode::NoShadow;
-            if(!meshFilename_.empty())
-                loadMesh(meshFilename_);
-        }
+            setLightingMode(LightingMode::NoShadow);
         ImGui::SameLine();
         if(ImGui::RadioButton("Shadow", lightingMode_ == LightingMode::Shadow))
-        {
-            lightingMode_ = LightingMode::Shadow;
-            if(!meshFilename_.empty())
-                loadMesh(meshFilename_);
-        }
+            setLightingMode(LightingMode::Shadow);
         ImGui::SameLine();
         if(ImGui::RadioButton("InterRefl", lightingMode_ == LightingMode::InterRefl))
-        {
-            lightingMode_ = LightingMode::InterRefl;
-            if(!meshFilename_.empty())
-                loadMesh(meshFilename_);
-        }
+            setLightingMode(LightingMode::InterRefl);
 
         if(ImGui::SliderInt("Max Order", &maxSHOrder_, 0, 4))
             updateRendererSettings();
@@ -173,6 +220,26 @@ void PRTApplication::frame()
 
         if(ImGui::SliderFloat("Light Angle", &rotateAngle_, 0, 360))
             updateRendererSettings();
+
+        if(bakeJob_)
+        {
+            const Progress &progress = bakeJob_->getProgress();
+            ImGui::ProgressBar(progress.getFraction());
+
+            const double remaining = progress.getRemainingSeconds();
+            if(remaining < 0)
+                ImGui::Text("Baking: preparing");
+            else
+            {
+                ImGui::Text(
+                    "Baking: %d spp shown, %.0f s left",
+                    bakedSamplesPerVertex_, remaining);
+            }
+        }
+        else if(!bakeError_.empty())
+            ImGui::Text("Baking failed: %s", bakeError_.c_str());
+        else if(!bakeSampleCounts_.empty())
+            ImGui::TextUnformatted(bakeSampleCounts_.c_str());
     }
     ImGui::End();
 
@@ -214,7 +281,8 @@ void PRTApplication::frame()
 
 void PRTApplication::destroy()
 {
-
+    cancelBake();
+    cancelledBakeJobs_.clear();
 }
 
 void PRTApplication::updateCamera()
@@ -258,7 +326,8 @@ void PRTApplication::updateRendererSettings()
 
         renderer_.setVertices(
             vertices_.data(), meshSHCoefs.data(),
-            static_cast<int>(vertices_.size()));
+            static_cast<int>(vertices_.size()),
+            indices_.data(), static_cast<int>(indices_.size()));
     }
 
     if(!envSHCoefs_.empty())
@@ -284,44 +353,214 @@ std::string PRTApplication::getCacheFilename(const std::string &filename) const
     return "./asset/01/.cache/" + result;
 }
 
+void PRTApplication::setLightingMode(LightingMode mode)
+{
+    lightingMode_ = mode;
+    if(meshFilename_.empty())
+        return;
+
+    if(bakeJob_ && bakeJob_->bakes(mode))
+    {
+        fullMeshSHCoefs_ = bakedSHCoefs_[static_cast<int>(mode)];
+        updateRendererSettings();
+        return;
+    }
+
+    loadMesh(meshFilename_);
+}
+
 void PRTApplication::loadMesh(const std::string &filename)
 {
+    cancelBake();
+
     auto triangles = agz::mesh::load_from_file(filename);
 
-    vertices_.clear();
-    vertices_.reserve(triangles.size() * 3);
+    // texture coordinates are not used here, so corners that only differ
+    // in them are welded as well
+
     for(auto &t : triangles)
     {
-        vertices_.push_back(t.vertices[0].position);
-        vertices_.push_back(t.vertices[1].position);
-        vertices_.push_back(t.vertices[2].position);
+        for(auto &v : t.vertices)
+            v.tex_coord = {};
     }
 
-    const auto cacheFilenameSuffix = std::string(".") + getLightingModeName();
-    const auto cacheFilename = getCacheFilename(filename) + cacheFilenameSuffix;
-    auto meshCoefs = loadCachedMeshCoefs(vertices_.size(), cacheFilename);
+    IndexedMesh mesh = weldTriangles(triangles);
+    vertices_ = std::move(mesh.positions);
+    indices_  = std::move(mesh.indices);
+
+    const auto cacheFilename = getMeshCacheFilename(filename, lightingMode_);
+    fullMeshSHCoefs_ = loadCachedMeshCoefs(vertices_.size(), cacheFilename);
 
-    if(meshCoefs.empty())
+    // nothing is drawn until the first pass of the bake arrives
+
+    if(fullMeshSHCoefs_.empty())
     {
-        std::vector<SHVertex> SHVertices;
-        SHVertices.reserve(triangles.size() * 3);
-        for(auto &t : triangles)
+        std::vector<SHVertex> SHVertices(vertices_.size());
+        for(size_t vi = 0; vi < vertices_.size(); ++vi)
+            SHVertices[vi] = { vertices_[vi], mesh.normals[vi] };
+
+        startBake(std::move(SHVertices), filename);
+    }
+
+    updateRendererSettings();
+}
+
+void PRTApplication::startBake(
+    std::vector<SHVertex> vertices, const std::string &filename)
+{
+    const uint32_t modeMask =
+        BAKE_ALL_MODES ? ALL_LIGHTING_MODES : modeBit(lightingMode_);
+
+    // the job writes the caches from its own thread
+
+    std::array<std::string, LIGHTING_MODE_COUNT> cacheFilenames;
+    for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
+        cacheFilenames[m] = getMeshCacheFilename(filename, LightingMode(m));
+
+    MeshBakeJob::Desc desc;
+    desc.vertices         = std::move(vertices);
+    desc.indices          = indices_;
+    desc.vertexAlbedo     = VERTEX_ALBEDO;
+    desc.maxOrder         = MAX_SH_ORDER;
+    desc.samplesPerVertex = SAMPLES_PER_VERTEX;
+    desc.firstPassSamples = FIRST_PASS_SAMPLES;
+    desc.targetError      = TARGET_TRANSFER_ERROR;
+    desc.modeMask         = modeMask;
+    desc.bvh              = bvh_;
+    desc.bvhKey           = bvhKey_;
+    desc.bvhCacheFilename = getCacheFilename(filename) + ".bvh";
+
+    // each cache is written to a temporary file that is then renamed, so
+    // that a reload of the mesh never reads a partly written cache. a
+    // cancelled job stops between the modes
+
+    desc.onFinished = [cacheFilenames](
+        const SHCoefsOfModes &coefs, const Progress &progress)
+    {
+        for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
         {
-            for(int i = 0; i < 3; ++i)
+            if(progress.isCancelled())
+                return;
+
+            if(coefs[m].empty())
+                continue;
+
+            const std::string tempFilename = cacheFilenames[m] + ".tmp";
+            agz::file::create_directory_for_file(tempFilename);
+            agz::file::write_raw_file(
+                tempFilename, coefs[m].data(), coefs[m].size() * sizeof(float));
+            std::filesystem::rename(tempFilename, cacheFilenames[m]);
+        }
+    };
+
+    bakedSHCoefs_          = {};
+    bakedSamplesPerVertex_ = 0;
+    bakeError_.clear();
+    bakeSampleCounts_.clear();
+    bakeJob_ = std::make_unique<MeshBakeJob>(std::move(desc));
+}
+
+void PRTApplication::cancelBake()
+{
+    if(bakeJob_)
+    {
+        bakeJob_->cancel();
+        cancelledBakeJobs_.push_back(std::move(bakeJob_));
+    }
+}
+
+void PRTApplication::pollBake()
+{
+    std::erase_if(cancelledBakeJobs_, [](const std::unique_ptr<MeshBakeJob> &job)
+    {
+        return job->isFinished();
+    });
+
+    if(!bakeJob_)
+        return;
+
+    // a finished job has published all of its passes
+
+    const bool finished = bakeJob_->isFinished();
+
+    int samplesPerVertex;
+    if(bakeJob_->fetchPass(bakedSHCoefs_, samplesPerVertex))
+    {
+        bakedSamplesPerVertex_ = samplesPerVertex;
+        fullMeshSHCoefs_ = bakedSHCoefs_[static_cast<int>(lightingMode_)];
+        updateRendererSettings();
+    }
+
+    if(finished)
+    {
+        if(auto exception = bakeJob_->getException())
+        {
+            try
+            {
+                std::rethrow_exception(exception);
+            }
+            catch(const std::exception &err)
+            {
+                bakeError_ = err.what();
+            }
+            catch(...)
             {
-                SHVertices.push_back({
-                    t.vertices[i].position,
-                    t.vertices[i].normal
-                });
+                bakeError_ = "unknown error";
             }
         }
 
-        meshCoefs = generateMeshCoefs(
-            SHVertices.data(), SHVertices.size(), cacheFilename);
+        const auto sampleCounts = bakeJob_->getSampleCounts();
+        if(TARGET_TRANSFER_ERROR > 0 && !sampleCounts.empty())
+        {
+            bakeSampleCounts_ =
+                getSampleCountSummary(sampleCounts, SAMPLES_PER_VERTEX);
+        }
+
+        uint64_t key;
+        if(auto bvh = bakeJob_->getBVH(key))
+        {
+            bvh_    = std::move(bvh);
+            bvhKey_ = key;
+        }
+        bakeJob_.reset();
     }
+}
 
-    fullMeshSHCoefs_ = std::move(meshCoefs);
-    updateRendererSettings();
+std::string PRTApplication::getSampleCountSummary(
+    const std::vector<int> &sampleCounts, int maxSamples)
+{
+    const auto [minIt, maxIt] =
+        std::minmax_element(sampleCounts.begin(), sampleCounts.end());
+
+    double total = 0;
+    for(int count : sampleCounts)
+        total += count;
+    const double mean = total / sampleCounts.size();
+
+    char line[128];
+    std::snprintf(
+        line, sizeof(line),
+        "Samples per vertex: min %d, mean %.1f, max %d (%.1f%% of %d)",
+        *minIt, mean, *maxIt, 100 * mean / maxSamples, maxSamples);
+    std::string result = line;
+
+    for(int lower = 1; lower <= *maxIt; lower *= 2)
+    {
+        const int upper = 2 * lower;
+        const auto count = std::count_if(
+            sampleCounts.begin(), sampleCounts.end(),
+            [&](int c) { return lower <= c && c < upper; });
+        if(!count)
+            continue;
+
+        std::snprintf(
+            line, sizeof(line), "\n    [%d, %d): %zu vertices, %.1f%%",
+            lower, upper, static_cast<size_t>(count),
+            100.0 * count / sampleCounts.size());
+        result += line;
+    }
+
+    return result;
 }
 
 void PRTApplication::loadEnv(const std::string &filename)
@@ -350,9 +589,11 @@ std::vector<float> PRTApplication::loadCachedMeshCoefs(
     if(!std::filesystem::exists(cacheFilename))
         return {};
 
+    // caches of the unwelded mesh hold more vertices and are rebuilt
+
     auto bytes = agz::file::read_raw_file(cacheFilename);
     const size_t size = sizeof(float) * FULL_SH_COUNT * vertexCount;
-    if(bytes.size() < size)
+    if(bytes.size() != size)
         return {};
 
     std::vector<float> result(vertexCount * FULL_SH_COUNT);
@@ -361,20 +602,10 @@ std::vector<float> PRTApplication::loadCachedMeshCoefs(
     return result;
 }
 
-std::vector<float> PRTApplication::generateMeshCoefs(
-    const SHVertex    *vertices,
-    size_t             vertexCount,
-    const std::string &cacheFilename) const
+std::string PRTApplication::getMeshCacheFilename(
+    const std::string &filename, LightingMode mode) const
 {
-    auto result = computeVertexSHCoefs(
-        vertices, static_cast<int>(vertexCount),
-        VERTEX_ALBEDO, MAX_SH_ORDER, SAMPLES_PER_VERTEX, lightingMode_);
-
-    agz::file::create_directory_for_file(cacheFilename);
-    agz::file::write_raw_file(
-        cacheFilename, result.data(), result.size() * sizeof(float));
-
-    return result;
+    return getCacheFilename(filename) + "." + getLightingModeName(mode);
 }
 
 std::vector<Float3> PRTApplication::loadCachedLightCoefs(
@@ -398,7 +629,8 @@ std::vector<Float3> PRTApplication::generateLightCoefs(
     const agz::texture::texture2d_t<Float3> &env,
     const std::string                       &cacheFilename) const
 {
-    auto result = computeEnvSHCoefs(env, MAX_SH_ORDER, SAMPLES_FOR_LIGHT);
+    auto result = computeEnvSHCoefs(
+        env, MAX_SH_ORDER, SAMPLES_FOR_LIGHT, ENV_PROJECTION);
 
     agz::file::create_directory_for_file(cacheFilename);
     agz::file::write_raw_file(
@@ -407,9 +639,9 @@ std::vector<Float3> PRTApplication::generateLightCoefs(
     return result;
 }
 
-const char *PRTApplication::getLightingModeName() const
+const char *PRTApplication::getLightingModeName(LightingMode mode)
 {
-    switch(lightingMode_)
+    switch(mode)
     {
     case LightingMode::NoShadow:
         return "noshadow";
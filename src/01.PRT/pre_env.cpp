@@ -1,6 +1,10 @@
-#include <random>
+#include <algorithm>
+
+#include <common/sampler.h>
+#include <common/task_scheduler.h>
 
 #include "pre_env.h"
+#include "sh.h"
 
 namespace
 {
@@ -40,36 +44,214 @@ namespace
         rot_funcs[order](rot, coefs);
     }
 
-} // namespace anonymous
+    constexpr double PI_D = 3.14159265358979323846;
 
-std::vector<Float3> computeEnvSHCoefs(
-    const agz::texture::texture2d_t<Float3> &env,
-    int                                      maxOrder,
-    int                                      numSamples)
-{
-    const int SHCount = agz::math::sqr(maxOrder + 1);
-    auto SHFuncs = agz::math::spherical_harmonics::linear_table<float>();
-    
-    std::default_random_engine rng{ std::random_device()() };
-    std::uniform_real_distribution<float> uniform01;
+    // rows of the map projected by one task of the texel projection
+    constexpr int ROWS_PER_TASK = 8;
+
+    // samples drawn by one task of the Monte Carlo projection
+    constexpr int SAMPLES_PER_TASK = 1 << 14;
+
+    // adds the projection of rows [rowBeg, rowEnd) to output, laid out as
+    // 3 * SH_COUNT<L> doubles. each texel is weighted by its exact solid
+    // angle and evaluated at its center
+    template<int L>
+    void projectEnvRows(
+        const agz::texture::texture2d_t<Float3> &env,
+        int                                      rowBeg,
+        int                                      rowEnd,
+        const float                             *cosPhi,
+        const float                             *sinPhi,
+        double                                  *output)
+    {
+        const int width  = env.width();
+        const int height = env.height();
+
+        alignas(32) float x[SH_PACKET_SIZE] = {};
+        alignas(32) float y[SH_PACKET_SIZE] = {};
+        alignas(32) float z[SH_PACKET_SIZE] = {};
+        alignas(32) float values[SH_COUNT<L> * SH_PACKET_SIZE];
+        Float3 radiance[SH_PACKET_SIZE];
+
+        for(int row = rowBeg; row < rowEnd; ++row)
+        {
+            // v = 0.5 - theta / PI, where theta is the latitude
+
+            const double thetaTop    = PI_D * (0.5 - double(row) / height);
+            const double thetaBottom = PI_D * (0.5 - double(row + 1) / height);
+            const double solidAngle  = 2 * PI_D / width *
+                (std::sin(thetaTop) - std::sin(thetaBottom));
+
+            const float theta = static_cast<float>(0.5 * (thetaTop + thetaBottom));
+            const float cosTheta = std::cos(theta);
+            const float sinTheta = std::sin(theta);
+
+            Float3 rowSum[SH_COUNT<L>];
+
+            for(int col = 0; col < width; col += SH_PACKET_SIZE)
+            {
+                const int count = (std::min)(SH_PACKET_SIZE, width - col);
+
+                for(int pi = 0; pi < count; ++pi)
+                {
+                    x[pi] = cosTheta * cosPhi[col + pi];
+                    y[pi] = sinTheta;
+                    z[pi] = cosTheta * sinPhi[col + pi];
+                    radiance[pi] = env(row, col + pi);
+                }
+
+                evaluateSHPacket<L>(x, y, z, values);
+
+                for(int j = 0; j < SH_COUNT<L>; ++j)
+                {
+                    const float *v = &values[j * SH_PACKET_SIZE];
+                    for(int pi = 0; pi < count; ++pi)
+                        rowSum[j] += radiance[pi] * v[pi];
+                }
+            }
+
+            for(int j = 0; j < SH_COUNT<L>; ++j)
+            {
+                for(int k = 0; k < 3; ++k)
+                    output[3 * j + k] += solidAngle * rowSum[j][k];
+            }
+        }
+    }
+
+    // adds samples [sampleBeg, sampleBeg + sampleCount) of one Owen-scrambled
+    // Sobol sequence, mapped uniformly to the sphere and divided by their
+    // pdf, to output
+    template<int L>
+    void projectEnvSamples(
+        const agz::texture::texture2d_t<Float3> &env,
+        int                                      sampleBeg,
+        int                                      sampleCount,
+        double                                  *output)
+    {
+        const SampleStream samples(SampleSequence::OwenSobol);
+
+        float u1[SH_PACKET_SIZE], u2[SH_PACKET_SIZE];
+        alignas(32) float x[SH_PACKET_SIZE] = {};
+        alignas(32) float y[SH_PACKET_SIZE] = {};
+        alignas(32) float z[SH_PACKET_SIZE] = {};
+        alignas(32) float values[SH_COUNT<L> * SH_PACKET_SIZE];
+        Float3 radiance[SH_PACKET_SIZE];
+
+        Float3 sum[SH_COUNT<L>];
+
+        for(int i = 0; i < sampleCount; i += SH_PACKET_SIZE)
+        {
+            const int count = (std::min)(SH_PACKET_SIZE, sampleCount - i);
+            samples.generate2D(
+                static_cast<uint32_t>(sampleBeg + i), count, 0, u1, u2);
+
+            for(int pi = 0; pi < count; ++pi)
+            {
+                const auto sample =
+                    agz::math::distribution::uniform_on_sphere(u1[pi], u2[pi]);
+
+                x[pi] = sample.first.x;
+                y[pi] = sample.first.y;
+                z[pi] = sample.first.z;
+                radiance[pi] = sampleEnv(env, sample.first) / sample.second;
+            }
+
+            evaluateSHPacket<L>(x, y, z, values);
 
-    std::vector<Float3> result(SHCount);
+            for(int j = 0; j < SH_COUNT<L>; ++j)
+            {
+                const float *v = &values[j * SH_PACKET_SIZE];
+                for(int pi = 0; pi < count; ++pi)
+                    sum[j] += radiance[pi] * v[pi];
+            }
+        }
+
+        for(int j = 0; j < SH_COUNT<L>; ++j)
+        {
+            for(int k = 0; k < 3; ++k)
+                output[3 * j + k] += sum[j][k];
+        }
+    }
 
-    for(int i = 0; i < numSamples; ++i)
+    // the work is split into a fixed number of tasks and their partial sums
+    // are added in task order, so the result does not depend on the thread
+    // count or on which thread ran which task
+    template<int L>
+    std::vector<Float3> projectEnvSH(
+        const agz::texture::texture2d_t<Float3> &env,
+        int                                      numSamples,
+        EnvProjection                            projection)
     {
-        const float u1 = uniform01(rng), u2 = uniform01(rng);
-        const auto sample = agz::math::distribution::uniform_on_sphere(u1, u2);
+        constexpr int SHCount = SH_COUNT<L>;
+
+        const int taskCount = projection == EnvProjection::Texel ?
+            (env.height() + ROWS_PER_TASK - 1) / ROWS_PER_TASK :
+            (numSamples + SAMPLES_PER_TASK - 1) / SAMPLES_PER_TASK;
+
+        std::vector<double> taskSums(
+            static_cast<size_t>(taskCount) * 3 * SHCount, 0.0);
 
-        const Float3 l = sampleEnv(env, sample.first) / sample.second;
-        for(int j = 0; j < SHCount; ++j)
-            result[j] += l * SHFuncs[j](sample.first);
+        if(projection == EnvProjection::Texel)
+        {
+            std::vector<float> cosPhi(env.width()), sinPhi(env.width());
+            for(int col = 0; col < env.width(); ++col)
+            {
+                const double phi = 2 * PI_D * (col + 0.5) / env.width();
+                cosPhi[col] = static_cast<float>(std::cos(phi));
+                sinPhi[col] = static_cast<float>(std::sin(phi));
+            }
+
+            TaskScheduler::getDefault().parallelFor(0, taskCount, [&](int, int task)
+            {
+                const int rowBeg = task * ROWS_PER_TASK;
+                const int rowEnd =
+                    (std::min)(rowBeg + ROWS_PER_TASK, env.height());
+                projectEnvRows<L>(
+                    env, rowBeg, rowEnd, cosPhi.data(), sinPhi.data(),
+                    &taskSums[static_cast<size_t>(task) * 3 * SHCount]);
+            });
+        }
+        else
+        {
+            TaskScheduler::getDefault().parallelFor(0, taskCount, [&](int, int task)
+            {
+                const int sampleBeg = task * SAMPLES_PER_TASK;
+                const int sampleCount =
+                    (std::min)(SAMPLES_PER_TASK, numSamples - sampleBeg);
+                projectEnvSamples<L>(
+                    env, sampleBeg, sampleCount,
+                    &taskSums[static_cast<size_t>(task) * 3 * SHCount]);
+            });
+        }
+
+        const double scale =
+            projection == EnvProjection::Texel ? 1.0 : 1.0 / numSamples;
+
+        std::vector<Float3> result(SHCount);
+        for(int i = 0; i < 3 * SHCount; ++i)
+        {
+            double sum = 0;
+            for(int task = 0; task < taskCount; ++task)
+                sum += taskSums[static_cast<size_t>(task) * 3 * SHCount + i];
+            result[i / 3][i % 3] = static_cast<float>(scale * sum);
+        }
+
+        return result;
     }
 
-    const float invNumSamples = 1.0f / numSamples;
-    for(auto &s : result)
-        s *= invNumSamples;
+} // namespace anonymous
 
-    return result;
+std::vector<Float3> computeEnvSHCoefs(
+    const agz::texture::texture2d_t<Float3> &env,
+    int                                      maxOrder,
+    int                                      numSamples,
+    EnvProjection                            projection)
+{
+    assert(projection == EnvProjection::Texel || numSamples > 0);
+    return dispatchSHOrder(maxOrder, [&](auto order)
+    {
+        return projectEnvSH<decltype(order)::value>(env, numSamples, projection);
+    });
 }
 
 void rotateEnvSHCoefs(
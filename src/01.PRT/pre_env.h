@@ -2,10 +2,23 @@
 
 #include <common/common.h>
 
+// how the environment map is projected onto the SH basis.
+// Texel integrates every texel of the equirectangular map weighted by its
+// solid angle. MonteCarlo averages numSamples uniform sphere samples taken
+// from an Owen-scrambled Sobol sequence. both are computed in parallel and
+// reproducible
+enum class EnvProjection
+{
+    Texel,
+    MonteCarlo
+};
+
+// numSamples is only used by EnvProjection::MonteCarlo
 std::vector<Float3> computeEnvSHCoefs(
     const agz::texture::texture2d_t<Float3> &env,
     int                                      maxOrder,
-    int                                      numSamples);
+    int                                      numSamples,
+    EnvProjection                            projection = EnvProjection::Texel);
 
 void rotateEnvSHCoefs(
     const agz::math::mat3f_c &rot, std::vector<Float3> &coefs);
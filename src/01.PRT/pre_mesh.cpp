@@ -1,200 +1,1110 @@
-#include <random>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <utility>
 
-#include <agz-utils/console.h>
-#include <agz-utils/thread.h>
-
-#include <common/bvh.h>
+#include <common/bvh_stats.h>
+#include <common/sampler.h>
+#include <common/task_scheduler.h>
 
 #include "pre_mesh.h"
+#include "sh.h"
 
 namespace
 {
 
     constexpr float EPS = 2e-4f;
 
-    class Sampler
+    // hemisphere samples of a vertex are traced as packets of this size
+    constexpr int PACKET_SIZE = 8;
+
+    static_assert(PACKET_SIZE == SH_PACKET_SIZE);
+
+    // bounces of an interreflection path
+    constexpr int MAX_DEPTH = 5;
+
+    // paths traced together by one wavefront batch
+    constexpr int WAVEFRONT_PATH_COUNT = 1 << 14;
+
+    // a progressive bake multiplies the samples per vertex traced so far
+    // by this after each pass
+    constexpr int PROGRESSIVE_PASS_GROWTH = 4;
+
+    // samples traced by one round of the adaptive bake, and the rounds
+    // traced before the error estimate is trusted
+    constexpr int ADAPTIVE_ROUND_SIZE = 16;
+    constexpr int ADAPTIVE_MIN_ROUNDS = 4;
+
+    // each vertex draws its samples from its own stream. sample i of a
+    // vertex uses dimensions 0 and 1 for its first direction and 2 * depth
+    // and 2 * depth + 1 to scatter at bounce depth
+    constexpr SampleSequence SAMPLE_SEQUENCE = SampleSequence::OwenSobol;
+
+    SampleStream getVertexSamples(int vertex)
     {
-        std::minstd_rand                      rng_;
-        std::uniform_real_distribution<float> dis_;
+        return SampleStream(SAMPLE_SEQUENCE, static_cast<uint64_t>(vertex));
+    }
 
-    public:
+    // first bounce samples of a vertex with their sample indices, sorted by
+    // their cell in a 16x16 grid over [0, 1)^2 in morton order. any run of
+    // consecutive low-discrepancy samples is spread evenly over the
+    // hemisphere, so in index order every packet and every visibility
+    // group would be as incoherent as possible
+    struct FirstBounceSamples
+    {
+        std::vector<float>    u1;
+        std::vector<float>    u2;
+        std::vector<uint32_t> index;
 
-        explicit Sampler(int seed)
-            : rng_(seed), dis_(0, 1)
+        FirstBounceSamples(const SampleStream &samples, uint32_t firstSample, int count)
+            : u1(count), u2(count), index(count)
         {
-            
-        }
+            constexpr int GRID_BITS = 4;
+            constexpr int CELL_COUNT = 1 << (2 * GRID_BITS);
 
-        float sample()
-        {
-            return dis_(rng_);
-        }
+            std::vector<float> v1(count), v2(count);
+            samples.generate2D(firstSample, count, 0, v1.data(), v2.data());
 
-        Float2 sample2()
-        {
-            const float s1 = sample();
-            const float s2 = sample();
-            return { s1, s2 };
+            auto spreadBits = [](uint32_t bits)
+            {
+                bits = (bits | (bits << 2)) & 0x33u;
+                bits = (bits | (bits << 1)) & 0x55u;
+                return bits;
+            };
+
+            std::vector<uint8_t> cells(count);
+            uint32_t offsets[CELL_COUNT] = {};
+            for(int i = 0; i < count; ++i)
+            {
+                const uint32_t x = static_cast<uint32_t>(v1[i] * (1 << GRID_BITS));
+                const uint32_t y = static_cast<uint32_t>(v2[i] * (1 << GRID_BITS));
+                cells[i] = static_cast<uint8_t>(spreadBits(x) | (spreadBits(y) << 1));
+                ++offsets[cells[i]];
+            }
+
+            uint32_t sum = 0;
+            for(auto &offset : offsets)
+                sum += std::exchange(offset, sum);
+
+            for(int i = 0; i < count; ++i)
+            {
+                const uint32_t dst = offsets[cells[i]]++;
+                u1[dst]    = v1[i];
+                u2[dst]    = v2[i];
+                index[dst] = firstSample + static_cast<uint32_t>(i);
+            }
         }
     };
 
+    template<int L>
     void computeVertexSHNoShadow(
         float         coef,
-        const Ray    &ray,
-        int           SHCount,
+        const Float3 &dir,
         float        *output)
     {
         if(!agz::math::is_finite(coef))
             return;
 
-        auto SHFuncs = agz::math::spherical_harmonics::linear_table<float>();
-        for(int i = 0; i < SHCount; ++i)
-            output[i] += coef * SHFuncs[i](ray.d);
+        float values[SH_COUNT<L>];
+        evaluateSH<L>(dir, values);
+        for(int i = 0; i < SH_COUNT<L>; ++i)
+            output[i] += coef * values[i];
     }
 
+    // adds the first count lanes of SH values produced by evaluateSHPacket,
+    // weighted by coefs, to output
+    template<int L>
+    void accumulatePacketSH(
+        const float *values,
+        const float *coefs,
+        int          count,
+        float       *output)
+    {
+        float weights[SH_PACKET_SIZE] = {};
+        for(int pi = 0; pi < count; ++pi)
+        {
+            if(agz::math::is_finite(coefs[pi]))
+                weights[pi] = coefs[pi];
+        }
+
+        for(int i = 0; i < SH_COUNT<L>; ++i)
+        {
+            const float *v = &values[i * SH_PACKET_SIZE];
+
+            float sum = 0;
+            for(int pi = 0; pi < count; ++pi)
+                sum += weights[pi] * v[pi];
+            output[i] += sum;
+        }
+    }
+
+    // the first count lanes of the SoA directions x, y and z, weighted by
+    // coefs, are projected at once
+    template<int L>
+    void computePacketSHNoShadow(
+        const float *x,
+        const float *y,
+        const float *z,
+        const float *coefs,
+        int          count,
+        float       *output)
+    {
+        alignas(32) float values[SH_COUNT<L> * SH_PACKET_SIZE];
+        evaluateSHPacket<L>(x, y, z, values);
+        accumulatePacketSH<L>(values, coefs, count, output);
+    }
+
+    // all hemisphere samples of a vertex leave from the same point, so
+    // their visibility is resolved by a single batched traversal
+    template<int L>
     void computeVertexSHShadow(
-        float      coef,
-        const Ray &ray,
-        const BVH &bvh,
-        int        SHCount,
-        float     *output)
+        const SHVertex     &vertex,
+        float               brdf,
+        uint32_t            firstSample,
+        int                 samplesPerVertex,
+        const BVH          &bvh,
+        const SampleStream &samples,
+        float              *output)
     {
-        if(!agz::math::is_finite(coef))
-            return;
+        const Float3 o = vertex.position + EPS * vertex.normal;
+        const Frame localFrame = Frame::from_z(vertex.normal);
 
-        if(bvh.hasIntersection(ray))
-            return;
+        std::vector<Float3> dirs(samplesPerVertex);
+        std::vector<float> coefs(samplesPerVertex);
 
-        auto SHFuncs = agz::math::spherical_harmonics::linear_table<float>();
-        for(int i = 0; i < SHCount; ++i)
-            output[i] += coef * SHFuncs[i](ray.d);
+        const FirstBounceSamples sams(samples, firstSample, samplesPerVertex);
+
+        for(int si = 0; si < samplesPerVertex; ++si)
+        {
+            const auto [localDir, pdfDir] =
+                agz::math::distribution::zweighted_on_hemisphere(
+                    sams.u1[si], sams.u2[si]);
+
+            dirs[si] = localFrame.local_to_global(localDir).normalize();
+            coefs[si] = brdf * abs(cos(dirs[si], vertex.normal)) / pdfDir;
+        }
+
+        std::vector<uint32_t> visibleMask((samplesPerVertex + 31) / 32);
+        bvh.computeVisibility(
+            o, dirs.data(), samplesPerVertex,
+            0, std::numeric_limits<float>::infinity(), visibleMask.data());
+
+        // visible samples are packed into SoA packets for the SH projection
+
+        alignas(32) float x[SH_PACKET_SIZE] = {};
+        alignas(32) float y[SH_PACKET_SIZE] = {};
+        alignas(32) float z[SH_PACKET_SIZE] = {};
+        float packetCoefs[SH_PACKET_SIZE];
+        int count = 0;
+
+        for(int si = 0; si < samplesPerVertex; ++si)
+        {
+            if(!((visibleMask[si / 32] >> (si % 32)) & 1))
+                continue;
+
+            x[count] = dirs[si].x;
+            y[count] = dirs[si].y;
+            z[count] = dirs[si].z;
+            packetCoefs[count] = coefs[si];
+
+            if(++count == SH_PACKET_SIZE)
+            {
+                computePacketSHNoShadow<L>(x, y, z, packetCoefs, count, output);
+                count = 0;
+            }
+        }
+
+        if(count)
+            computePacketSHNoShadow<L>(x, y, z, packetCoefs, count, output);
+    }
+
+    // vertex indices of the corners of a triangle. without indices the
+    // vertices are a triangle soup
+    void getCorners(const uint32_t *indices, int triangle, uint32_t corners[3])
+    {
+        const uint32_t base = 3 * static_cast<uint32_t>(triangle);
+        for(int k = 0; k < 3; ++k)
+            corners[k] = indices ? indices[base + k] : base + k;
+    }
+
+    Float3 interpolateNormal(
+        const SHVertex          *vertices,
+        const uint32_t          *indices,
+        const BVH::Intersection &inct)
+    {
+        uint32_t corners[3];
+        getCorners(indices, inct.triangle, corners);
+
+        return ((1 - inct.uv.sum()) * vertices[corners[0]].normal +
+                inct.uv.x           * vertices[corners[1]].normal +
+                inct.uv.y           * vertices[corners[2]].normal).normalize();
     }
 
+    // continues the path of sample at its hit of bounce depth by sampling
+    // the next direction. returns false when the path ends there
+    bool scatterPath(
+        const SHVertex          *vertices,
+        const uint32_t          *indices,
+        const BVH::Intersection &inct,
+        float                    brdf,
+        const SampleStream      &samples,
+        uint32_t                 sample,
+        int                      depth,
+        Ray                     &ray,
+        float                   &coef)
+    {
+        const Float3 nor = interpolateNormal(vertices, indices, inct);
+
+        if(dot(nor, ray.d) >= 0)
+            return false;
+
+        const Float2 sam = samples.get2D(sample, 2 * depth);
+        auto [local_dir, pdf_dir] =
+            agz::math::distribution::zweighted_on_hemisphere(sam.x, sam.y);
+
+        const Frame localFrame = Frame::from_z(nor);
+        ray.d = localFrame.local_to_global(local_dir).normalize();
+        ray.o = inct.position + EPS * nor;
+
+        coef *= brdf * abs(cos(ray.d, nor)) / pdf_dir;
+        return true;
+    }
+
+    // firstInct is the closest hit of ray, or nullptr when it escapes.
+    // sample is the index of the path in samples
+    template<int L>
     void computeVertexSHInterRefl(
-        const SHVertex *vertices,
-        float           coef,
-        float           brdf,
-        Ray             ray,
-        const BVH      &bvh,
-        int             SHCount,
-        int             maxDepth,
-        Sampler        &sampler,
-        float          *output)
+        const SHVertex          *vertices,
+        const uint32_t          *indices,
+        float                    coef,
+        float                    brdf,
+        Ray                      ray,
+        const BVH::Intersection *firstInct,
+        const BVH               &bvh,
+        const SampleStream      &samples,
+        uint32_t                 sample,
+        float                   *output)
     {
-        auto SHFuncs = agz::math::spherical_harmonics::linear_table<float>();
+        BVH::Intersection inct;
+        bool hit = firstInct != nullptr;
+        if(hit)
+            inct = *firstInct;
 
-        for(int depth = 1; depth <= maxDepth; ++depth)
+        for(int depth = 1; depth <= MAX_DEPTH; ++depth)
         {
             if(!agz::math::is_finite(coef))
                 return;
 
-            BVH::Intersection inct;
-            if(!bvh.findIntersection(ray, &inct))
+            if(depth > 1)
+                hit = bvh.findIntersection(ray, &inct);
+
+            if(!hit)
             {
-                for(int i = 0; i < SHCount; ++i)
-                    output[i] += coef * SHFuncs[i](ray.d);
+                computeVertexSHNoShadow<L>(coef, ray.d, output);
                 return;
             }
 
-            const SHVertex *tri = &vertices[3 * inct.triangle];
-            const Float3 nor =
-                ((1 - inct.uv.sum()) * tri[0].normal +
-                 inct.uv.x           * tri[1].normal +
-                 inct.uv.y           * tri[2].normal).normalize();
-
-            if(dot(nor, ray.d) >= 0)
+            if(!scatterPath(
+                    vertices, indices, inct, brdf, samples, sample, depth, ray, coef))
                 return;
-            
-            const Float2 sam = sampler.sample2();
-            auto [local_dir, pdf_dir] =
-                agz::math::distribution::zweighted_on_hemisphere(sam.x, sam.y);
+        }
+    }
+
+    struct WavefrontPath
+    {
+        Ray      ray;
+        float    coef;
+        int      vertex;
+        uint32_t sample;
+    };
 
-            const Frame localFrame = Frame::from_z(nor);
-            ray.d = localFrame.local_to_global(local_dir).normalize();
-            ray.o = inct.position + EPS * nor;
+    constexpr int COHERENCE_KEY_BITS = 30;
 
-            coef *= brdf * abs(cos(ray.d, nor)) / pdf_dir;
+    // 9 bits per axis of the morton code of the origin cell, followed by
+    // the direction octant
+    uint32_t computeCoherenceKey(
+        const Ray &ray, const Float3 &lower, const Float3 &invExtent)
+    {
+        uint32_t cell[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            const float u = (ray.o[axis] - lower[axis]) * invExtent[axis];
+            cell[axis] = static_cast<uint32_t>(
+                (std::clamp)(static_cast<int>(u * 512), 0, 511));
         }
-    }
-    
-} // namespace anonymous
 
-std::vector<float> computeVertexSHCoefs(
-    const SHVertex *vertices,
-    int             vertexCount,
-    float           vertexAlbedo,
-    int             maxOrder,
-    int             samplesPerVertex,
-    LightingMode    mode)
-{
-    assert(vertices && vertexCount > 0);
-    assert(vertexCount % 3 == 0);
-    assert(samplesPerVertex > 0);
+        uint32_t key = 0;
+        for(int bit = 8; bit >= 0; --bit)
+        {
+            for(int axis = 0; axis < 3; ++axis)
+                key = (key << 1) | ((cell[axis] >> bit) & 1);
+        }
 
-    const float brdf = vertexAlbedo / PI;
-    const float invSamplesPerVertex = 1.0f / samplesPerVertex;
+        return (key << 3) | (ray.d.x < 0 ? 1 : 0)
+                          | (ray.d.y < 0 ? 2 : 0)
+                          | (ray.d.z < 0 ? 4 : 0);
+    }
 
-    BVH bvh;
-    if(mode != LightingMode::NoShadow)
+    // stable LSD radix sort of (key << 32 | payload) items by the low
+    // keyBits bits of key
+    void radixSortByKey(
+        std::vector<uint64_t> &items,
+        std::vector<uint64_t> &temp,
+        int                    keyBits)
     {
-        std::vector<Float3> positions(vertexCount);
-        for(int vi = 0; vi < vertexCount; ++vi)
-            positions[vi] = vertices[vi].position;
-        bvh = BVH::create(positions.data(), vertexCount / 3);
+        constexpr int DIGIT_BITS = 10;
+        constexpr uint32_t DIGIT_MASK = (1u << DIGIT_BITS) - 1;
+
+        temp.resize(items.size());
+        for(int shift = 32; shift < 32 + keyBits; shift += DIGIT_BITS)
+        {
+            uint32_t offsets[DIGIT_MASK + 1] = {};
+            for(uint64_t item : items)
+                ++offsets[(item >> shift) & DIGIT_MASK];
+
+            uint32_t sum = 0;
+            for(auto &offset : offsets)
+                sum += std::exchange(offset, sum);
+
+            for(uint64_t item : items)
+                temp[offsets[(item >> shift) & DIGIT_MASK]++] = item;
+            items.swap(temp);
+        }
     }
 
-    const int SHCount = agz::math::sqr(maxOrder + 1);
-    std::vector<float> result(SHCount * vertexCount, 0.0f);
+    // all paths of vertices [vertexBeg, vertexEnd) are advanced one bounce
+    // at a time. the rays of a bounce are sorted so that consecutive ones,
+    // which the stream query traces as packets, visit similar nodes
+    template<int L>
+    void computeBatchSHInterRefl(
+        const SHVertex *vertices,
+        const uint32_t *indices,
+        int             vertexBeg,
+        int             vertexEnd,
+        float           brdf,
+        int             samplesPerVertex,
+        const BVH      &bvh,
+        float          *result)
+    {
+        const BVH::Node &root = bvh.getNodes()[0];
+        const Float3 extent = root.upper - root.lower;
+        const Float3 invExtent = {
+            extent.x > 0 ? 1 / extent.x : 0.0f,
+            extent.y > 0 ? 1 / extent.y : 0.0f,
+            extent.z > 0 ? 1 / extent.z : 0.0f
+        };
+
+        std::vector<WavefrontPath> paths;
+        paths.reserve(static_cast<size_t>(vertexEnd - vertexBeg) * samplesPerVertex);
 
-    const int reportStepSize = (std::max)(vertexCount / 50, 1);
-    int lastReportedVi = 0;
-    agz::console::progress_bar_f_t pbar(80, '=');
-    pbar.display();
+        for(int vi = vertexBeg; vi < vertexEnd; ++vi)
+        {
+            const FirstBounceSamples sams(getVertexSamples(vi), 0, samplesPerVertex);
 
-    agz::thread::parallel_forrange(0, vertexCount, [&](int threadIdx, int vi)
+            auto &vertex = vertices[vi];
+            const Float3 o = vertex.position + EPS * vertex.normal;
+            const Frame localFrame = Frame::from_z(vertex.normal);
+
+            for(int si = 0; si < samplesPerVertex; ++si)
+            {
+                const auto [localDir, pdfDir] =
+                    agz::math::distribution::zweighted_on_hemisphere(
+                        sams.u1[si], sams.u2[si]);
+
+                const Float3 d = localFrame.local_to_global(localDir).normalize();
+                const float coef = brdf * abs(cos(d, vertex.normal)) / pdfDir;
+
+                if(agz::math::is_finite(coef))
+                    paths.push_back({ Ray(o, d), coef, vi, sams.index[si] });
+            }
+        }
+
+        std::vector<WavefrontPath>     nextPaths;
+        std::vector<uint64_t>          order;
+        std::vector<uint64_t>          sortTemp;
+        std::vector<Ray>               rays;
+        std::vector<uint32_t>          hitMask;
+        std::vector<BVH::Intersection> incts;
+
+        for(int depth = 1; depth <= MAX_DEPTH && !paths.empty(); ++depth)
+        {
+            const int pathCount = static_cast<int>(paths.size());
+
+            // first bounce rays are generated per vertex and already share
+            // their origins, so only the later bounces are sorted
+
+            order.resize(pathCount);
+            for(int i = 0; i < pathCount; ++i)
+            {
+                const uint32_t key = depth == 1 ? 0 : computeCoherenceKey(
+                    paths[i].ray, root.lower, invExtent);
+                order[i] = (static_cast<uint64_t>(key) << 32) | i;
+            }
+
+            if(depth > 1)
+                radixSortByKey(order, sortTemp, COHERENCE_KEY_BITS);
+
+            rays.resize(pathCount);
+            for(int k = 0; k < pathCount; ++k)
+                rays[k] = paths[static_cast<uint32_t>(order[k])].ray;
+
+            hitMask.resize((pathCount + 31) / 32);
+            incts.resize(pathCount);
+            bvh.findIntersection(
+                rays.data(), pathCount, hitMask.data(), incts.data());
+
+            nextPaths.clear();
+            for(int k = 0; k < pathCount; ++k)
+            {
+                WavefrontPath path = paths[static_cast<uint32_t>(order[k])];
+
+                if(!((hitMask[k / 32] >> (k % 32)) & 1))
+                {
+                    computeVertexSHNoShadow<L>(
+                        path.coef, path.ray.d, &result[SH_COUNT<L> * path.vertex]);
+                    continue;
+                }
+
+                if(depth == MAX_DEPTH)
+                    continue;
+
+                if(scatterPath(
+                        vertices, indices, incts[k], brdf,
+                        getVertexSamples(path.vertex), path.sample, depth,
+                        path.ray, path.coef) &&
+                   agz::math::is_finite(path.coef))
+                    nextPaths.push_back(path);
+            }
+
+            paths.swap(nextPaths);
+        }
+    }
+
+    // adds the transfer of samples [firstSample, firstSample + sampleCount)
+    // of a vertex, not yet divided by the sample count, to outputs[mode] of
+    // each mode in modeMask
+    template<int L>
+    void traceVertexSamples(
+        const SHVertex     *vertices,
+        const uint32_t     *indices,
+        const SHVertex     &vertex,
+        float               brdf,
+        uint32_t            firstSample,
+        int                 sampleCount,
+        uint32_t            modeMask,
+        const BVH          &bvh,
+        const SampleStream &samples,
+        float       *const *outputs)
     {
-        Sampler sampler(vi);
+        float *noShadowOutput  = outputs[static_cast<int>(LightingMode::NoShadow)];
+        float *shadowOutput    = outputs[static_cast<int>(LightingMode::Shadow)];
+        float *interReflOutput = outputs[static_cast<int>(LightingMode::InterRefl)];
 
-        auto &vertex = vertices[vi];
-        float *output = &result[SHCount * vi];
+        if(modeMask == modeBit(LightingMode::Shadow))
+        {
+            computeVertexSHShadow<L>(
+                vertex, brdf, firstSample, sampleCount, bvh, samples, shadowOutput);
+            return;
+        }
 
         const Float3 o = vertex.position + EPS * vertex.normal;
         const Frame localFrame = Frame::from_z(vertex.normal);
-        
-        for(int si = 0; si < samplesPerVertex; ++si)
+
+        const FirstBounceSamples sams(samples, firstSample, sampleCount);
+
+        for(int si = 0; si < sampleCount; si += PACKET_SIZE)
         {
-            const auto sam = sampler.sample2();
-            const auto [localDir, pdfDir] =
-                agz::math::distribution::zweighted_on_hemisphere(sam.x, sam.y);
-
-            const Float3 d = localFrame.local_to_global(localDir).normalize();
-            const Ray ray(o, d);
-            
-            const float initCoef = brdf * abs(cos(d, vertex.normal)) / pdfDir;
-
-            if(mode == LightingMode::NoShadow)
-                computeVertexSHNoShadow(initCoef, ray, SHCount, output);
-            else if(mode == LightingMode::Shadow)
-                computeVertexSHShadow(initCoef, ray, bvh, SHCount, output);
-            else
-            {
-                computeVertexSHInterRefl(
-                    vertices, initCoef, brdf, ray, bvh,
-                    SHCount, 5, sampler, output);
+            const int count = (std::min)(PACKET_SIZE, sampleCount - si);
+
+            RayPacket<PACKET_SIZE> packet = {};
+            float initCoefs[PACKET_SIZE];
+
+            for(int pi = 0; pi < count; ++pi)
+            {
+                const auto [localDir, pdfDir] =
+                    agz::math::distribution::zweighted_on_hemisphere(
+                        sams.u1[si + pi], sams.u2[si + pi]);
+
+                const Float3 d =
+                    localFrame.local_to_global(localDir).normalize();
+                packet.set(pi, Ray(o, d));
+
+                initCoefs[pi] =
+                    brdf * abs(cos(d, vertex.normal)) / pdfDir;
+            }
+
+            // the SH values of the first bounce directions are shared by
+            // all modes
+
+            alignas(32) float values[SH_COUNT<L> * SH_PACKET_SIZE];
+            evaluateSHPacket<L>(packet.dx, packet.dy, packet.dz, values);
+
+            if(noShadowOutput)
+                accumulatePacketSH<L>(values, initCoefs, count, noShadowOutput);
+
+            if(!shadowOutput && !interReflOutput)
+                continue;
+
+            const uint32_t activeMask = (1u << count) - 1;
+
+            BVH::Intersection incts[PACKET_SIZE];
+            const uint32_t hits =
+                bvh.findIntersection(packet, activeMask, incts);
+
+            float escapedCoefs[PACKET_SIZE];
+            for(int pi = 0; pi < count; ++pi)
+                escapedCoefs[pi] = (hits >> pi) & 1 ? 0.0f : initCoefs[pi];
+
+            if(shadowOutput)
+                accumulatePacketSH<L>(values, escapedCoefs, count, shadowOutput);
+
+            if(interReflOutput)
+            {
+                accumulatePacketSH<L>(
+                    values, escapedCoefs, count, interReflOutput);
+
+                for(int pi = 0; pi < count; ++pi)
+                {
+                    if((hits >> pi) & 1)
+                    {
+                        computeVertexSHInterRefl<L>(
+                            vertices, indices, initCoefs[pi], brdf,
+                            packet.get(pi), &incts[pi], bvh,
+                            samples, sams.index[si + pi], interReflOutput);
+                    }
+                }
             }
         }
+    }
+
+    // traces rounds of ADAPTIVE_ROUND_SIZE samples until the estimated
+    // standard error of the transfer falls to targetError or maxSamples
+    // have been spent. the error is estimated from the spread of the round
+    // means over all baked modes, so at least ADAPTIVE_MIN_ROUNDS rounds are
+    // traced. rounds of a low-discrepancy sequence partly cancel each
+    // other's error, which makes the estimate conservative.
+    // returns the number of samples spent
+    template<int L>
+    int traceVertexSamplesAdaptive(
+        const SHVertex     *vertices,
+        const uint32_t     *indices,
+        const SHVertex     &vertex,
+        float               brdf,
+        int                 maxSamples,
+        float               targetError,
+        uint32_t            modeMask,
+        const BVH          &bvh,
+        const SampleStream &samples,
+        float       *const *outputs)
+    {
+        constexpr int SHCount = SH_COUNT<L>;
+
+        float roundSums[LIGHTING_MODE_COUNT][SHCount];
+        float *roundOutputs[LIGHTING_MODE_COUNT];
+        for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
+            roundOutputs[m] = outputs[m] ? roundSums[m] : nullptr;
+
+        double meanSums[LIGHTING_MODE_COUNT][SHCount] = {};
+        double meanSqrSums[LIGHTING_MODE_COUNT][SHCount] = {};
+
+        int spent = 0, rounds = 0;
+        while(spent < maxSamples)
+        {
+            const int count = (std::min)(ADAPTIVE_ROUND_SIZE, maxSamples - spent);
+
+            for(auto &sums : roundSums)
+                std::fill(std::begin(sums), std::end(sums), 0.0f);
+
+            traceVertexSamples<L>(
+                vertices, indices, vertex, brdf, static_cast<uint32_t>(spent),
+                count, modeMask, bvh, samples, roundOutputs);
+
+            spent += count;
+            ++rounds;
+
+            double errorSqr = 0;
+            for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
+            {
+                if(!outputs[m])
+                    continue;
+
+                for(int i = 0; i < SHCount; ++i)
+                {
+                    outputs[m][i] += roundSums[m][i];
+
+                    const double mean = double(roundSums[m][i]) / count;
+                    meanSums[m][i]    += mean;
+                    meanSqrSums[m][i] += mean * mean;
+
+                    // variance of the round means divided by the round count
+                    const double avg = meanSums[m][i] / rounds;
+                    errorSqr += (meanSqrSums[m][i] / rounds - avg * avg)
+                              / (std::max)(rounds - 1, 1);
+                }
+            }
+
+            if(rounds >= ADAPTIVE_MIN_ROUNDS && errorSqr <= targetError * targetError)
+                break;
+        }
+
+        return spent;
+    }
+
+    // bakes the modes in modeMask together. the first bounce rays of a
+    // vertex are traced once and shared by all of them: every sample adds
+    // to NoShadow, escaped ones add to Shadow and InterRefl, and hits
+    // continue the InterRefl paths.
+    // a positive firstPassSamples traces the samples in passes as
+    // described at computeVertexSHCoefsProgressive. the sums of the
+    // samples are kept over all passes and averaged for onPass
+    template<int L>
+    SHCoefsOfModes bakeVertexSHCoefs(
+        const SHVertex            *vertices,
+        const uint32_t            *indices,
+        int                        vertexCount,
+        float                      vertexAlbedo,
+        int                        samplesPerVertex,
+        uint32_t                   modeMask,
+        const BVH                 &bvh,
+        PathSchedule               schedule,
+        float                      targetError,
+        int                        firstPassSamples,
+        const SHCoefsPassCallback &onPass,
+        Progress                  *progress,
+        std::vector<int>          *sampleCountsOut)
+    {
+        const float brdf = vertexAlbedo / PI;
+
+        constexpr int SHCount = SH_COUNT<L>;
+
+        SHCoefsOfModes result;
+        for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
+        {
+            if(modeMask & modeBit(LightingMode(m)))
+                result[m].assign(SHCount * vertexCount, 0.0f);
+        }
+
+        auto &interReflResult = result[static_cast<int>(LightingMode::InterRefl)];
+
+        std::vector<int> sampleCounts(vertexCount, samplesPerVertex);
+
+        auto isCancelled = [&]
+        {
+            return progress && progress->isCancelled();
+        };
+
+        auto advance = [&](int64_t samples)
+        {
+            if(progress)
+                progress->advance(samples);
+        };
+
+        // divides the sums of each vertex by its sample count, or by
+        // passSamples when the bake is not adaptive
+        auto average = [&](SHCoefsOfModes &coefs, int passSamples)
+        {
+            for(auto &c : coefs)
+            {
+                if(c.empty())
+                    continue;
+                for(int vi = 0; vi < vertexCount; ++vi)
+                {
+                    const float scale =
+                        1.0f / (targetError > 0 ? sampleCounts[vi] : passSamples);
+                    for(int i = SHCount * vi; i < SHCount * (vi + 1); ++i)
+                        c[i] *= scale;
+                }
+            }
+        };
+
+        BVH_STATS(BVHTraversalStats::reset());
+
+        if(progress)
+            progress->begin(static_cast<int64_t>(vertexCount) * samplesPerVertex);
+
+        if(modeMask == modeBit(LightingMode::InterRefl) &&
+           schedule == PathSchedule::Wavefront && targetError <= 0)
+        {
+            const int batchSize =
+                (std::max)(WAVEFRONT_PATH_COUNT / samplesPerVertex, 1);
+            const int batchCount = (vertexCount + batchSize - 1) / batchSize;
+
+            TaskScheduler::getDefault().parallelFor(0, batchCount, [&](int, int bi)
+            {
+                if(isCancelled())
+                    return;
+
+                const int vertexBeg = bi * batchSize;
+                const int vertexEnd = (std::min)(vertexBeg + batchSize, vertexCount);
+
+                computeBatchSHInterRefl<L>(
+                    vertices, indices, vertexBeg, vertexEnd, brdf,
+                    samplesPerVertex, bvh, interReflResult.data());
+
+                advance(static_cast<int64_t>(vertexEnd - vertexBeg) * samplesPerVertex);
+            });
+        }
+        else
+        {
+            // pass p traces samples [passBeg, passEnd) of every vertex
+
+            int passBeg = 0;
+            int passEnd = samplesPerVertex;
+            if(firstPassSamples > 0 && targetError <= 0)
+                passEnd = (std::min)(firstPassSamples, samplesPerVertex);
+
+            for(;;)
+            {
+                TaskScheduler::getDefault().parallelFor(0, vertexCount, [&](int, int vi)
+                {
+                    if(isCancelled())
+                        return;
+
+                    const SampleStream samples = getVertexSamples(vi);
+
+                    float *outputs[LIGHTING_MODE_COUNT];
+                    for(int m = 0; m < LIGHTING_MODE_COUNT; ++m)
+                    {
+                        outputs[m] = result[m].empty() ?
+                            nullptr : &result[m][static_cast<size_t>(SHCount) * vi];
+                    }
+
+                    if(targetError > 0)
+                    {
+                        sampleCounts[vi] = traceVertexSamplesAdaptive<L>(
+                            vertices, indices, vertices[vi], brdf, samplesPerVertex,
+                            targetError, modeMask, bvh, samples, outputs);
+                    }
+                    else
+                    {
+                        traceVertexSamples<L>(
+                            vertices, indices, vertices[vi], brdf,
+                            static_cast<uint32_t>(passBeg), passEnd - passBeg,
+                            modeMask, bvh, samples, outputs);
+                    }
+
+                    advance(targetError > 0 ? samplesPerVertex : passEnd - passBeg);
+                });
+
+                if(passEnd == samplesPerVertex || isCancelled())
+                    break;
+
+                if(onPass)
+                {
+                    SHCoefsOfModes averages = result;
+                    average(averages, passEnd);
+                    onPass(averages, passEnd);
+                }
+
+                passBeg = passEnd;
+                passEnd = (std::min)(
+                    passEnd * PROGRESSIVE_PASS_GROWTH, samplesPerVertex);
+            }
+        }
+
+        if(isCancelled())
+            return {};
+
+        average(result, samplesPerVertex);
+        if(onPass)
+            onPass(result, samplesPerVertex);
+
+        if(sampleCountsOut)
+            *sampleCountsOut = std::move(sampleCounts);
+
+        BVH_STATS(BVHTraversalStats::collect().dump(stdout));
+        return result;
+    }
+
+    // first hit of a pass 0 sample that a path would continue from.
+    // coef already includes the 1 / samplesPerVertex of the estimator
+    struct GatherHit
+    {
+        int    triangle;
+        Float2 uv;
+        float  coef;
+    };
+
+    // pass 0 traces the samples of every vertex once. escaped ones give the
+    // shadowed transfer and hits are kept. pass b then sets the transfer of
+    // bounce b at a vertex to the sum over its hits of coef times the
+    // bounce b - 1 transfer interpolated at the hit, so no ray is traced
+    // after pass 0. the result is the sum of all passes
+    template<int L>
+    std::vector<float> bakeGatheredSHCoefs(
+        const SHVertex *vertices,
+        const uint32_t *indices,
+        int             vertexCount,
+        float           vertexAlbedo,
+        int             samplesPerVertex,
+        int             bounceCount,
+        const BVH      &bvh,
+        Progress       *progress)
+    {
+        const float brdf = vertexAlbedo / PI;
+        const float invSamplesPerVertex = 1.0f / samplesPerVertex;
+
+        constexpr int SHCount = SH_COUNT<L>;
+
+        std::vector<float> result(SHCount * vertexCount, 0.0f);
+        std::vector<std::vector<GatherHit>> hits(vertexCount);
+
+        auto isCancelled = [&]
+        {
+            return progress && progress->isCancelled();
+        };
 
-        for(int i = 0; i < SHCount; ++i)
-            output[i] *= invSamplesPerVertex;
+        BVH_STATS(BVHTraversalStats::reset());
 
-        if(threadIdx == 0 && vi - lastReportedVi >= reportStepSize)
+        if(progress)
+            progress->begin(static_cast<int64_t>(vertexCount) * samplesPerVertex);
+
+        TaskScheduler::getDefault().parallelFor(0, vertexCount, [&](int, int vi)
         {
-            lastReportedVi = vi;
-            pbar.set_percent(100.0f * vi / vertexCount);
-            pbar.display();
+            if(isCancelled())
+                return;
+
+            auto &vertex = vertices[vi];
+            float *output = &result[SHCount * vi];
+
+            const Float3 o = vertex.position + EPS * vertex.normal;
+            const Frame localFrame = Frame::from_z(vertex.normal);
+
+            const FirstBounceSamples sams(
+                getVertexSamples(vi), 0, samplesPerVertex);
+
+            for(int si = 0; si < samplesPerVertex; si += PACKET_SIZE)
+            {
+                const int count = (std::min)(PACKET_SIZE, samplesPerVertex - si);
+
+                RayPacket<PACKET_SIZE> packet = {};
+                float initCoefs[PACKET_SIZE];
+
+                for(int pi = 0; pi < count; ++pi)
+                {
+                    const auto [localDir, pdfDir] =
+                        agz::math::distribution::zweighted_on_hemisphere(
+                            sams.u1[si + pi], sams.u2[si + pi]);
+
+                    const Float3 d =
+                        localFrame.local_to_global(localDir).normalize();
+                    packet.set(pi, Ray(o, d));
+
+                    initCoefs[pi] =
+                        brdf * abs(cos(d, vertex.normal)) / pdfDir;
+                }
+
+                const uint32_t activeMask = (1u << count) - 1;
+
+                BVH::Intersection incts[PACKET_SIZE];
+                const uint32_t hitMask =
+                    bvh.findIntersection(packet, activeMask, incts);
+
+                float escapedCoefs[PACKET_SIZE];
+                for(int pi = 0; pi < count; ++pi)
+                {
+                    if(!((hitMask >> pi) & 1))
+                    {
+                        escapedCoefs[pi] = initCoefs[pi];
+                        continue;
+                    }
+
+                    escapedCoefs[pi] = 0;
+
+                    // hits on the back of the surface end the path
+
+                    const Float3 d = { packet.dx[pi], packet.dy[pi], packet.dz[pi] };
+                    const Float3 nor = interpolateNormal(vertices, indices, incts[pi]);
+                    if(dot(nor, d) < 0 && agz::math::is_finite(initCoefs[pi]))
+                    {
+                        hits[vi].push_back({
+                            incts[pi].triangle, incts[pi].uv,
+                            initCoefs[pi] * invSamplesPerVertex
+                        });
+                    }
+                }
+
+                computePacketSHNoShadow<L>(
+                    packet.dx, packet.dy, packet.dz,
+                    escapedCoefs, count, output);
+            }
+
+            for(int i = 0; i < SHCount; ++i)
+                output[i] *= invSamplesPerVertex;
+
+            if(progress)
+                progress->advance(samplesPerVertex);
+        });
+
+        if(isCancelled())
+            return {};
+
+        std::vector<float> lastBounce = result;
+        std::vector<float> bounce(SHCount * vertexCount);
+
+        for(int b = 1; b <= bounceCount; ++b)
+        {
+            TaskScheduler::getDefault().parallelFor(0, vertexCount, [&](int, int vi)
+            {
+                float gathered[SHCount] = {};
+                for(const GatherHit &hit : hits[vi])
+                {
+                    uint32_t corners[3];
+                    getCorners(indices, hit.triangle, corners);
+
+                    const float w0 = hit.coef * (1 - hit.uv.sum());
+                    const float w1 = hit.coef * hit.uv.x;
+                    const float w2 = hit.coef * hit.uv.y;
+
+                    const float *t0 = &lastBounce[SHCount * corners[0]];
+                    const float *t1 = &lastBounce[SHCount * corners[1]];
+                    const float *t2 = &lastBounce[SHCount * corners[2]];
+
+                    for(int i = 0; i < SHCount; ++i)
+                        gathered[i] += w0 * t0[i] + w1 * t1[i] + w2 * t2[i];
+                }
+
+                float *output = &bounce[SHCount * vi];
+                float *total  = &result[SHCount * vi];
+                for(int i = 0; i < SHCount; ++i)
+                {
+                    output[i] = gathered[i];
+                    total[i] += gathered[i];
+                }
+            });
+
+            lastBounce.swap(bounce);
         }
-    }, -1);
 
-    pbar.done();
-    return result;
+        BVH_STATS(BVHTraversalStats::collect().dump(stdout));
+        return result;
+    }
+
+} // namespace anonymous
+
+std::vector<float> computeVertexSHCoefs(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    LightingMode      mode,
+    const BVH        &bvh,
+    PathSchedule      schedule,
+    float             targetError,
+    Progress         *progress,
+    std::vector<int> *sampleCounts)
+{
+    assert(vertexCount % 3 == 0);
+    return computeVertexSHCoefs(
+        vertices, vertexCount, nullptr, vertexAlbedo, maxOrder,
+        samplesPerVertex, mode, bvh, schedule, targetError, progress,
+        sampleCounts);
+}
+
+std::vector<float> computeVertexSHCoefs(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    const uint32_t   *indices,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    LightingMode      mode,
+    const BVH        &bvh,
+    PathSchedule      schedule,
+    float             targetError,
+    Progress         *progress,
+    std::vector<int> *sampleCounts)
+{
+    assert(vertices && vertexCount > 0);
+    assert(samplesPerVertex > 0);
+    assert(mode == LightingMode::NoShadow || !bvh.empty());
+
+    auto result = dispatchSHOrder(maxOrder, [&](auto order)
+    {
+        return bakeVertexSHCoefs<decltype(order)::value>(
+            vertices, indices, vertexCount, vertexAlbedo, samplesPerVertex,
+            modeBit(mode), bvh, schedule, targetError, 0, {}, progress,
+            sampleCounts);
+    });
+
+    return std::move(result[static_cast<int>(mode)]);
+}
+
+SHCoefsOfModes computeVertexSHCoefsOfAllModes(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    const uint32_t   *indices,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    const BVH        &bvh,
+    float             targetError,
+    Progress         *progress,
+    std::vector<int> *sampleCounts)
+{
+    assert(vertices && vertexCount > 0);
+    assert(samplesPerVertex > 0);
+    assert(!bvh.empty());
+
+    return dispatchSHOrder(maxOrder, [&](auto order)
+    {
+        return bakeVertexSHCoefs<decltype(order)::value>(
+            vertices, indices, vertexCount, vertexAlbedo, samplesPerVertex,
+            ALL_LIGHTING_MODES, bvh, PathSchedule::DepthFirst, targetError,
+            0, {}, progress, sampleCounts);
+    });
+}
+
+SHCoefsOfModes computeVertexSHCoefsProgressive(
+    const SHVertex            *vertices,
+    int                        vertexCount,
+    const uint32_t            *indices,
+    float                      vertexAlbedo,
+    int                        maxOrder,
+    int                        samplesPerVertex,
+    int                        firstPassSamples,
+    uint32_t                   modeMask,
+    const BVH                 &bvh,
+    const SHCoefsPassCallback &onPass,
+    float                      targetError,
+    Progress                  *progress,
+    std::vector<int>          *sampleCounts)
+{
+    assert(vertices && vertexCount > 0);
+    assert(samplesPerVertex > 0 && firstPassSamples > 0);
+    assert(modeMask && !(modeMask & ~ALL_LIGHTING_MODES));
+    assert(modeMask == modeBit(LightingMode::NoShadow) || !bvh.empty());
+
+    return dispatchSHOrder(maxOrder, [&](auto order)
+    {
+        return bakeVertexSHCoefs<decltype(order)::value>(
+            vertices, indices, vertexCount, vertexAlbedo, samplesPerVertex,
+            modeMask, bvh, PathSchedule::DepthFirst, targetError,
+            firstPassSamples, onPass, progress, sampleCounts);
+    });
+}
+
+std::vector<float> computeVertexSHCoefsGathered(
+    const SHVertex *vertices,
+    int             vertexCount,
+    const uint32_t *indices,
+    float           vertexAlbedo,
+    int             maxOrder,
+    int             samplesPerVertex,
+    int             bounceCount,
+    const BVH      &bvh,
+    Progress       *progress)
+{
+    assert(vertices && vertexCount > 0);
+    assert(indices || vertexCount % 3 == 0);
+    assert(samplesPerVertex > 0 && bounceCount >= 0);
+    assert(!bvh.empty());
+
+    return dispatchSHOrder(maxOrder, [&](auto order)
+    {
+        return bakeGatheredSHCoefs<decltype(order)::value>(
+            vertices, indices, vertexCount, vertexAlbedo, samplesPerVertex,
+            bounceCount, bvh, progress);
+    });
 }
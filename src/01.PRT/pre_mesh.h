@@ -1,5 +1,11 @@
 #pragma once
 
+#include <array>
+#include <functional>
+
+#include <common/bvh.h>
+#include <common/progress.h>
+
 #include "common.h"
 
 struct SHVertex
@@ -8,10 +14,130 @@ struct SHVertex
     Float3 normal;
 };
 
+// transfer vectors of every lighting mode, indexed by LightingMode. modes
+// that were not baked are empty
+using SHCoefsOfModes = std::array<std::vector<float>, LIGHTING_MODE_COUNT>;
+
+inline uint32_t modeBit(LightingMode mode)
+{
+    return 1u << static_cast<int>(mode);
+}
+
+constexpr uint32_t ALL_LIGHTING_MODES = (1u << LIGHTING_MODE_COUNT) - 1;
+
+// order in which InterRefl paths are traced.
+// DepthFirst follows the paths of a vertex one at a time.
+// Wavefront advances all paths of a batch of vertices one bounce at a time
+// and traces each bounce as a ray stream sorted by origin and direction
+enum class PathSchedule
+{
+    DepthFirst,
+    Wavefront
+};
+
+// every three vertices form a triangle.
+// bvh must be built from the vertex positions unless mode is NoShadow.
+//
+// a positive targetError makes the bake adaptive: the samples of a vertex
+// are traced in rounds until the estimated standard error of its transfer
+// vector, the root of the summed variances of its coefficients, drops to
+// targetError. samplesPerVertex is then the budget per vertex. adaptive
+// bakes use the DepthFirst schedule.
+//
+// progress may be nullptr. otherwise it counts the traced samples, and
+// once it is cancelled the bake stops at the next vertex and returns
+// empty vectors. sampleCounts may be nullptr too. otherwise a completed
+// bake stores in it how many samples each vertex took, samplesPerVertex
+// for all vertices unless the bake is adaptive. both hold for all bakes
+// below that take them
+std::vector<float> computeVertexSHCoefs(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    LightingMode      mode,
+    const BVH        &bvh,
+    PathSchedule      schedule     = PathSchedule::DepthFirst,
+    float             targetError  = 0,
+    Progress         *progress     = nullptr,
+    std::vector<int> *sampleCounts = nullptr);
+
+// vertices are shared by the triangles of indices, three per triangle, and
+// each of them is baked once. bvh must be built from the vertex positions
+// and indices unless mode is NoShadow
 std::vector<float> computeVertexSHCoefs(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    const uint32_t   *indices,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    LightingMode      mode,
+    const BVH        &bvh,
+    PathSchedule      schedule     = PathSchedule::DepthFirst,
+    float             targetError  = 0,
+    Progress         *progress     = nullptr,
+    std::vector<int> *sampleCounts = nullptr);
+
+// transfer vectors of every lighting mode, indexed by LightingMode, baked
+// in one pass that traces each first bounce ray once. the total cost is
+// close to that of InterRefl alone. bvh must be built from the vertex
+// positions and indices. targetError is as in computeVertexSHCoefs and
+// applies to the transfer vectors of all modes together
+SHCoefsOfModes computeVertexSHCoefsOfAllModes(
+    const SHVertex   *vertices,
+    int               vertexCount,
+    const uint32_t   *indices,
+    float             vertexAlbedo,
+    int               maxOrder,
+    int               samplesPerVertex,
+    const BVH        &bvh,
+    float             targetError  = 0,
+    Progress         *progress     = nullptr,
+    std::vector<int> *sampleCounts = nullptr);
+
+// called after each pass of computeVertexSHCoefsProgressive with the
+// transfer vectors of the first samplesPerVertex samples
+using SHCoefsPassCallback =
+    std::function<void(const SHCoefsOfModes &coefs, int samplesPerVertex)>;
+
+// bakes the modes in modeMask like computeVertexSHCoefsOfAllModes, in
+// passes over all vertices so that a coarse result is available early.
+// pass 0 traces firstPassSamples per vertex and every later pass continues
+// the sample sequences until 4 times as many have been traced, up to
+// samplesPerVertex. onPass is called on the calling thread after every
+// pass, the last one included, whose result is returned.
+// adaptive bakes, with a positive targetError, take a single pass
+SHCoefsOfModes computeVertexSHCoefsProgressive(
+    const SHVertex            *vertices,
+    int                        vertexCount,
+    const uint32_t            *indices,
+    float                      vertexAlbedo,
+    int                        maxOrder,
+    int                        samplesPerVertex,
+    int                        firstPassSamples,
+    uint32_t                   modeMask,
+    const BVH                 &bvh,
+    const SHCoefsPassCallback &onPass,
+    float                      targetError  = 0,
+    Progress                  *progress     = nullptr,
+    std::vector<int>          *sampleCounts = nullptr);
+
+// interreflection baked in passes, in the style of Sloan's PRT. pass 0
+// bakes the shadowed transfer and keeps the first hit of every sample.
+// each of the bounceCount later passes gathers the transfer of the
+// previous one, interpolated at those hits, without tracing rays.
+// indices may be nullptr when vertices is a triangle soup. InterRefl
+// paths of computeVertexSHCoefs bounce at most 4 times. progress counts
+// the samples of pass 0 only, as the gathering passes trace no rays
+std::vector<float> computeVertexSHCoefsGathered(
     const SHVertex *vertices,
     int             vertexCount,
+    const uint32_t *indices,
     float           vertexAlbedo,
     int             maxOrder,
     int             samplesPerVertex,
-    LightingMode    mode);
+    int             bounceCount,
+    const BVH      &bvh,
+    Progress       *progress = nullptr);
@@ -40,11 +40,14 @@ void Renderer::setSH(int SHCount)
 }
 
 void Renderer::setVertices(
-    const Float3 *vertices,
-    const float  *vertexSHCoefs,
-    int           vertexCount)
+    const Float3   *vertices,
+    const float    *vertexSHCoefs,
+    int             vertexCount,
+    const uint32_t *indices,
+    int             indexCount)
 {
     vertexBuffer_.initialize(vertexCount, vertices);
+    indexBuffer_.initialize(indexCount, indices);
 
     D3D11_BUFFER_DESC SHCoefBufDesc;
     SHCoefBufDesc.ByteWidth           = sizeof(float) * vsEnvSHData_.count * vertexCount;
@@ -85,11 +88,16 @@ void Renderer::render(const Mat4 &viewProj)
     shader_.bind();
     shaderRscs_.bind();
     vertexBuffer_.bind(0);
+    indexBuffer_.bind();
     deviceContext.setInputLayout(inputLayout_);
     deviceContext.setPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
-    deviceContext->Draw(vertexBuffer_.getVertexCount(), 0);
+    // SV_VertexID is the fetched index, so it still selects the SH
+    // coefficients of the shared vertex
 
+    deviceContext->DrawIndexed(indexBuffer_.getIndexCount(), 0, 0);
+
+    indexBuffer_.unbind();
     vertexBuffer_.unbind(0);
     deviceContext.setInputLayout(nullptr);
     shaderRscs_.unbind();
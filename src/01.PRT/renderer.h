@@ -10,10 +10,13 @@ public:
 
     void setSH(int SHCount);
 
+    // indices holds three vertex indices per triangle
     void setVertices(
-        const Float3 *vertices,
-        const float  *vertexSHCoefs,
-        int           vertexCount);
+        const Float3   *vertices,
+        const float    *vertexSHCoefs,
+        int             vertexCount,
+        const uint32_t *indices,
+        int             indexCount);
 
     void setLight(const Float3 *coefs);
 
@@ -40,6 +43,7 @@ private:
 
     ComPtr<ID3D11InputLayout> inputLayout_;
     VertexBuffer<Float3>      vertexBuffer_;
+    IndexBuffer<uint32_t>     indexBuffer_;
     
     ShaderResourceViewSlot<VS> *vertexSHCoefsSlot_ = nullptr;
 
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <type_traits>
+
+#include <common/simd.h>
+
+#include "common.h"
+
+// real spherical harmonics evaluated as polynomials of the direction.
+//
+// the basis and its ordering are those of
+// agz::math::spherical_harmonics::linear_table: Y(l, m) is stored at
+// l * (l + 1) + m and no Condon-Shortley phase is applied, so coefficients
+// can still be rotated by rotate_sh_coefs.
+//
+// Y(l, 0)  = K(l, 0)            * Q(l, 0)(z)
+// Y(l, m)  = sqrt(2) * K(l, m)  * Q(l, m)(z) * Re((x + iy)^m)
+// Y(l, -m) = sqrt(2) * K(l, m)  * Q(l, m)(z) * Im((x + iy)^m)
+//
+// where Q(l, m) is the associated Legendre polynomial divided by
+// sin(theta)^m. all loop bounds are known at compile time, so each order
+// unrolls to straight-line multiply-adds
+
+template<int L>
+constexpr int SH_COUNT = (L + 1) * (L + 1);
+
+// highest order the bake and the environment projection are instantiated
+// for. rotate_sh_coefs is provided up to this order too
+constexpr int SH_MAX_ORDER = 4;
+
+// directions evaluated together by evaluateSHPacket
+constexpr int SH_PACKET_SIZE = 8;
+
+namespace sh_detail
+{
+
+    constexpr double sqrtNewton(double v)
+    {
+        if(v <= 0)
+            return 0;
+        double x = v > 1 ? v : 1;
+        for(int i = 0; i < 64; ++i)
+            x = 0.5 * (x + v / x);
+        return x;
+    }
+
+    // entries are indexed by l * (l + 1) + m with m >= 0
+    template<int L>
+    struct SHConstants
+    {
+        // normalization times (2m - 1)!!, the constant factor of Q(m, m)
+        float norm[SH_COUNT<L>] = {};
+
+        // Q(l, m) = a * z * Q(l - 1, m) - b * Q(l - 2, m)
+        float a[SH_COUNT<L>] = {};
+        float b[SH_COUNT<L>] = {};
+    };
+
+    template<int L>
+    constexpr SHConstants<L> computeSHConstants()
+    {
+        constexpr double PI_D = 3.14159265358979323846;
+
+        SHConstants<L> result;
+        for(int l = 0; l <= L; ++l)
+        {
+            for(int m = 0; m <= l; ++m)
+            {
+                // (l - m)! / (l + m)!
+                double factorialRatio = 1;
+                for(int k = l - m + 1; k <= l + m; ++k)
+                    factorialRatio /= k;
+
+                double doubleFactorial = 1;
+                for(int k = 2 * m - 1; k > 1; k -= 2)
+                    doubleFactorial *= k;
+
+                const double K = sqrtNewton((2 * l + 1) / (4 * PI_D) * factorialRatio);
+                const double scale = m ? sqrtNewton(2.0) : 1.0;
+
+                const int idx = l * (l + 1) + m;
+                result.norm[idx] = static_cast<float>(scale * K * doubleFactorial);
+
+                if(l > m)
+                {
+                    result.a[idx] = static_cast<float>(2 * l - 1) / (l - m);
+                    result.b[idx] = static_cast<float>(l + m - 1) / (l - m);
+                }
+            }
+        }
+        return result;
+    }
+
+    template<int L>
+    constexpr SHConstants<L> SH_CONSTANTS = computeSHConstants<L>();
+
+    // scalar stand-in for SIMDLanes so that both variants share one kernel
+    struct ScalarLanes
+    {
+        using T = float;
+
+        static T zero()        { return 0; }
+        static T set1(float v) { return v; }
+
+        static T add(T a, T b) { return a + b; }
+        static T sub(T a, T b) { return a - b; }
+        static T mul(T a, T b) { return a * b; }
+    };
+
+    template<int L, typename Lanes>
+    void evaluateSHLanes(
+        typename Lanes::T  x,
+        typename Lanes::T  y,
+        typename Lanes::T  z,
+        typename Lanes::T *out)
+    {
+        using T = typename Lanes::T;
+        constexpr const SHConstants<L> &C = SH_CONSTANTS<L>;
+
+        // (c, s) = (x + iy)^m
+        T c = Lanes::set1(1);
+        T s = Lanes::zero();
+
+        for(int m = 0; m <= L; ++m)
+        {
+            T q1 = Lanes::set1(1);
+            T q2 = Lanes::zero();
+
+            for(int l = m; l <= L; ++l)
+            {
+                const int idx = l * (l + 1) + m;
+
+                if(l > m)
+                {
+                    const T q = Lanes::sub(
+                        Lanes::mul(Lanes::set1(C.a[idx]), Lanes::mul(z, q1)),
+                        Lanes::mul(Lanes::set1(C.b[idx]), q2));
+                    q2 = q1;
+                    q1 = q;
+                }
+
+                const T nq = Lanes::mul(Lanes::set1(C.norm[idx]), q1);
+                if(m)
+                {
+                    out[idx]         = Lanes::mul(nq, c);
+                    out[idx - 2 * m] = Lanes::mul(nq, s);
+                }
+                else
+                    out[idx] = nq;
+            }
+
+            const T nc = Lanes::sub(Lanes::mul(x, c), Lanes::mul(y, s));
+            const T ns = Lanes::add(Lanes::mul(x, s), Lanes::mul(y, c));
+            c = nc;
+            s = ns;
+        }
+    }
+
+} // namespace sh_detail
+
+// out[l * (l + 1) + m] = Y(l, m)(d) for 0 <= l <= L. d must be normalized
+template<int L>
+void evaluateSH(const Float3 &d, float *out)
+{
+    sh_detail::evaluateSHLanes<L, sh_detail::ScalarLanes>(d.x, d.y, d.z, out);
+}
+
+// evaluates SH_PACKET_SIZE normalized directions given in SoA form.
+// x, y, z and out must be 32-byte aligned.
+// out[(l * (l + 1) + m) * SH_PACKET_SIZE + i] = Y(l, m)(direction i)
+template<int L>
+void evaluateSHPacket(const float *x, const float *y, const float *z, float *out)
+{
+    constexpr int W = SIMD_WIDTH<SH_PACKET_SIZE>;
+    using Lanes = SIMDLanes<W>;
+
+    for(int c = 0; c < SH_PACKET_SIZE; c += W)
+    {
+        typename Lanes::T values[SH_COUNT<L>];
+        sh_detail::evaluateSHLanes<L, Lanes>(
+            Lanes::load(x + c), Lanes::load(y + c), Lanes::load(z + c), values);
+
+        for(int i = 0; i < SH_COUNT<L>; ++i)
+            Lanes::store(out + i * SH_PACKET_SIZE + c, values[i]);
+    }
+}
+
+// calls func(std::integral_constant<int, L>()) with L == order
+template<int MaxL = SH_MAX_ORDER, typename Func>
+decltype(auto) dispatchSHOrder(int order, Func &&func)
+{
+    assert(0 <= order && order <= MaxL);
+    if constexpr(MaxL > 0)
+    {
+        if(order < MaxL)
+            return dispatchSHOrder<MaxL - 1>(order, std::forward<Func>(func));
+    }
+    return func(std::integral_constant<int, MaxL>());
+}
@@ -1,6 +1,5 @@
-#include <random>
-
-#include <agz-utils/thread.h>
+#include <common/sampler.h>
+#include <common/task_scheduler.h>
 
 #include "lut.h"
 
@@ -10,17 +9,6 @@ namespace
 #include "../../../asset/03/brdf.hlsl"
 #undef float3
 
-    Float2 hammersley(uint32_t i, uint32_t N)
-    {
-        uint32_t bits = (i << 16u) | (i >> 16u);
-        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
-        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
-        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
-        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
-        const float rdi = static_cast<float>(bits * 2.3283064365386963e-10);
-        return { static_cast<float>(i) / N, rdi };
-    }
-
     Float3 sampleGGX(float roughness, float u1, float u2)
     {
         float alpha = roughness * roughness;
@@ -37,7 +25,9 @@ namespace
         return wh;
     }
 
-    float computeEmiu(float nDotO, float roughness, int spp)
+    // u1 and u2 hold the spp samples shared by all texels
+    float computeEmiu(
+        float nDotO, float roughness, int spp, const float *u1, const float *u2)
     {
         const Float3 wo = Float3(
             std::sqrt((std::max)(0.0f, 1 - nDotO * nDotO)), 0, nDotO);
@@ -45,9 +35,7 @@ namespace
         float sum = 0;
         for(int i = 0; i < spp; ++i)
         {
-            const Float2 sam = hammersley(i, spp);
-
-            const Float3 wh = sampleGGX(roughness, sam.x, sam.y);
+            const Float3 wh = sampleGGX(roughness, u1[i], u2[i]);
             const Float3 wi = (2 * wh * dot(wh, wo) - wo).normalize();
             if(wi.z <= 0)
                 continue;
@@ -66,14 +54,22 @@ namespace
     {
         agz::texture::texture2d_t<float> result(res.y, res.x);
 
-        agz::thread::parallel_forrange(0, res.y,
+        // every texel integrates over the same Owen-scrambled Sobol points,
+        // so the remaining error varies smoothly over the table
+
+        std::vector<float> u1(spp), u2(spp);
+        SampleStream(SampleSequence::OwenSobol).generate2D(
+            0, spp, 0, u1.data(), u2.data());
+
+        TaskScheduler::getDefault().parallelFor(0, res.y,
             [&](int threadIdx, int y)
         {
             const float roughness = (y + 0.5f) / res.y;
             for(int x = 0; x < res.x; ++x)
             {
                 const float nDotO = (x + 0.5f) / res.x;
-                result(y, x) = computeEmiu(nDotO, roughness, spp);
+                result(y, x) = computeEmiu(
+                    nDotO, roughness, spp, u1.data(), u2.data());
             }
         });
 
@@ -33,7 +33,7 @@ void Renderer::initialize()
     shaderRscs_.getConstantBufferSlot<PS>("PSParams")
         ->setBuffer(psParams_);
 
-    const auto lut = LUTGenerator().generate({ 128, 128 }, 512);
+    const auto lut = LUTGenerator().generate({ 128, 128 }, 256);
     shaderRscs_.getShaderResourceViewSlot<PS>("EMiu")
         ->setShaderResourceView(lut.Emiu);
     shaderRscs_.getShaderResourceViewSlot<PS>("EAvg")
@@ -0,0 +1,1100 @@
+// headless BVH benchmark.
+//
+//     BVHBench [--json report.json] [mesh.obj ...]
+//
+// builds each mesh with every builder and layout, traces three standard
+// ray sets through them and prints build time, memory and any-hit/closest
+// throughput. the interreflection bake of 01.PRT is timed with both of
+// its path schedules and with transfer gathering. builds and bakes also
+// report how busy the threads of the shared TaskScheduler were. a few
+// builder regression checks run first, and a failed one makes BVHBench
+// exit with 1. --json also writes the numbers in machine-readable form
+// for tracking regressions
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+
+#include <agz-utils/mesh.h>
+
+#include <common/compressed_bvh.h>
+#include <common/scene_bvh.h>
+#include <common/task_scheduler.h>
+#include <common/wide_bvh.h>
+
+#include "pre_mesh.h"
+
+namespace
+{
+
+    struct Builder
+    {
+        const char        *name;
+        BVH::BuildSettings settings;
+    };
+
+    std::vector<Builder> createBuilders()
+    {
+        std::vector<Builder> result;
+
+        BVH::BuildSettings middle;
+        middle.splitMethod = BVH::SplitMethod::Middle;
+        result.push_back({ "middle", middle });
+
+        BVH::BuildSettings sah;
+        sah.splitMethod = BVH::SplitMethod::SAH;
+        result.push_back({ "sah", sah });
+
+        BVH::BuildSettings lbvh30;
+        lbvh30.splitMethod = BVH::SplitMethod::LBVH;
+        lbvh30.mortonBits  = 30;
+        result.push_back({ "lbvh30", lbvh30 });
+
+        BVH::BuildSettings lbvh63 = lbvh30;
+        lbvh63.mortonBits = 63;
+        result.push_back({ "lbvh63", lbvh63 });
+
+        BVH::BuildSettings lbvhTreelet = lbvh30;
+        lbvhTreelet.treeletPasses = 3;
+        result.push_back({ "lbvh30+treelet", lbvhTreelet });
+
+        BVH::BuildSettings sbvh;
+        sbvh.splitMethod = BVH::SplitMethod::SBVH;
+        result.push_back({ "sbvh", sbvh });
+
+        return result;
+    }
+
+    struct Mesh
+    {
+        std::vector<Float3> positions;
+        std::vector<Float3> normals;
+    };
+
+    Mesh loadMesh(const std::string &filename)
+    {
+        const auto triangles = agz::mesh::load_from_file(filename);
+
+        Mesh result;
+        result.positions.reserve(triangles.size() * 3);
+        result.normals.reserve(triangles.size() * 3);
+        for(auto &t : triangles)
+        {
+            for(auto &v : t.vertices)
+            {
+                result.positions.push_back(v.position);
+                result.normals.push_back(v.normal.normalize());
+            }
+        }
+
+        return result;
+    }
+
+    struct RaySet
+    {
+        const char      *name;
+        std::vector<Ray> rays;
+    };
+
+    agz::math::aabb3f computeBounds(const Mesh &mesh)
+    {
+        agz::math::aabb3f result;
+        for(auto &p : mesh.positions)
+            result |= p;
+        return result;
+    }
+
+    // coherent pinhole camera rays, row by row, from a fixed viewpoint
+    // outside the mesh looking at its center
+    std::vector<Ray> generatePrimaryRays(
+        const Mesh &mesh, int width, int height)
+    {
+        const auto bounds = computeBounds(mesh);
+        const Float3 center = 0.5f * (bounds.low + bounds.high);
+        const float radius = 0.5f * (bounds.high - bounds.low).length();
+
+        const Float3 eye =
+            center + 2.5f * radius * Float3(1, 0.6f, 1.4f).normalize();
+        const Float3 forward = (center - eye).normalize();
+        const Float3 right = cross(forward, Float3(0, 1, 0)).normalize();
+        const Float3 up = cross(right, forward);
+
+        const float tanHalfFOV = std::tan(agz::math::deg2rad(30.0f));
+        const float wOverH = static_cast<float>(width) / height;
+
+        std::vector<Ray> result;
+        result.reserve(static_cast<size_t>(width) * height);
+        for(int y = 0; y < height; ++y)
+        {
+            for(int x = 0; x < width; ++x)
+            {
+                const float ndcX = 2 * (x + 0.5f) / width - 1;
+                const float ndcY = 1 - 2 * (y + 0.5f) / height;
+                const Float3 d = forward + tanHalfFOV * (
+                    ndcX * wOverH * right + ndcY * up);
+                result.push_back(Ray(eye, d.normalize()));
+            }
+        }
+
+        return result;
+    }
+
+    // cosine-weighted hemisphere rays from mesh vertices, as in the PRT bake
+    std::vector<Ray> generateHemisphereRays(
+        const Mesh &mesh, int vertexCount, int raysPerVertex)
+    {
+        constexpr float EPS = 2e-4f;
+
+        std::minstd_rand rng(0);
+        std::uniform_real_distribution<float> uniform01;
+
+        const int meshVertexCount = static_cast<int>(mesh.positions.size());
+        const int step = (std::max)(meshVertexCount / vertexCount, 1);
+
+        std::vector<Ray> result;
+        for(int vi = 0; vi < meshVertexCount; vi += step)
+        {
+            const Float3 &nor = mesh.normals[vi];
+            const Float3 o = mesh.positions[vi] + EPS * nor;
+            const auto frame = agz::math::tcoord3<float>::from_z(nor);
+
+            for(int i = 0; i < raysPerVertex; ++i)
+            {
+                const float u1 = uniform01(rng), u2 = uniform01(rng);
+                const auto localDir =
+                    agz::math::distribution::zweighted_on_hemisphere(u1, u2).first;
+                result.push_back(
+                    Ray(o, frame.local_to_global(localDir).normalize()));
+            }
+        }
+
+        return result;
+    }
+
+    // uniformly distributed directions from random points of the slightly
+    // enlarged mesh bounding box
+    std::vector<Ray> generateIncoherentRays(const Mesh &mesh, int rayCount)
+    {
+        const auto bounds = computeBounds(mesh);
+        const Float3 margin = 0.05f * (bounds.high - bounds.low);
+        const Float3 low = bounds.low - margin;
+        const Float3 extent = bounds.high + margin - low;
+
+        std::minstd_rand rng(1);
+        std::uniform_real_distribution<float> uniform01;
+
+        std::vector<Ray> result;
+        result.reserve(rayCount);
+        for(int i = 0; i < rayCount; ++i)
+        {
+            const Float3 o = low + Float3(
+                uniform01(rng), uniform01(rng), uniform01(rng)) * extent;
+
+            const float u1 = uniform01(rng), u2 = uniform01(rng);
+            const auto dir =
+                agz::math::distribution::uniform_on_sphere(u1, u2).first;
+
+            result.push_back(Ray(o, dir));
+        }
+
+        return result;
+    }
+
+    // binary BVH traced with a fixed leaf triangle kernel and traversal mode
+    template<
+        BVH::TriangleKernel K,
+        BVH::TraversalMode  T = BVH::TraversalMode::Stack>
+    struct KernelView
+    {
+        const BVH &bvh;
+
+        bool hasIntersection(const Ray &r) const
+        {
+            return bvh.hasIntersection<K, T>(r);
+        }
+
+        bool findIntersection(const Ray &r, BVH::Intersection *inct) const
+        {
+            return bvh.findIntersection<K, T>(r, inct);
+        }
+
+        size_t getMemoryUsage() const
+        {
+            return bvh.getMemoryUsage();
+        }
+    };
+
+    // minimal wall time over several runs, in milliseconds
+    template<typename Func>
+    double measure(int repeat, const Func &func)
+    {
+        double result = std::numeric_limits<double>::infinity();
+        for(int i = 0; i < repeat; ++i)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            func();
+            const auto end = std::chrono::steady_clock::now();
+
+            result = (std::min)(
+                result,
+                std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        return result;
+    }
+
+    // share of the thread time of the shared scheduler spent in loop
+    // bodies during one run
+    template<typename Func>
+    double measureUtilization(const Func &func)
+    {
+        auto &scheduler = TaskScheduler::getDefault();
+        scheduler.resetStatistics();
+
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        const auto end = std::chrono::steady_clock::now();
+
+        const double seconds = std::chrono::duration<double>(end - start).count();
+        return scheduler.getStatistics().busySeconds /
+               (seconds * scheduler.getThreadCount());
+    }
+
+    // Mray/s of each query over one ray set. negative when the layout
+    // does not support the query
+    struct Throughput
+    {
+        double anyHit  = 0;
+        double closest = 0;
+    };
+
+    template<typename Accel>
+    Throughput measureThroughput(
+        int repeat, const Accel &accel, const std::vector<Ray> &rays)
+    {
+        int anyHitCount = 0, closestHitCount = 0;
+
+        const double anyMs = measure(repeat, [&]
+        {
+            anyHitCount = 0;
+            for(auto &r : rays)
+                anyHitCount += accel.hasIntersection(r);
+        });
+
+        const double closestMs = measure(repeat, [&]
+        {
+            closestHitCount = 0;
+            BVH::Intersection inct;
+            for(auto &r : rays)
+                closestHitCount += accel.findIntersection(r, &inct);
+        });
+
+        assert(anyHitCount == closestHitCount);
+
+        const double rayCount = static_cast<double>(rays.size());
+        return { rayCount / anyMs * 1e-3, rayCount / closestMs * 1e-3 };
+    }
+
+    // the same rays traced through the packet stream API
+    Throughput measureStreamThroughput(
+        int repeat, const BVH &bvh, const std::vector<Ray> &rays)
+    {
+        const int count = static_cast<int>(rays.size());
+        std::vector<uint32_t> hitMask((count + 31) / 32);
+        std::vector<BVH::Intersection> incts(count);
+
+        const double anyMs = measure(repeat, [&]
+        {
+            bvh.hasIntersection(rays.data(), count, hitMask.data());
+        });
+
+        const double closestMs = measure(repeat, [&]
+        {
+            bvh.findIntersection(
+                rays.data(), count, hitMask.data(), incts.data());
+        });
+
+        return { count / anyMs * 1e-3, count / closestMs * 1e-3 };
+    }
+
+    // consecutive rays sharing an origin traced as occlusion batches.
+    // sets without shared origins degenerate into batches of one ray
+    Throughput measureOcclusionThroughput(
+        int repeat, const BVH &bvh, const std::vector<Ray> &rays)
+    {
+        constexpr size_t MAX_BATCH_SIZE = 1024;
+
+        struct Batch
+        {
+            size_t beg;
+            size_t end;
+        };
+
+        std::vector<Batch> batches;
+        for(size_t beg = 0, end; beg < rays.size(); beg = end)
+        {
+            const Ray &first = rays[beg];
+            for(end = beg + 1; end < rays.size() &&
+                               end - beg < MAX_BATCH_SIZE; ++end)
+            {
+                const Ray &r = rays[end];
+                if(r.o.x != first.o.x || r.o.y != first.o.y ||
+                   r.o.z != first.o.z ||
+                   r.t0 != first.t0 || r.t1 != first.t1)
+                    break;
+            }
+            batches.push_back({ beg, end });
+        }
+
+        std::vector<Float3> directions(rays.size());
+        for(size_t i = 0; i < rays.size(); ++i)
+            directions[i] = rays[i].d;
+
+        const double anyMs = measure(repeat, [&]
+        {
+            for(auto &batch : batches)
+            {
+                const Ray &first = rays[batch.beg];
+                bvh.computeVisibility(
+                    first.o, &directions[batch.beg],
+                    static_cast<int>(batch.end - batch.beg),
+                    first.t0, first.t1, nullptr);
+            }
+        });
+
+        return { static_cast<double>(rays.size()) / anyMs * 1e-3, -1 };
+    }
+
+    struct BuilderResult
+    {
+        std::string             name;
+        double                  buildMs;
+        double                  buildUtilization;
+        float                   sahCost;
+        int                     nodeCount;
+        int                     referenceCount;
+        size_t                  memoryUsage;
+        std::vector<Throughput> throughput; // per ray set
+    };
+
+    struct LayoutResult
+    {
+        std::string             name;
+        size_t                  memoryUsage;
+        std::vector<Throughput> throughput; // per ray set
+    };
+
+    struct MeshResult
+    {
+        std::string                filename;
+        int                        triangleCount;
+        std::vector<RaySet>        raySets;
+        std::vector<BuilderResult> builders;
+        std::vector<LayoutResult>  layouts;
+    };
+
+    struct SceneResult
+    {
+        std::string filename;
+        int         instanceCount;
+        double      topLevelBuildMs;
+        double      bottomRefitMs;
+        double      bottomRebuildMs;
+        size_t      twoLevelMemoryUsage;
+        size_t      flattenedMemoryUsage;
+    };
+
+    struct BakeResult
+    {
+        std::string filename;
+        int         samplesPerVertex;
+        double      depthFirstMs;
+        double      wavefrontMs;
+        double      gatherMs;
+        double      depthFirstUtilization;
+        double      wavefrontUtilization;
+        double      gatherUtilization;
+    };
+
+    // streaming writer for the small subset of JSON used by the report
+    class JsonWriter
+    {
+    public:
+
+        explicit JsonWriter(FILE *file)
+            : file_(file)
+        {
+
+        }
+
+        void beginObject(const char *key = nullptr)
+        {
+            writeKey(key);
+            std::fputc('{', file_);
+            first_.push_back(true);
+        }
+
+        void endObject()
+        {
+            close('}');
+        }
+
+        void beginArray(const char *key = nullptr)
+        {
+            writeKey(key);
+            std::fputc('[', file_);
+            first_.push_back(true);
+        }
+
+        void endArray()
+        {
+            close(']');
+        }
+
+        void write(const char *key, double value)
+        {
+            writeKey(key);
+            std::fprintf(file_, "%.6g", value);
+        }
+
+        void write(const char *key, long long value)
+        {
+            writeKey(key);
+            std::fprintf(file_, "%lld", value);
+        }
+
+        void write(const char *key, const std::string &value)
+        {
+            writeKey(key);
+            std::fputc('"', file_);
+            for(char c : value)
+            {
+                if(c == '"' || c == '\\')
+                    std::fputc('\\', file_);
+                std::fputc(c, file_);
+            }
+            std::fputc('"', file_);
+        }
+
+    private:
+
+        void writeKey(const char *key)
+        {
+            if(!first_.empty())
+            {
+                if(!first_.back())
+                    std::fputc(',', file_);
+                first_.back() = false;
+            }
+
+            newLine();
+            if(key)
+                std::fprintf(file_, "\"%s\": ", key);
+        }
+
+        void close(char bracket)
+        {
+            const bool empty = first_.back();
+            first_.pop_back();
+            if(!empty)
+                newLine();
+            std::fputc(bracket, file_);
+        }
+
+        void newLine()
+        {
+            if(first_.empty())
+                return;
+            std::fputc('\n', file_);
+            for(size_t i = 0; i < first_.size(); ++i)
+                std::fputs("  ", file_);
+        }
+
+        FILE             *file_;
+        std::vector<bool> first_;
+    };
+
+    void writeThroughput(
+        JsonWriter                    &json,
+        const std::vector<RaySet>     &raySets,
+        const std::vector<Throughput> &throughput)
+    {
+        json.beginObject("throughput");
+        for(size_t i = 0; i < raySets.size(); ++i)
+        {
+            json.beginObject(raySets[i].name);
+            json.write("anyHitMrays", throughput[i].anyHit);
+            if(throughput[i].closest >= 0)
+                json.write("closestHitMrays", throughput[i].closest);
+            json.endObject();
+        }
+        json.endObject();
+    }
+
+    bool writeReport(
+        const std::string             &filename,
+        const std::vector<MeshResult> &meshes,
+        const SceneResult             *scene,
+        const BakeResult              *bake)
+    {
+        FILE *file = std::fopen(filename.c_str(), "w");
+        if(!file)
+            return false;
+
+        JsonWriter json(file);
+        json.beginObject();
+
+        json.beginArray("meshes");
+        for(auto &mesh : meshes)
+        {
+            json.beginObject();
+            json.write("file", mesh.filename);
+            json.write("triangles", static_cast<long long>(mesh.triangleCount));
+
+            json.beginObject("rays");
+            for(auto &raySet : mesh.raySets)
+            {
+                json.write(
+                    raySet.name, static_cast<long long>(raySet.rays.size()));
+            }
+            json.endObject();
+
+            json.beginArray("builders");
+            for(auto &builder : mesh.builders)
+            {
+                json.beginObject();
+                json.write("name", builder.name);
+                json.write("buildMs", builder.buildMs);
+                json.write("buildUtilization", builder.buildUtilization);
+                json.write("sahCost", builder.sahCost);
+                json.write("nodes", static_cast<long long>(builder.nodeCount));
+                json.write(
+                    "references", static_cast<long long>(builder.referenceCount));
+                json.write(
+                    "memoryBytes", static_cast<long long>(builder.memoryUsage));
+                writeThroughput(json, mesh.raySets, builder.throughput);
+                json.endObject();
+            }
+            json.endArray();
+
+            json.beginArray("layouts");
+            for(auto &layout : mesh.layouts)
+            {
+                json.beginObject();
+                json.write("name", layout.name);
+                json.write(
+                    "memoryBytes", static_cast<long long>(layout.memoryUsage));
+                writeThroughput(json, mesh.raySets, layout.throughput);
+                json.endObject();
+            }
+            json.endArray();
+
+            json.endObject();
+        }
+        json.endArray();
+
+        if(scene)
+        {
+            json.beginObject("scene");
+            json.write("file", scene->filename);
+            json.write("instances", static_cast<long long>(scene->instanceCount));
+            json.write("topLevelBuildMs", scene->topLevelBuildMs);
+            json.write("bottomRefitMs", scene->bottomRefitMs);
+            json.write("bottomRebuildMs", scene->bottomRebuildMs);
+            json.write(
+                "twoLevelMemoryBytes",
+                static_cast<long long>(scene->twoLevelMemoryUsage));
+            json.write(
+                "flattenedMemoryBytes",
+                static_cast<long long>(scene->flattenedMemoryUsage));
+            json.endObject();
+        }
+
+        if(bake)
+        {
+            json.beginObject("bake");
+            json.write("file", bake->filename);
+            json.write(
+                "samplesPerVertex", static_cast<long long>(bake->samplesPerVertex));
+            json.write("depthFirstMs", bake->depthFirstMs);
+            json.write("wavefrontMs", bake->wavefrontMs);
+            json.write("gatherMs", bake->gatherMs);
+            json.write("depthFirstUtilization", bake->depthFirstUtilization);
+            json.write("wavefrontUtilization", bake->wavefrontUtilization);
+            json.write("gatherUtilization", bake->gatherUtilization);
+            json.endObject();
+        }
+
+        json.endObject();
+        std::fputc('\n', file);
+
+        return std::fclose(file) == 0;
+    }
+
+    void printThroughputHeader(const std::vector<RaySet> &raySets)
+    {
+        std::printf("    %-18s", "any/closest Mray/s");
+        for(auto &raySet : raySets)
+            std::printf(" %17s", raySet.name);
+        std::printf("\n");
+    }
+
+    void printThroughputRow(
+        const std::string &name, const std::vector<Throughput> &throughput)
+    {
+        std::printf("    %-18s", name.c_str());
+        for(auto &t : throughput)
+        {
+            if(t.closest >= 0)
+                std::printf(" %8.3f/%8.3f", t.anyHit, t.closest);
+            else
+                std::printf(" %8.3f/%8s", t.anyHit, "-");
+        }
+        std::printf("\n");
+    }
+
+    // regression checks of builder decisions that throughput and SAH cost
+    // alone would not reveal. run before the benchmarks
+
+    // a staircase of long diagonal slivers overlaps under any object split,
+    // and a small triangle beyond a gap leaves spatial bins empty along x.
+    // the root is expected to split the slivers spatially, so that some of
+    // them are referenced under both of its children
+    bool checkSpatialSplitAcrossGap()
+    {
+        constexpr int SLIVER_COUNT = 64;
+
+        std::vector<Float3> vertices;
+        for(int i = 0; i < SLIVER_COUNT; ++i)
+        {
+            const float b = 0.05f * i;
+            const float z = 0.01f * (i % 4);
+            vertices.push_back({ b, b, z });
+            vertices.push_back({ b + 4, b + 4, z });
+            vertices.push_back({ b + 4, b + 4.05f, z + 0.01f });
+        }
+
+        vertices.push_back({ 10, 10, 0 });
+        vertices.push_back({ 10.1f, 10, 0 });
+        vertices.push_back({ 10.1f, 10.1f, 0 });
+
+        BVH::BuildSettings settings;
+        settings.splitMethod = BVH::SplitMethod::SBVH;
+
+        const BVH bvh = BVH::create(
+            vertices.data(), static_cast<int>(vertices.size() / 3), settings);
+        const auto nodes = bvh.getNodes();
+        const auto triangles = bvh.getTriangles();
+        if(nodes.empty() || nodes[0].isLeaf())
+            return false;
+
+        // children follow their parent, so the left subtree of the root
+        // is [1, rightChild)
+
+        std::vector<int> sides(vertices.size() / 3);
+        for(uint32_t i = 1; i < nodes.size(); ++i)
+        {
+            if(!nodes[i].isLeaf())
+                continue;
+
+            const int side = i < nodes[0].rightChild ? 1 : 2;
+            for(uint32_t j = nodes[i].triBeg; j < nodes[i].triEnd; ++j)
+                sides[triangles[j].index] |= side;
+        }
+
+        return std::find(sides.begin(), sides.end(), 3) != sides.end();
+    }
+
+    // BVH cache files are keyed without the thread count, so every builder
+    // must produce the same tree for any thread count. treelet passes of
+    // LBVH alternate between subtrees and top levels, which is where the
+    // parallel build used to diverge
+    bool checkThreadCountIndependence()
+    {
+        constexpr int TRIANGLE_COUNT = 5000;
+
+        std::mt19937 rng(3);
+        std::uniform_real_distribution<float> dis(0, 1);
+
+        std::vector<Float3> vertices;
+        for(int i = 0; i < TRIANGLE_COUNT; ++i)
+        {
+            const Float3 center(10 * dis(rng), 10 * dis(rng), 10 * dis(rng));
+            for(int j = 0; j < 3; ++j)
+            {
+                vertices.push_back(center + 0.3f * Float3(
+                    dis(rng) - 0.5f, dis(rng) - 0.5f, dis(rng) - 0.5f));
+            }
+        }
+
+        auto builders = createBuilders();
+        BVH::BuildSettings lbvhTreelets;
+        lbvhTreelets.splitMethod   = BVH::SplitMethod::LBVH;
+        lbvhTreelets.treeletPasses = 2;
+        builders.push_back({ "lbvh30+2 treelet passes", lbvhTreelets });
+
+        for(auto &builder : builders)
+        {
+            BVH::BuildSettings settings = builder.settings;
+            settings.threadCount = 1;
+            const BVH serial = BVH::create(
+                vertices.data(), TRIANGLE_COUNT, settings);
+
+            for(int threadCount : { 2, 4, 8 })
+            {
+                settings.threadCount = threadCount;
+                const BVH parallel = BVH::create(
+                    vertices.data(), TRIANGLE_COUNT, settings);
+
+                const auto a = serial.getNodes(), b = parallel.getNodes();
+                const auto c = serial.getTriangles(), d = parallel.getTriangles();
+                if(a.size() != b.size() || c.size() != d.size() ||
+                   std::memcmp(a.data(), b.data(), a.size_bytes()) ||
+                   std::memcmp(c.data(), d.data(), c.size_bytes()))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool runChecks()
+    {
+        struct Check
+        {
+            const char *name;
+            bool      (*run)();
+        };
+
+        const Check checks[] = {
+            { "sbvh spatial split across empty bins", checkSpatialSplitAcrossGap },
+            { "builds independent of thread count",   checkThreadCountIndependence }
+        };
+
+        bool result = true;
+        for(auto &check : checks)
+        {
+            const bool passed = check.run();
+            std::printf("check: %s: %s\n", check.name, passed ? "ok" : "FAILED");
+            result &= passed;
+        }
+        return result;
+    }
+
+} // namespace anonymous
+
+int main(int argc, char *argv[])
+{
+    std::string jsonFilename;
+    std::vector<std::string> meshFilenames;
+    for(int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if(arg == "--json" && i + 1 < argc)
+            jsonFilename = argv[++i];
+        else
+            meshFilenames.push_back(arg);
+    }
+
+    if(meshFilenames.empty())
+    {
+        meshFilenames = {
+            "./asset/202.obj",
+            "./asset/torus.obj",
+            "./asset/cylinder.obj",
+            "./asset/corner.obj"
+        };
+    }
+
+    if(!runChecks())
+        return 1;
+
+    constexpr int REPEAT = 3;
+
+    const auto builders = createBuilders();
+
+    std::vector<MeshResult> meshResults;
+
+    for(auto &filename : meshFilenames)
+    {
+        const auto mesh = loadMesh(filename);
+        const auto &vertices = mesh.positions;
+        const int triangleCount = static_cast<int>(vertices.size() / 3);
+
+        MeshResult &meshResult = meshResults.emplace_back();
+        meshResult.filename      = filename;
+        meshResult.triangleCount = triangleCount;
+
+        auto &raySets = meshResult.raySets;
+        raySets.push_back({ "primary",    generatePrimaryRays(mesh, 512, 512) });
+        raySets.push_back({ "hemisphere", generateHemisphereRays(mesh, 4096, 64) });
+        raySets.push_back({ "incoherent", generateIncoherentRays(mesh, 1 << 18) });
+
+        std::printf("%s: %d triangles\n", filename.c_str(), triangleCount);
+
+        // spatial splits trade build time and duplicated references
+        // for tighter bounds, so builders are compared by throughput too
+
+        std::printf(
+            "    %-18s %12s %8s %12s %10s %10s %10s\n",
+            "builder", "build (ms)", "busy", "SAH cost", "nodes", "refs/tri",
+            "bytes/tri");
+
+        for(auto &builder : builders)
+        {
+            BVH bvh;
+            auto build = [&]
+            {
+                bvh = BVH::create(
+                    vertices.data(), triangleCount, builder.settings);
+            };
+            const double ms = measure(REPEAT, build);
+
+            BuilderResult &result = meshResult.builders.emplace_back();
+            result.name             = builder.name;
+            result.buildMs          = ms;
+            result.buildUtilization = measureUtilization(build);
+            result.sahCost          = bvh.computeSAHCost();
+            result.nodeCount        = bvh.getNodeCount();
+            result.referenceCount   = bvh.getTriangleCount();
+            result.memoryUsage      = bvh.getMemoryUsage();
+
+            for(auto &raySet : raySets)
+            {
+                result.throughput.push_back(
+                    measureThroughput(REPEAT, bvh, raySet.rays));
+            }
+
+            std::printf(
+                "    %-18s %12.3f %7.1f%% %12.3f %10d %10.3f %10.2f\n",
+                builder.name, ms, 100 * result.buildUtilization,
+                result.sahCost, result.nodeCount,
+                static_cast<double>(result.referenceCount) / triangleCount,
+                static_cast<double>(result.memoryUsage) / triangleCount);
+        }
+
+        printThroughputHeader(raySets);
+        for(auto &result : meshResult.builders)
+            printThroughputRow(result.name, result.throughput);
+
+        // layouts of the default build
+
+        const BVH bvh = BVH::create(vertices.data(), triangleCount);
+        const BVH4 bvh4 = BVH4::create(bvh);
+        const BVH8 bvh8 = BVH8::create(bvh);
+
+        const CompressedBVH qbvh = CompressedBVH::create(bvh);
+        const CompressedBVH qbvhIndexed =
+            CompressedBVH::create(bvh, vertices.data());
+
+        auto runLayout = [&](const char *name, const auto &accel)
+        {
+            LayoutResult &result = meshResult.layouts.emplace_back();
+            result.name        = name;
+            result.memoryUsage = accel.getMemoryUsage();
+            for(auto &raySet : raySets)
+            {
+                result.throughput.push_back(
+                    measureThroughput(REPEAT, accel, raySet.rays));
+            }
+        };
+
+        runLayout(
+            "binary-scalar",
+            KernelView<BVH::TriangleKernel::Scalar>{ bvh });
+        runLayout(
+            "binary-simd",
+            KernelView<BVH::TriangleKernel::SIMD>{ bvh });
+        runLayout(
+            "binary-watertight",
+            KernelView<BVH::TriangleKernel::Watertight>{ bvh });
+        runLayout(
+            "binary-stackless",
+            KernelView<
+                BVH::TriangleKernel::SIMD,
+                BVH::TraversalMode::Stackless>{ bvh });
+        runLayout("bvh4", bvh4);
+        runLayout("bvh8", bvh8);
+        runLayout("quantized", qbvh);
+        runLayout("quantized-index", qbvhIndexed);
+
+        {
+            LayoutResult &result = meshResult.layouts.emplace_back();
+            result.name        = "binary-stream";
+            result.memoryUsage = bvh.getMemoryUsage();
+            for(auto &raySet : raySets)
+            {
+                result.throughput.push_back(
+                    measureStreamThroughput(REPEAT, bvh, raySet.rays));
+            }
+        }
+
+        {
+            LayoutResult &result = meshResult.layouts.emplace_back();
+            result.name        = "binary-occlusion";
+            result.memoryUsage = bvh.getMemoryUsage();
+            for(auto &raySet : raySets)
+            {
+                result.throughput.push_back(
+                    measureOcclusionThroughput(REPEAT, bvh, raySet.rays));
+            }
+        }
+
+        std::printf("    %-18s %10s\n", "layout", "bytes/tri");
+        for(auto &result : meshResult.layouts)
+        {
+            std::printf(
+                "    %-18s %10.2f\n", result.name.c_str(),
+                static_cast<double>(result.memoryUsage) / triangleCount);
+        }
+
+        printThroughputHeader(raySets);
+        for(auto &result : meshResult.layouts)
+            printThroughputRow(result.name, result.throughput);
+    }
+
+    // two-level scene with the torus instances of 03.KC: one shared bottom
+    // level, a top level rebuilt per frame and a refit of the bottom level
+
+    SceneResult sceneResult;
+    bool hasScene = false;
+
+    const std::string sceneMeshFilename = "./asset/torus.obj";
+    if(std::filesystem::exists(sceneMeshFilename))
+    {
+        const auto sceneMesh = loadMesh(sceneMeshFilename);
+        const int sceneTriangleCount =
+            static_cast<int>(sceneMesh.positions.size() / 3);
+
+        auto bottom = std::make_shared<BVH>(
+            BVH::create(sceneMesh.positions.data(), sceneTriangleCount));
+
+        constexpr int INSTANCE_COUNT = 7;
+
+        SceneBVH scene;
+        const Mat4 rot = Trans4::rotate_z(agz::math::PI_f / 2);
+        for(int i = 0; i < INSTANCE_COUNT; ++i)
+        {
+            const float t = i / (INSTANCE_COUNT - 1.0f);
+            const float z = agz::math::lerp(-10.0f, 10.0f, t);
+            scene.addInstance(bottom, rot * Trans4::translate(0, 0, z));
+        }
+
+        sceneResult.filename      = sceneMeshFilename;
+        sceneResult.instanceCount = INSTANCE_COUNT;
+
+        sceneResult.topLevelBuildMs = measure(REPEAT, [&] { scene.build(); });
+
+        sceneResult.bottomRefitMs = measure(REPEAT, [&]
+        {
+            bottom->refit(sceneMesh.positions.data());
+        });
+
+        sceneResult.bottomRebuildMs = measure(REPEAT, [&]
+        {
+            *bottom = BVH::create(
+                sceneMesh.positions.data(), sceneTriangleCount);
+        });
+
+        scene.build();
+
+        sceneResult.twoLevelMemoryUsage  = scene.getMemoryUsage();
+        sceneResult.flattenedMemoryUsage =
+            INSTANCE_COUNT * bottom->getMemoryUsage();
+        hasScene = true;
+
+        std::printf(
+            "scene: %d instances of %s\n",
+            INSTANCE_COUNT, sceneMeshFilename.c_str());
+        std::printf(
+            "    top level build %.3f ms, bottom refit %.3f ms, "
+            "bottom rebuild %.3f ms\n", sceneResult.topLevelBuildMs,
+            sceneResult.bottomRefitMs, sceneResult.bottomRebuildMs);
+        std::printf(
+            "    two-level %zu bytes, flattened copies %zu bytes\n",
+            sceneResult.twoLevelMemoryUsage,
+            sceneResult.flattenedMemoryUsage);
+    }
+
+    // interreflection bake of the 01.PRT mesh, traced depth-first per path,
+    // as sorted wavefronts and gathered from first hits
+
+    BakeResult bakeResult;
+    bool hasBake = false;
+
+    const std::string bakeMeshFilename = "./asset/202.obj";
+    if(std::filesystem::exists(bakeMeshFilename))
+    {
+        constexpr int BAKE_SAMPLES_PER_VERTEX = 64;
+        constexpr float BAKE_ALBEDO = 0.8f;
+        constexpr int BAKE_SH_ORDER = 4;
+        constexpr int BAKE_BOUNCE_COUNT = 4;
+
+        const auto bakeMesh = loadMesh(bakeMeshFilename);
+        const int bakeVertexCount = static_cast<int>(bakeMesh.positions.size());
+
+        std::vector<SHVertex> vertices(bakeVertexCount);
+        for(int i = 0; i < bakeVertexCount; ++i)
+            vertices[i] = { bakeMesh.positions[i], bakeMesh.normals[i] };
+
+        const BVH bvh = BVH::create(
+            bakeMesh.positions.data(), bakeVertexCount / 3);
+
+        auto bake = [&](PathSchedule schedule, double &utilization)
+        {
+            auto run = [&]
+            {
+                computeVertexSHCoefs(
+                    vertices.data(), bakeVertexCount, BAKE_ALBEDO,
+                    BAKE_SH_ORDER, BAKE_SAMPLES_PER_VERTEX,
+                    LightingMode::InterRefl, bvh, schedule);
+            };
+            utilization = measureUtilization(run);
+            return measure(REPEAT, run);
+        };
+
+        auto gather = [&]
+        {
+            computeVertexSHCoefsGathered(
+                vertices.data(), bakeVertexCount, nullptr, BAKE_ALBEDO,
+                BAKE_SH_ORDER, BAKE_SAMPLES_PER_VERTEX, BAKE_BOUNCE_COUNT, bvh);
+        };
+
+        std::printf(
+            "bake: interreflection of %s, %d samples per vertex\n",
+            bakeMeshFilename.c_str(), BAKE_SAMPLES_PER_VERTEX);
+
+        bakeResult.filename         = bakeMeshFilename;
+        bakeResult.samplesPerVertex = BAKE_SAMPLES_PER_VERTEX;
+        bakeResult.depthFirstMs = bake(
+            PathSchedule::DepthFirst, bakeResult.depthFirstUtilization);
+        bakeResult.wavefrontMs = bake(
+            PathSchedule::Wavefront, bakeResult.wavefrontUtilization);
+        bakeResult.gatherUtilization = measureUtilization(gather);
+        bakeResult.gatherMs          = measure(REPEAT, gather);
+        hasBake = true;
+
+        std::printf(
+            "    depth-first %.1f ms, wavefront %.1f ms, gather %.1f ms\n",
+            bakeResult.depthFirstMs, bakeResult.wavefrontMs,
+            bakeResult.gatherMs);
+        std::printf(
+            "    busy %.1f%%, %.1f%%, %.1f%% of %d scheduler threads\n",
+            100 * bakeResult.depthFirstUtilization,
+            100 * bakeResult.wavefrontUtilization,
+            100 * bakeResult.gatherUtilization,
+            TaskScheduler::getDefault().getThreadCount());
+    }
+
+    if(!jsonFilename.empty() &&
+       !writeReport(
+           jsonFilename, meshResults,
+           hasScene ? &sceneResult : nullptr, hasBake ? &bakeResult : nullptr))
+    {
+        std::fprintf(stderr, "failed to write %s\n", jsonFilename.c_str());
+        return 1;
+    }
+}
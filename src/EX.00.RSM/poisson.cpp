@@ -1,7 +1,7 @@
 #include <cyPoint.h>
 #include <cySampleElim.h>
 
-#include <random>
+#include <common/sampler.h>
 
 #include "./poisson.h"
 
@@ -10,19 +10,17 @@
 ComPtr<ID3D11ShaderResourceView> createPoissionDiskSamplesSRV(
     int sampleCount, float radius)
 {
-    std::default_random_engine rng{ std::random_device{}() };
-    std::uniform_real_distribution<float> dis(0, 1);
+    // candidates come from a fixed stream, so the kernel is the same in
+    // every run
+
+    const int candidateCount = 4 * sampleCount;
+    std::vector<float> x(candidateCount), y(candidateCount);
+    SampleStream(SampleSequence::Random).generate2D(
+        0, candidateCount, 0, x.data(), y.data());
 
     std::vector<cy::Point2f> candidateSamples;
-    for(int i = 0; i < sampleCount; ++i)
-    {
-        for(int j = 0; j < 4; ++j)
-        {
-            const float x = dis(rng);
-            const float y = dis(rng);
-            candidateSamples.push_back({ x, y });
-        }
-    }
+    for(int i = 0; i < candidateCount; ++i)
+        candidateSamples.push_back({ x[i], y[i] });
 
     std::vector<cy::Point2f> resultSamples(sampleCount);
 
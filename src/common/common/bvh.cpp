@@ -1,9 +1,15 @@
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <queue>
 #include <stack>
 
 #include <agz-utils/alloc.h>
 
 #include <common/bvh.h>
+#include <common/bvh_stats.h>
+#include <common/task_scheduler.h>
+#include <common/triangle.h>
 
 namespace
 {
@@ -11,6 +17,9 @@ namespace
     using Arena = agz::alloc::obj_arena_t;
     using AABB  = agz::math::aabb3f;
 
+    // ranges smaller than this are never split across threads
+    constexpr int PARALLEL_BUILD_GRAIN = 4096;
+
     struct BuildNode
     {
         AABB       aabb;
@@ -18,11 +27,29 @@ namespace
         BuildNode *right  = nullptr;
         uint32_t   triBeg = 0;
         uint32_t   triEnd = 0;
+
+        // SAH cost of the subtree, only maintained by treelet optimization
+        float cost = 0;
+    };
+
+    // corners of the input triangles: three consecutive vertices per
+    // triangle, or three indices per triangle into the vertex array
+    struct TriangleSource
+    {
+        const Float3   *vertices;
+        const uint32_t *indices;
+
+        const Float3 &get(int triangle, int corner) const
+        {
+            const size_t i = 3 * static_cast<size_t>(triangle) + corner;
+            return vertices[indices ? indices[i] : i];
+        }
     };
 
+    // vertices are read from the TriangleSource through index when needed
     struct BuildTriangle
     {
-        Float3 vertices[3];
+        AABB   bounds;
         Float3 centroid;
         int    index;
     };
@@ -33,391 +60,2244 @@ namespace
         int        node_count;
     };
 
-    BuildResult buildLinkedBVH(
+    float surfaceArea(const AABB &aabb)
+    {
+        const Float3 d = aabb.high - aabb.low;
+        if(d.x < 0 || d.y < 0 || d.z < 0)
+            return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    void unionAABB(AABB &dst, const AABB &src)
+    {
+        dst |= src.low;
+        dst |= src.high;
+    }
+
+    int partitionMiddle(
         BuildTriangle *triangles,
-        int            triangleCount,
-        int            leafSizeThreshold,
-        Arena         &arena)
+        int            triBeg,
+        int            triEnd,
+        const AABB    &centroidBound)
     {
-        struct BuildTask
+        const auto centroidDelta =
+            centroidBound.high - centroidBound.low;
+        const int splitAxis = centroidDelta[0] > centroidDelta[1] ?
+            (centroidDelta[0] > centroidDelta[2] ? 0 : 2) :
+            (centroidDelta[1] > centroidDelta[2] ? 1 : 2);
+        
+        std::sort(
+            triangles + triBeg, triangles + triEnd,
+            [axis = splitAxis]
+        (const BuildTriangle &L, const BuildTriangle &R)
         {
-            BuildNode **fillbackPtr;
-            int triBeg, triEnd;
-            int depth;
-        };
+            return L.centroid[axis] < R.centroid[axis];
+        });
 
-        BuildResult result = { nullptr, 0 };
+        return triBeg + (triEnd - triBeg) / 2;
+    }
 
-        std::queue<BuildTask> tasks;
-        tasks.push({ &result.root, 0, triangleCount, 0 });
+    struct ObjectSplit
+    {
+        // -1 when all centroids coincide
+        int axis = -1;
 
-        while(!tasks.empty())
+        // last bin on the left side
+        int bin = 0;
+
+        // leftArea * leftCount + rightArea * rightCount
+        float cost = std::numeric_limits<float>::infinity();
+
+        AABB leftBound;
+        AABB rightBound;
+    };
+
+    constexpr int MAX_BIN_COUNT = 64;
+
+    int clampBinCount(const BVH::BuildSettings &settings)
+    {
+        return agz::math::clamp(settings.binCount, 2, MAX_BIN_COUNT);
+    }
+
+    int computeCentroidBin(
+        const BuildTriangle &tri,
+        int                  axis,
+        const AABB          &centroidBound,
+        float                binScale,
+        int                  binCount)
+    {
+        return (std::min)(
+            static_cast<int>(
+                binScale * (tri.centroid[axis] - centroidBound.low[axis])),
+            binCount - 1);
+    }
+
+    ObjectSplit findObjectSplitSAH(
+        const BuildTriangle      *triangles,
+        int                       triBeg,
+        int                       triEnd,
+        const AABB               &centroidBound,
+        const BVH::BuildSettings &settings)
+    {
+        struct Bin
         {
-            const BuildTask task = tasks.front();
-            tasks.pop();
+            AABB bound;
+            int  count = 0;
+        };
 
-            assert(task.triBeg < task.triEnd);
+        const int binCount = clampBinCount(settings);
 
-            AABB allBound, centroidBound;
-            for(int i = task.triBeg; i < task.triEnd; ++i)
-            {
-                auto &tri = triangles[i];
-                allBound |= tri.vertices[0];
-                allBound |= tri.vertices[1];
-                allBound |= tri.vertices[2];
-                centroidBound |= tri.centroid;
-            }
+        ObjectSplit result;
 
-            const int n = task.triEnd - task.triBeg;
-            if(n <= leafSizeThreshold)
-            {
-                ++result.node_count;
+        // bin triangles along all axes in a single sweep
 
-                auto leaf = arena.create<BuildNode>();
-                leaf->aabb   = allBound;
-                leaf->left   = nullptr;
-                leaf->right  = nullptr;
-                leaf->triBeg = task.triBeg;
-                leaf->triEnd = task.triEnd;
+        Bin bins[3][MAX_BIN_COUNT];
+        float binScales[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
 
-                *task.fillbackPtr = leaf;
+            const float extent =
+                centroidBound.high[axis] - centroidBound.low[axis];
+            binScales[axis] = extent > 0 ? binCount / extent : 0.0f;
+        }
 
-                continue;
+        for(int i = triBeg; i < triEnd; ++i)
+        {
+            const auto &tri = triangles[i];
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                const int b = computeCentroidBin(
+                    tri, axis, centroidBound, binScales[axis], binCount);
+                unionAABB(bins[axis][b].bound, tri.bounds);
+                ++bins[axis][b].count;
             }
+        }
 
-            const auto centroidDelta =
-                centroidBound.high - centroidBound.low;
-            const int splitAxis = centroidDelta[0] > centroidDelta[1] ?
-                (centroidDelta[0] > centroidDelta[2] ? 0 : 2) :
-                (centroidDelta[1] > centroidDelta[2] ? 1 : 2);
-            
-            std::sort(
-                triangles + task.triBeg, triangles + task.triEnd,
-                [axis = splitAxis]
-            (const BuildTriangle &L, const BuildTriangle &R)
-            {
-                return L.centroid[axis] < R.centroid[axis];
-            });
-            const int splitMiddle = task.triBeg + n / 2;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            if(binScales[axis] <= 0)
+                continue;
 
-            auto interior = arena.create<BuildNode>();
-            interior->aabb    = allBound;
-            interior->left    = nullptr;
-            interior->right   = nullptr;
-            interior->triBeg = 0;
-            interior->triEnd = 0;
+            // rightBound[i]/rightCount[i]: bins [i, binCount)
 
-            *task.fillbackPtr = interior;
-            ++result.node_count;
+            AABB rightBound[MAX_BIN_COUNT];
+            int  rightCount[MAX_BIN_COUNT];
 
-            tasks.push({
-                &interior->left,
-                task.triBeg,
-                splitMiddle,
-                task.depth + 1
-            });
+            AABB accuBound;
+            int accuCount = 0;
+            for(int b = binCount - 1; b > 0; --b)
+            {
+                if(bins[axis][b].count)
+                    unionAABB(accuBound, bins[axis][b].bound);
+                accuCount += bins[axis][b].count;
+                rightBound[b] = accuBound;
+                rightCount[b] = accuCount;
+            }
 
-            tasks.push({
-                &interior->right,
-                splitMiddle,
-                task.triEnd,
-                task.depth + 1
-            });
+            accuBound = AABB();
+            accuCount = 0;
+            for(int b = 0; b < binCount - 1; ++b)
+            {
+                if(bins[axis][b].count)
+                    unionAABB(accuBound, bins[axis][b].bound);
+                accuCount += bins[axis][b].count;
+
+                const float cost =
+                    surfaceArea(accuBound) * accuCount +
+                    surfaceArea(rightBound[b + 1]) * rightCount[b + 1];
+                if(accuCount && rightCount[b + 1] && cost < result.cost)
+                {
+                    result.cost       = cost;
+                    result.axis       = axis;
+                    result.bin        = b;
+                    result.leftBound  = accuBound;
+                    result.rightBound = rightBound[b + 1];
+                }
+            }
         }
 
         return result;
     }
 
-    void linearizeBVH(
-        const BuildNode     *buildNode,
-        const BuildTriangle *triangles,
-        BVH::Node           *nodeArr,
-        BVH::Triangle       *triArr)
+    BuildTriangle *partitionObjectSplit(
+        BuildTriangle            *triangles,
+        int                       triBeg,
+        int                       triEnd,
+        const AABB               &centroidBound,
+        const ObjectSplit        &split,
+        const BVH::BuildSettings &settings)
     {
-        struct CompactingTask
+        const int binCount = clampBinCount(settings);
+        const float binScale = binCount /
+            (centroidBound.high[split.axis] - centroidBound.low[split.axis]);
+
+        return std::partition(
+            triangles + triBeg, triangles + triEnd,
+            [&](const BuildTriangle &tri)
         {
-            const BuildNode *tree;
-            uint32_t *fillbackPtr;
-        };
+            return computeCentroidBin(
+                tri, split.axis, centroidBound, binScale, binCount) <= split.bin;
+        });
+    }
 
-        uint32_t nextNodeIdx = 0, nextTriIdx = 0;
+    // returns -1 when making a leaf is cheaper than any split
+    int partitionSAH(
+        BuildTriangle            *triangles,
+        int                       triBeg,
+        int                       triEnd,
+        const AABB               &allBound,
+        const AABB               &centroidBound,
+        const BVH::BuildSettings &settings)
+    {
+        const int n = triEnd - triBeg;
 
-        std::stack<CompactingTask> tasks;
-        tasks.push({ buildNode, nullptr });
+        const ObjectSplit split = findObjectSplitSAH(
+            triangles, triBeg, triEnd, centroidBound, settings);
 
-        while(!tasks.empty())
+        if(split.axis < 0)
         {
-            const CompactingTask task = tasks.top();
-            tasks.pop();
+            // all centroids coincide. fall back to an arbitrary halving
+            // when too many triangles are left
 
-            const BuildNode *tree = task.tree;
+            if(n <= settings.maxLeafSize)
+                return -1;
+            return triBeg + n / 2;
+        }
 
-            if(task.fillbackPtr)
-                *task.fillbackPtr = nextNodeIdx;
+        const float area = surfaceArea(allBound);
+        const float splitCost = settings.traversalCost +
+            settings.intersectionCost * split.cost / (std::max)(area, 1e-20f);
+        const float leafCost = settings.intersectionCost * n;
 
-            if(tree->left && tree->right)
-            {
-                auto &node = nodeArr[nextNodeIdx++];
-                node.lower      = tree->aabb.low;
-                node.upper      = tree->aabb.high;
-                node.triBeg     = BVH::Node::TRI_NIL;
-                node.rightChild = 0;
-                tasks.push({ tree->right, &node.rightChild});
-                tasks.push({ tree->left, nullptr });
-            }
-            else
-            {
-                const uint32_t beg = nextTriIdx;
-                const uint32_t end = nextTriIdx + (tree->triEnd - tree->triBeg);
+        if(n <= settings.maxLeafSize && leafCost <= splitCost)
+            return -1;
 
-                auto &node = nodeArr[nextNodeIdx++];
-                node.lower   = tree->aabb.low;
-                node.upper   = tree->aabb.high;
-                node.triBeg  = beg;
-                node.triEnd  = end;
+        auto mid = partitionObjectSplit(
+            triangles, triBeg, triEnd, centroidBound, split, settings);
 
-                for(uint32_t i = beg, j = tree->triBeg; i < end; ++i, ++j)
-                {
-                    assert(j < tree->triEnd);
+        return static_cast<int>(mid - triangles);
+    }
 
-                    auto &buildTri = triangles[j];
-                    auto &tri = triArr[i];
-                    
-                    tri.a     = buildTri.vertices[0];
-                    tri.b_a   = buildTri.vertices[1] - buildTri.vertices[0];
-                    tri.c_a   = buildTri.vertices[2] - buildTri.vertices[0];
-                    tri.index = buildTri.index;
-                }
+    struct NodeSplit
+    {
+        AABB bound;
+        int  middle; // < 0 for leaf
+    };
 
-                nextTriIdx = end;
-            }
+    NodeSplit splitNode(
+        BuildTriangle            *triangles,
+        int                       triBeg,
+        int                       triEnd,
+        const BVH::BuildSettings &settings)
+    {
+        assert(triBeg < triEnd);
+
+        AABB allBound, centroidBound;
+        for(int i = triBeg; i < triEnd; ++i)
+        {
+            auto &tri = triangles[i];
+            unionAABB(allBound, tri.bounds);
+            centroidBound |= tri.centroid;
         }
-    }
 
-    bool hasIntersectionWithTriangle(
-        const Ray    &r,
-        const Float3 &A,
-        const Float3 &B_A,
-        const Float3 &C_A) noexcept
-    {
-        const Float3 s1 = cross(r.d, C_A);
-        const float div = dot(s1, B_A);
-        if(div == 0.0f)
-            return false;
-        const float invDiv = 1 / div;
-    
-        const Float3 o_A = r.o - A;
-        const float alpha = dot(o_A, s1) * invDiv;
-        if(alpha < 0 || alpha > 1)
-            return false;
-    
-        const Float3 s2  = cross(o_A, B_A);
-        const float beta = dot(r.d, s2) * invDiv;
-        if(beta < 0 || alpha + beta > 1)
-            return false;
-    
-        const float t = dot(C_A, s2) * invDiv;
-        return r.isBetween(t);
-    }
-
-    bool closestIntersectionWithTriangle(
-        const Ray    &r,
-        const Float3 &A,
-        const Float3 &B_A,
-        const Float3 &C_A,
-        float        *r_t,
-        Float2       *uv) noexcept
-    {
-        const Float3 s1 = cross(r.d, C_A);
-        const float div = dot(s1, B_A);
-        if(div == 0.0f)
-            return false;
-        const float invDiv = 1 / div;
+        const int n = triEnd - triBeg;
 
-        const Float3 o_A = r.o - A;
-        const float alpha = dot(o_A, s1) * invDiv;
-        if(alpha < 0)
-            return false;
+        int splitMiddle = -1;
+        if(settings.splitMethod == BVH::SplitMethod::SAH)
+        {
+            if(n > 1)
+            {
+                splitMiddle = partitionSAH(
+                    triangles, triBeg, triEnd,
+                    allBound, centroidBound, settings);
+            }
+        }
+        else if(n > settings.leafSizeThreshold)
+        {
+            splitMiddle = partitionMiddle(
+                triangles, triBeg, triEnd, centroidBound);
+        }
 
-        const Float3 s2 = cross(o_A, B_A);
-        const float beta = dot(r.d, s2) * invDiv;
-        if(beta < 0 || alpha + beta > 1)
-            return false;
+        assert(splitMiddle < 0 || (triBeg < splitMiddle && splitMiddle < triEnd));
+        return { allBound, splitMiddle };
+    }
 
-        const float t = dot(C_A, s2) * invDiv;
-        if(!r.isBetween(t))
-            return false;
+    BuildNode *createBuildNode(
+        const NodeSplit &split, int triBeg, int triEnd, Arena &arena)
+    {
+        auto node = arena.create<BuildNode>();
+        node->aabb  = split.bound;
+        node->left  = nullptr;
+        node->right = nullptr;
 
-        *r_t = t;
-        *uv  = Float2(alpha, beta);
+        if(split.middle < 0)
+        {
+            node->triBeg = triBeg;
+            node->triEnd = triEnd;
+        }
+        else
+        {
+            node->triBeg = 0;
+            node->triEnd = 0;
+        }
 
-        return true;
+        return node;
     }
 
-    bool bboxHasIntersection(
-        const BVH::Node &node,
-        const Float3    &ori,
-        const Float3    &invDir,
-        float            t0,
-        float            t1)
+    BuildResult buildLinkedBVH(
+        BuildTriangle            *triangles,
+        int                       triBeg,
+        int                       triEnd,
+        const BVH::BuildSettings &settings,
+        Arena                    &arena)
     {
-        const float nx = invDir[0] * (node.lower[0] - ori[0]);
-        const float ny = invDir[1] * (node.lower[1] - ori[1]);
-        const float nz = invDir[2] * (node.lower[2] - ori[2]);
+        struct BuildTask
+        {
+            BuildNode **fillbackPtr;
+            int triBeg, triEnd;
+        };
 
-        const float fx = invDir[0] * (node.upper[0] - ori[0]);
-        const float fy = invDir[1] * (node.upper[1] - ori[1]);
-        const float fz = invDir[2] * (node.upper[2] - ori[2]);
+        BuildResult result = { nullptr, 0 };
 
-        t0 = (std::max)(t0, (std::min)(nx, fx));
-        t0 = (std::max)(t0, (std::min)(ny, fy));
-        t0 = (std::max)(t0, (std::min)(nz, fz));
+        std::queue<BuildTask> tasks;
+        tasks.push({ &result.root, triBeg, triEnd });
 
-        t1 = (std::min)(t1, (std::max)(nx, fx));
-        t1 = (std::min)(t1, (std::max)(ny, fy));
-        t1 = (std::min)(t1, (std::max)(nz, fz));
+        while(!tasks.empty())
+        {
+            const BuildTask task = tasks.front();
+            tasks.pop();
 
-        return t0 <= t1;
-    }
+            const NodeSplit split = splitNode(
+                triangles, task.triBeg, task.triEnd, settings);
 
-    bool isLeaf(const BVH::Node &node)
-    {
-        return node.triBeg != BVH::Node::TRI_NIL;
-    }
+            auto node = createBuildNode(split, task.triBeg, task.triEnd, arena);
+            *task.fillbackPtr = node;
+            ++result.node_count;
 
-    thread_local uint32_t traversalStack[BVH::TRAVERSAL_STACK_SIZE];
+            if(split.middle < 0)
+                continue;
 
-} // namespace anonymous
+            tasks.push({ &node->left, task.triBeg, split.middle });
+            tasks.push({ &node->right, split.middle, task.triEnd });
+        }
 
-BVH BVH::create(const Float3 *triangle_vertices, int triangle_count)
-{
-    assert(triangle_vertices && triangle_count > 0);
+        return result;
+    }
 
-    std::vector<BuildTriangle> build_triangles(triangle_count);
-    for(int i = 0; i < triangle_count; ++i)
+    // subtree of a parallel build, linearized independently
+    struct BuildSubtree
     {
-        auto &dst = build_triangles[i];
-        auto  src = &triangle_vertices[3 * i];
-        dst.vertices[0] = src[0];
-        dst.vertices[1] = src[1];
-        dst.vertices[2] = src[2];
-        dst.index       = i;
+        BuildNode **fillbackPtr;
+        int         triBeg;
+        int         triEnd;
+        BuildResult result;
+        uint32_t    nodeOffset;
+    };
+
+    int resolveThreadCount(int threadCount)
+    {
+        if(threadCount <= 0)
+            threadCount += TaskScheduler::getDefault().getThreadCount();
+        return (std::max)(threadCount, 1);
     }
 
-    Arena arena;
-    auto [root, node_count] = buildLinkedBVH(
-        build_triangles.data(), triangle_count, 4, arena);
-    
-    BVH bvh;
-    bvh.nodes_.resize(node_count);
-    bvh.triangles_.resize(triangle_count);
-    
-    linearizeBVH(
-        root, build_triangles.data(),
-        bvh.nodes_.data(), bvh.triangles_.data());
-    
-    return bvh;
-}
+    // calls func(threadIdx, i) for i in [beg, end) on the shared scheduler,
+    // or in order on the calling thread with threadIdx 0 for serial builds
+    template<typename Func>
+    void parallelForRange(int beg, int end, int threadCount, const Func &func)
+    {
+        if(threadCount == 1)
+        {
+            for(int i = beg; i < end; ++i)
+                func(0, i);
+            return;
+        }
+        TaskScheduler::getDefault().parallelFor(beg, end, func);
+    }
 
-bool BVH::hasIntersection(const Ray &ray) const
-{
-    const Float3 invDir = { 1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z };
+    // top levels are split breadth-first with all nodes of a level processed
+    // in parallel. once there are enough pending ranges, each of them is
+    // built into an independent subtree on a worker thread.
+    // the result only depends on the input, not on the thread schedule.
+    BuildResult buildLinkedBVHParallel(
+        BuildTriangle             *triangles,
+        int                        triangleCount,
+        const BVH::BuildSettings  &settings,
+        int                        threadCount,
+        std::vector<Arena>        &arenas,
+        std::vector<BuildSubtree> &subtrees)
+    {
+        Arena &topArena = arenas[0];
+        BuildResult result = { nullptr, 0 };
 
-    if(!bboxHasIntersection(nodes_[0], ray.o, invDir, ray.t0, ray.t1))
-        return false;
+        const int targetSubtreeCount = 4 * threadCount;
+        const int minSubtreeSize = (std::max)(
+            triangleCount / (16 * targetSubtreeCount),
+            PARALLEL_BUILD_GRAIN);
 
-    int top = 0;
-    traversalStack[top++] = 0;
+        std::vector<BuildSubtree> frontier;
+        frontier.push_back({ &result.root, 0, triangleCount, {}, 0 });
 
-    while(top)
-    {
-        const uint32_t task_node_idx = traversalStack[--top];
-        const Node &node = nodes_[task_node_idx];
+        std::vector<NodeSplit> splits;
+        std::vector<BuildSubtree> nextFrontier;
 
-        if(isLeaf(node))
+        while(!frontier.empty() &&
+              static_cast<int>(frontier.size()) < targetSubtreeCount)
         {
-            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            splits.resize(frontier.size());
+            parallelForRange(
+                0, static_cast<int>(frontier.size()), threadCount,
+                [&](int, int i)
             {
-                const Triangle &tri = triangles_[i];
-                if(hasIntersectionWithTriangle(
-                    ray, tri.a, tri.b_a, tri.c_a))
-                    return true;
+                splits[i] = splitNode(
+                    triangles, frontier[i].triBeg, frontier[i].triEnd,
+                    settings);
+            });
+
+            nextFrontier.clear();
+            for(size_t i = 0; i < frontier.size(); ++i)
+            {
+                auto &task = frontier[i];
+                auto &split = splits[i];
+
+                auto node = createBuildNode(
+                    split, task.triBeg, task.triEnd, topArena);
+                *task.fillbackPtr = node;
+                ++result.node_count;
+
+                if(split.middle < 0)
+                    continue;
+
+                const BuildSubtree children[] =
+                {
+                    { &node->left,  task.triBeg,  split.middle, {}, 0 },
+                    { &node->right, split.middle, task.triEnd,  {}, 0 }
+                };
+
+                for(auto &child : children)
+                {
+                    if(child.triEnd - child.triBeg <= minSubtreeSize)
+                        subtrees.push_back(child);
+                    else
+                        nextFrontier.push_back(child);
+                }
             }
+
+            frontier.swap(nextFrontier);
         }
-        else
+
+        subtrees.insert(subtrees.end(), frontier.begin(), frontier.end());
+
+        parallelForRange(
+            0, static_cast<int>(subtrees.size()), threadCount,
+            [&](int threadIdx, int i)
         {
-            assert(top + 2 < TRAVERSAL_STACK_SIZE);
+            auto &subtree = subtrees[i];
+            subtree.result = buildLinkedBVH(
+                triangles, subtree.triBeg, subtree.triEnd,
+                settings, arenas[threadIdx + 1]);
+        });
+
+        for(auto &subtree : subtrees)
+        {
+            *subtree.fillbackPtr = subtree.result.root;
+            result.node_count += subtree.result.node_count;
+        }
+
+        return result;
+    }
 
-            if(bboxHasIntersection(
-                nodes_[task_node_idx + 1], ray.o, invDir, ray.t0, ray.t1))
-                traversalStack[top++] = task_node_idx + 1;
+    // spatial splits (Stich et al., Spatial Splits in Bounding Volume
+    // Hierarchies). references straddling the split plane are clipped
+    // into both children, so that long triangles no longer inflate the
+    // bounds of their siblings
+
+    struct SpatialSplit
+    {
+        int   axis     = -1;
+        float position = 0;
+        float cost     = std::numeric_limits<float>::infinity();
+    };
 
-            if(bboxHasIntersection(
-                nodes_[node.rightChild], ray.o, invDir, ray.t0, ray.t1))
-                traversalStack[top++] = node.rightChild;
+    AABB intersectAABB(const AABB &a, const AABB &b)
+    {
+        AABB result;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            result.low[axis]  = (std::max)(a.low[axis], b.low[axis]);
+            result.high[axis] = (std::min)(a.high[axis], b.high[axis]);
         }
+        return result;
     }
 
-    return false;
-}
+    bool isEmpty(const AABB &aabb)
+    {
+        return aabb.low.x > aabb.high.x ||
+               aabb.low.y > aabb.high.y ||
+               aabb.low.z > aabb.high.z;
+    }
 
-bool BVH::findIntersection(const Ray &ray, Intersection *inct) const
-{
-    auto r = ray;
-    const Float3 invDir = { 1 / r.d.x, 1 / r.d.y, 1 / r.d.z };
+    // bounds of the part of a reference between lo and hi along axis
+    AABB clipReference(
+        const TriangleSource &source,
+        const BuildTriangle  &ref,
+        int                   axis,
+        float                 lo,
+        float                 hi)
+    {
+        AABB result;
+        for(int i = 0; i < 3; ++i)
+        {
+            const Float3 &a = source.get(ref.index, i);
+            const Float3 &b = source.get(ref.index, (i + 1) % 3);
 
-    if(!bboxHasIntersection(
-        nodes_[0], r.o, invDir, r.t0, r.t1))
-        return false;
+            if(lo <= a[axis] && a[axis] <= hi)
+                result |= a;
+
+            for(float plane : { lo, hi })
+            {
+                if((a[axis] < plane) == (b[axis] < plane))
+                    continue;
 
-    int top = 0;
-    traversalStack[top++] = 0;
+                Float3 p = a + (plane - a[axis]) / (b[axis] - a[axis]) * (b - a);
+                p[axis] = plane;
+                result |= p;
+            }
+        }
 
-    uint32_t finalIndex = 0;
-    Float2 finalUV;
-    float finalT = std::numeric_limits<float>::infinity();
+        // a reference may already have been clipped by an ancestor
+        return intersectAABB(result, ref.bounds);
+    }
 
-    while(top)
+    SpatialSplit findSpatialSplit(
+        const TriangleSource             &source,
+        const std::vector<BuildTriangle> &refs,
+        const AABB                       &allBound,
+        const BVH::BuildSettings         &settings)
     {
-        const uint32_t taskNodeIdx = traversalStack[--top];
-        const Node &node = nodes_[taskNodeIdx];
+        struct Bin
+        {
+            AABB bound;
+            int  enter = 0;
+            int  exit  = 0;
+        };
 
-        if(isLeaf(node))
+        const int binCount = clampBinCount(settings);
+
+        SpatialSplit result;
+
+        for(int axis = 0; axis < 3; ++axis)
         {
-            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            const float low = allBound.low[axis];
+            const float extent = allBound.high[axis] - low;
+            if(extent <= 0)
+                continue;
+
+            const float binWidth = extent / binCount;
+            auto binLow = [&](int b)
+            {
+                return b == binCount ? allBound.high[axis] : low + b * binWidth;
+            };
+
+            auto findBin = [&](float x)
+            {
+                return agz::math::clamp(
+                    static_cast<int>((x - low) / binWidth), 0, binCount - 1);
+            };
+
+            // references are clipped against each bin they overlap, and
+            // counted where they enter and where they leave
+
+            Bin bins[MAX_BIN_COUNT];
+            for(auto &ref : refs)
             {
-                const Triangle &tri = triangles_[i];
-                if(closestIntersectionWithTriangle(
-                    r, tri.a, tri.b_a, tri.c_a, &finalT, &finalUV))
+                const int first = findBin(ref.bounds.low[axis]);
+                const int last  = findBin(ref.bounds.high[axis]);
+
+                for(int b = first; b <= last; ++b)
                 {
-                    r.t1 = finalT;
-                    finalIndex = tri.index;
+                    const AABB part = first == last ? ref.bounds :
+                        clipReference(
+                            source, ref, axis, binLow(b), binLow(b + 1));
+                    if(!isEmpty(part))
+                        unionAABB(bins[b].bound, part);
                 }
-            }
-        }
-        else
-        {
-            assert(top + 2 < TRAVERSAL_STACK_SIZE);
-
-            const bool addLeft = bboxHasIntersection(
-                nodes_[taskNodeIdx + 1], r.o, invDir, r.t0, r.t1);
-            if(addLeft)
-                traversalStack[top++] = taskNodeIdx + 1;
 
-            const bool addRight = bboxHasIntersection(
-                nodes_[node.rightChild], r.o, invDir, r.t0, r.t1);
-            if(addRight)
-                traversalStack[top++] = node.rightChild;
-        }
-    }
+                ++bins[first].enter;
+                ++bins[last].exit;
+            }
 
-    if(isinf(finalT))
-        return false;
+            AABB rightBound[MAX_BIN_COUNT];
+            int  rightCount[MAX_BIN_COUNT];
 
-    inct->triangle = finalIndex;
-    inct->position = r.at(finalT); // IMPROVE: better precision
-    inct->t        = finalT;
-    inct->uv       = finalUV;
+            AABB accuBound;
+            int accuCount = 0;
+            for(int b = binCount - 1; b > 0; --b)
+            {
+                if(!isEmpty(bins[b].bound))
+                    unionAABB(accuBound, bins[b].bound);
+                accuCount += bins[b].exit;
+                rightBound[b] = accuBound;
+                rightCount[b] = accuCount;
+            }
+
+            accuBound = AABB();
+            accuCount = 0;
+            for(int b = 0; b < binCount - 1; ++b)
+            {
+                if(!isEmpty(bins[b].bound))
+                    unionAABB(accuBound, bins[b].bound);
+                accuCount += bins[b].enter;
+
+                const float cost =
+                    surfaceArea(accuBound) * accuCount +
+                    surfaceArea(rightBound[b + 1]) * rightCount[b + 1];
+                if(accuCount && rightCount[b + 1] && cost < result.cost)
+                {
+                    result.cost     = cost;
+                    result.axis     = axis;
+                    result.position = binLow(b + 1);
+                }
+            }
+        }
+
+        return result;
+    }
+
+    // distributes refs to both sides of the plane. straddling references
+    // are split only when that is cheaper than moving them to one side
+    // (reference unsplitting) and while the duplication budget allows it
+    void partitionSpatialSplit(
+        const TriangleSource             &source,
+        const std::vector<BuildTriangle> &refs,
+        const SpatialSplit               &split,
+        size_t                           &refBudget,
+        std::vector<BuildTriangle>       &left,
+        std::vector<BuildTriangle>       &right)
+    {
+        const int axis = split.axis;
+        const float position = split.position;
+
+        struct Straddling
+        {
+            const BuildTriangle *ref;
+            AABB                 leftPart;
+            AABB                 rightPart;
+        };
+
+        std::vector<Straddling> straddling;
+        AABB leftBound, rightBound;
+
+        for(auto &ref : refs)
+        {
+            if(ref.bounds.high[axis] <= position)
+            {
+                unionAABB(leftBound, ref.bounds);
+                left.push_back(ref);
+            }
+            else if(ref.bounds.low[axis] >= position)
+            {
+                unionAABB(rightBound, ref.bounds);
+                right.push_back(ref);
+            }
+            else
+            {
+                const AABB leftPart = clipReference(
+                    source, ref, axis,
+                    -std::numeric_limits<float>::infinity(), position);
+                const AABB rightPart = clipReference(
+                    source, ref, axis,
+                    position, std::numeric_limits<float>::infinity());
+                straddling.push_back({ &ref, leftPart, rightPart });
+            }
+        }
+
+        // the bounds start out as if every straddling reference was split
+
+        for(auto &s : straddling)
+        {
+            if(!isEmpty(s.leftPart))
+                unionAABB(leftBound, s.leftPart);
+            if(!isEmpty(s.rightPart))
+                unionAABB(rightBound, s.rightPart);
+        }
+
+        float leftCount  = static_cast<float>(left.size()  + straddling.size());
+        float rightCount = static_cast<float>(right.size() + straddling.size());
+
+        auto toCentroid = [](BuildTriangle ref, const AABB &part)
+        {
+            ref.bounds   = part;
+            ref.centroid = 0.5f * (part.low + part.high);
+            return ref;
+        };
+
+        for(auto &s : straddling)
+        {
+            const BuildTriangle &ref = *s.ref;
+
+            AABB leftWithRef = leftBound, rightWithRef = rightBound;
+            unionAABB(leftWithRef, ref.bounds);
+            unionAABB(rightWithRef, ref.bounds);
+
+            const float splitCost =
+                surfaceArea(leftBound) * leftCount +
+                surfaceArea(rightBound) * rightCount;
+            const float leftCost =
+                surfaceArea(leftWithRef) * leftCount +
+                surfaceArea(rightBound) * (rightCount - 1);
+            const float rightCost =
+                surfaceArea(leftBound) * (leftCount - 1) +
+                surfaceArea(rightWithRef) * rightCount;
+
+            const bool canSplit = refBudget > 0 &&
+                !isEmpty(s.leftPart) && !isEmpty(s.rightPart);
+
+            if(canSplit && splitCost < (std::min)(leftCost, rightCost))
+            {
+                left.push_back(toCentroid(ref, s.leftPart));
+                right.push_back(toCentroid(ref, s.rightPart));
+                --refBudget;
+            }
+            else if(leftCost <= rightCost)
+            {
+                leftBound = leftWithRef;
+                rightCount -= 1;
+                left.push_back(ref);
+            }
+            else
+            {
+                rightBound = rightWithRef;
+                leftCount -= 1;
+                right.push_back(ref);
+            }
+        }
+    }
+
+    // references of all leaves are appended to triangles in leaf order,
+    // replacing the input triangles
+    BuildResult buildSBVH(
+        const TriangleSource       &source,
+        std::vector<BuildTriangle> &triangles,
+        const BVH::BuildSettings   &settings,
+        Arena                      &arena)
+    {
+        struct BuildTask
+        {
+            BuildNode                **fillbackPtr;
+            std::vector<BuildTriangle> refs;
+        };
+
+        BuildResult result = { nullptr, 0 };
+
+        size_t refBudget = static_cast<size_t>(
+            (std::max)(settings.spatialSplitBudget, 0.0f) * triangles.size());
+
+        std::vector<BuildTriangle> leafRefs;
+        leafRefs.reserve(triangles.size() + refBudget);
+
+        std::stack<BuildTask> tasks;
+        tasks.push({ &result.root, std::move(triangles) });
+
+        float minOverlapArea = 0;
+
+        while(!tasks.empty())
+        {
+            BuildTask task = std::move(tasks.top());
+            tasks.pop();
+
+            auto &refs = task.refs;
+            const int n = static_cast<int>(refs.size());
+
+            AABB allBound, centroidBound;
+            for(auto &ref : refs)
+            {
+                unionAABB(allBound, ref.bounds);
+                centroidBound |= ref.centroid;
+            }
+
+            if(!result.root)
+            {
+                minOverlapArea =
+                    settings.spatialSplitAlpha * surfaceArea(allBound);
+            }
+
+            auto node = arena.create<BuildNode>();
+            node->aabb = allBound;
+            *task.fillbackPtr = node;
+            ++result.node_count;
+
+            auto makeLeaf = [&]
+            {
+                node->triBeg = static_cast<uint32_t>(leafRefs.size());
+                leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+                node->triEnd = static_cast<uint32_t>(leafRefs.size());
+            };
+
+            if(n <= 1)
+            {
+                makeLeaf();
+                continue;
+            }
+
+            const ObjectSplit objectSplit = findObjectSplitSAH(
+                refs.data(), 0, n, centroidBound, settings);
+
+            // spatial splits only pay off where the object split leaves
+            // the children overlapping
+
+            SpatialSplit spatialSplit;
+            if(refBudget > 0 && objectSplit.axis >= 0)
+            {
+                const AABB overlap = intersectAABB(
+                    objectSplit.leftBound, objectSplit.rightBound);
+                if(!isEmpty(overlap) && surfaceArea(overlap) > minOverlapArea)
+                    spatialSplit = findSpatialSplit(source, refs, allBound, settings);
+            }
+            else if(refBudget > 0)
+                spatialSplit = findSpatialSplit(source, refs, allBound, settings);
+
+            const float bestCost = (std::min)(objectSplit.cost, spatialSplit.cost);
+
+            const float area = surfaceArea(allBound);
+            const float splitCost = settings.traversalCost +
+                settings.intersectionCost * bestCost / (std::max)(area, 1e-20f);
+            const float leafCost = settings.intersectionCost * n;
+
+            if(n <= settings.maxLeafSize && leafCost <= splitCost)
+            {
+                makeLeaf();
+                continue;
+            }
+
+            std::vector<BuildTriangle> left, right;
+
+            if(spatialSplit.cost < objectSplit.cost)
+            {
+                partitionSpatialSplit(
+                    source, refs, spatialSplit, refBudget, left, right);
+
+                // unsplitting may move everything to one side
+                if(left.empty() || right.empty())
+                {
+                    left.clear();
+                    right.clear();
+                }
+            }
+
+            if(left.empty() && right.empty())
+            {
+                int middle;
+                if(objectSplit.axis >= 0)
+                {
+                    middle = static_cast<int>(partitionObjectSplit(
+                        refs.data(), 0, n, centroidBound,
+                        objectSplit, settings) - refs.data());
+                }
+                else if(n <= settings.maxLeafSize)
+                {
+                    makeLeaf();
+                    continue;
+                }
+                else
+                    middle = n / 2;
+
+                left.assign(refs.begin(), refs.begin() + middle);
+                right.assign(refs.begin() + middle, refs.end());
+            }
+
+            refs = {};
+            tasks.push({ &node->right, std::move(right) });
+            tasks.push({ &node->left,  std::move(left) });
+        }
+
+        triangles = std::move(leafRefs);
+        return result;
+    }
+
+    struct MortonPrimitive
+    {
+        uint64_t code;
+        int      triangle;
+    };
+
+    uint32_t expandBits10(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    uint64_t expandBits21(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x001f00000000ffffull;
+        v = (v | v << 16) & 0x001f0000ff0000ffull;
+        v = (v | v << 8)  & 0x100f00f00f00f00full;
+        v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2)  & 0x1249249249249249ull;
+        return v;
+    }
+
+    uint64_t computeMortonCode(
+        const Float3 &centroid, const AABB &centroidBound, int mortonBits)
+    {
+        const int bitsPerAxis = mortonBits / 3;
+        const float cells = static_cast<float>(1u << bitsPerAxis);
+
+        uint64_t coord[3];
+        for(int i = 0; i < 3; ++i)
+        {
+            const float extent = centroidBound.high[i] - centroidBound.low[i];
+            const float t = extent > 0 ?
+                (centroid[i] - centroidBound.low[i]) / extent : 0.0f;
+            coord[i] = static_cast<uint64_t>(
+                agz::math::clamp(t * cells, 0.0f, cells - 1));
+        }
+
+        if(bitsPerAxis == 10)
+        {
+            return (expandBits10(static_cast<uint32_t>(coord[0])) << 2) |
+                   (expandBits10(static_cast<uint32_t>(coord[1])) << 1) |
+                    expandBits10(static_cast<uint32_t>(coord[2]));
+        }
+
+        return (expandBits21(coord[0]) << 2) |
+               (expandBits21(coord[1]) << 1) |
+                expandBits21(coord[2]);
+    }
+
+    // calls func(chunkIdx, beg, end) for threadCount consecutive chunks
+    template<typename Func>
+    void parallelForChunks(int count, int threadCount, const Func &func)
+    {
+        const int chunkSize = (count + threadCount - 1) / threadCount;
+        parallelForRange(0, threadCount, threadCount, [&](int, int chunk)
+        {
+            const int beg = chunk * chunkSize;
+            const int end = (std::min)(beg + chunkSize, count);
+            if(beg < end)
+                func(chunk, beg, end);
+        });
+    }
+
+    // stable LSD radix sort with per-chunk digit histograms
+    void radixSortMortonPrimitives(
+        std::vector<MortonPrimitive> &prims, int keyBits, int threadCount)
+    {
+        constexpr int DIGIT_BITS   = 8;
+        constexpr int BUCKET_COUNT = 1 << DIGIT_BITS;
+
+        using Histogram = std::array<int, BUCKET_COUNT>;
+
+        const int n = static_cast<int>(prims.size());
+        std::vector<MortonPrimitive> sorted(n);
+        std::vector<Histogram> histograms(threadCount);
+
+        for(int shift = 0; shift < keyBits; shift += DIGIT_BITS)
+        {
+            auto digit = [shift](const MortonPrimitive &p)
+            {
+                return static_cast<int>((p.code >> shift) & (BUCKET_COUNT - 1));
+            };
+
+            for(auto &h : histograms)
+                h.fill(0);
+
+            parallelForChunks(n, threadCount, [&](int chunk, int beg, int end)
+            {
+                for(int i = beg; i < end; ++i)
+                    ++histograms[chunk][digit(prims[i])];
+            });
+
+            int offset = 0;
+            for(int d = 0; d < BUCKET_COUNT; ++d)
+            {
+                for(auto &h : histograms)
+                {
+                    const int count = h[d];
+                    h[d] = offset;
+                    offset += count;
+                }
+            }
+
+            parallelForChunks(n, threadCount, [&](int chunk, int beg, int end)
+            {
+                auto &h = histograms[chunk];
+                for(int i = beg; i < end; ++i)
+                    sorted[h[digit(prims[i])]++] = prims[i];
+            });
+
+            prims.swap(sorted);
+        }
+    }
+
+    // returns -1 for leaf
+    int splitMortonRange(
+        const MortonPrimitive *prims, int beg, int end, int leafSize)
+    {
+        if(end - beg <= leafSize)
+            return -1;
+
+        const uint64_t diff = prims[beg].code ^ prims[end - 1].code;
+        if(!diff)
+            return beg + (end - beg) / 2;
+
+        int highBit = 63;
+        while(!(diff >> highBit))
+            --highBit;
+        const uint64_t mask = uint64_t(1) << highBit;
+
+        auto it = std::partition_point(
+            prims + beg, prims + end,
+            [mask](const MortonPrimitive &p) { return !(p.code & mask); });
+        return static_cast<int>(it - prims);
+    }
+
+    BuildNode *emitLBVH(
+        const BuildTriangle      *triangles,
+        const MortonPrimitive    *prims,
+        int                       beg,
+        int                       end,
+        const BVH::BuildSettings &settings,
+        Arena                    &arena,
+        int                      &nodeCount)
+    {
+        ++nodeCount;
+        auto node = arena.create<BuildNode>();
+
+        const int middle = splitMortonRange(
+            prims, beg, end, settings.leafSizeThreshold);
+        if(middle < 0)
+        {
+            for(int i = beg; i < end; ++i)
+            {
+                unionAABB(node->aabb, triangles[i].bounds);
+            }
+            node->triBeg = beg;
+            node->triEnd = end;
+            return node;
+        }
+
+        node->left = emitLBVH(
+            triangles, prims, beg, middle, settings, arena, nodeCount);
+        node->right = emitLBVH(
+            triangles, prims, middle, end, settings, arena, nodeCount);
+
+        node->aabb = node->left->aabb;
+        unionAABB(node->aabb, node->right->aabb);
+
+        return node;
+    }
+
+    const AABB &fixupLBVHBounds(BuildNode *node)
+    {
+        // only top-level nodes are created without bounds
+        if(node->aabb.low.x > node->aabb.high.x)
+        {
+            node->aabb = fixupLBVHBounds(node->left);
+            unionAABB(node->aabb, fixupLBVHBounds(node->right));
+        }
+        return node->aabb;
+    }
+
+    float computeTreeletCost(
+        const BuildNode *node, const BVH::BuildSettings &settings)
+    {
+        const float area = surfaceArea(node->aabb);
+        if(!node->left)
+        {
+            return settings.intersectionCost * area *
+                   (node->triEnd - node->triBeg);
+        }
+        return settings.traversalCost * area +
+               node->left->cost + node->right->cost;
+    }
+
+    // Karras & Aila, Fast Parallel Construction of High-Quality Bounding
+    // Volume Hierarchies. finds the optimal topology of the treelet rooted
+    // at node via dynamic programming over subsets of its leaves
+    void restructureTreelet(BuildNode *node, const BVH::BuildSettings &settings)
+    {
+        constexpr int MAX_TREELET_LEAVES = 7;
+        constexpr int SUBSET_COUNT = 1 << MAX_TREELET_LEAVES;
+
+        if(!node->left)
+        {
+            node->cost = computeTreeletCost(node, settings);
+            return;
+        }
+
+        const int maxLeaves = agz::math::clamp(
+            settings.treeletSize, 3, MAX_TREELET_LEAVES);
+
+        BuildNode *leaves[MAX_TREELET_LEAVES] = { node->left, node->right };
+        BuildNode *internals[MAX_TREELET_LEAVES] = { node };
+        int leafCount = 2, internalCount = 1;
+
+        while(leafCount < maxLeaves)
+        {
+            int expand = -1;
+            float expandArea = -1;
+            for(int i = 0; i < leafCount; ++i)
+            {
+                const float area = surfaceArea(leaves[i]->aabb);
+                if(leaves[i]->left && area > expandArea)
+                {
+                    expand = i;
+                    expandArea = area;
+                }
+            }
+            if(expand < 0)
+                break;
+
+            BuildNode *expanded = leaves[expand];
+            internals[internalCount++] = expanded;
+            leaves[expand] = expanded->left;
+            leaves[leafCount++] = expanded->right;
+        }
+
+        const float oldCost = computeTreeletCost(node, settings);
+        if(leafCount < 3)
+        {
+            node->cost = oldCost;
+            return;
+        }
+
+        AABB  bounds[SUBSET_COUNT];
+        float costs[SUBSET_COUNT];
+        int   splits[SUBSET_COUNT];
+
+        const int fullSet = (1 << leafCount) - 1;
+        for(int set = 1; set <= fullSet; ++set)
+        {
+            const int lowBit = set & -set;
+            if(set == lowBit)
+            {
+                int i = 0;
+                while(!(set & (1 << i)))
+                    ++i;
+                bounds[set] = leaves[i]->aabb;
+                costs[set]  = leaves[i]->cost;
+                continue;
+            }
+
+            bounds[set] = bounds[lowBit];
+            unionAABB(bounds[set], bounds[set ^ lowBit]);
+
+            float bestCost = std::numeric_limits<float>::infinity();
+            int bestSplit = 0;
+            for(int sub = (set - 1) & set; sub; sub = (sub - 1) & set)
+            {
+                if(!(sub & lowBit))
+                    continue;
+                const float cost = costs[sub] + costs[set ^ sub];
+                if(cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestSplit = sub;
+                }
+            }
+
+            costs[set] = settings.traversalCost * surfaceArea(bounds[set]) +
+                         bestCost;
+            splits[set] = bestSplit;
+        }
+
+        if(costs[fullSet] >= oldCost * (1 - 1e-5f))
+        {
+            node->cost = oldCost;
+            return;
+        }
+
+        int nextInternal = 1;
+        auto rebuild = [&](auto &self, int set, BuildNode *target) -> BuildNode*
+        {
+            if(!(set & (set - 1)))
+            {
+                int i = 0;
+                while(!(set & (1 << i)))
+                    ++i;
+                return leaves[i];
+            }
+
+            const int left = splits[set];
+            const int right = set ^ left;
+
+            BuildNode *leftNode = (left & (left - 1)) ?
+                internals[nextInternal++] : nullptr;
+            target->left = self(self, left, leftNode);
+
+            BuildNode *rightNode = (right & (right - 1)) ?
+                internals[nextInternal++] : nullptr;
+            target->right = self(self, right, rightNode);
+
+            target->aabb = bounds[set];
+            target->cost = costs[set];
+            return target;
+        };
+
+        rebuild(rebuild, fullSet, node);
+        assert(nextInternal == internalCount);
+    }
+
+    void optimizeTreelets(BuildNode *node, const BVH::BuildSettings &settings)
+    {
+        if(node->left)
+        {
+            optimizeTreelets(node->left, settings);
+            optimizeTreelets(node->right, settings);
+        }
+        restructureTreelet(node, settings);
+    }
+
+    // sorts triangles along the morton curve, then emits the hierarchy by
+    // splitting each range at its highest differing code bit
+    BuildResult buildLBVH(
+        std::vector<BuildTriangle> &triangles,
+        const BVH::BuildSettings   &settings,
+        int                         threadCount,
+        std::vector<Arena>         &arenas,
+        std::vector<BuildSubtree>  &subtrees)
+    {
+        const int n = static_cast<int>(triangles.size());
+        const int mortonBits = settings.mortonBits > 30 ? 63 : 30;
+
+        std::vector<AABB> chunkBounds(threadCount);
+        parallelForChunks(n, threadCount, [&](int chunk, int beg, int end)
+        {
+            for(int i = beg; i < end; ++i)
+                chunkBounds[chunk] |= triangles[i].centroid;
+        });
+
+        AABB centroidBound;
+        for(auto &b : chunkBounds)
+        {
+            if(b.low.x <= b.high.x)
+                unionAABB(centroidBound, b);
+        }
+
+        std::vector<MortonPrimitive> prims(n);
+        parallelForChunks(n, threadCount, [&](int, int beg, int end)
+        {
+            for(int i = beg; i < end; ++i)
+            {
+                prims[i].code = computeMortonCode(
+                    triangles[i].centroid, centroidBound, mortonBits);
+                prims[i].triangle = i;
+            }
+        });
+
+        radixSortMortonPrimitives(prims, mortonBits, threadCount);
+
+        {
+            std::vector<BuildTriangle> sortedTriangles(n);
+            parallelForChunks(n, threadCount, [&](int, int beg, int end)
+            {
+                for(int i = beg; i < end; ++i)
+                    sortedTriangles[i] = triangles[prims[i].triangle];
+            });
+            triangles.swap(sortedTriangles);
+        }
+
+        BuildResult result = { nullptr, 0 };
+
+        if(threadCount == 1)
+        {
+            result.root = emitLBVH(
+                triangles.data(), prims.data(), 0, n,
+                settings, arenas[0], result.node_count);
+        }
+        else
+        {
+            const int targetSubtreeCount = 4 * threadCount;
+
+            std::vector<BuildSubtree> frontier, nextFrontier;
+            frontier.push_back({ &result.root, 0, n, {}, 0 });
+
+            while(!frontier.empty() &&
+                  static_cast<int>(frontier.size()) < targetSubtreeCount)
+            {
+                nextFrontier.clear();
+                for(auto &task : frontier)
+                {
+                    const int middle = splitMortonRange(
+                        prims.data(), task.triBeg, task.triEnd,
+                        (std::max)(settings.leafSizeThreshold,
+                                   PARALLEL_BUILD_GRAIN));
+                    if(middle < 0)
+                    {
+                        subtrees.push_back(task);
+                        continue;
+                    }
+
+                    auto node = arenas[0].create<BuildNode>();
+                    *task.fillbackPtr = node;
+                    ++result.node_count;
+
+                    nextFrontier.push_back(
+                        { &node->left, task.triBeg, middle, {}, 0 });
+                    nextFrontier.push_back(
+                        { &node->right, middle, task.triEnd, {}, 0 });
+                }
+                frontier.swap(nextFrontier);
+            }
+
+            subtrees.insert(subtrees.end(), frontier.begin(), frontier.end());
+
+            parallelForRange(
+                0, static_cast<int>(subtrees.size()), threadCount,
+                [&](int threadIdx, int i)
+            {
+                auto &subtree = subtrees[i];
+                subtree.result.node_count = 0;
+                subtree.result.root = emitLBVH(
+                    triangles.data(), prims.data(),
+                    subtree.triBeg, subtree.triEnd, settings,
+                    arenas[threadIdx + 1], subtree.result.node_count);
+            });
+
+            for(auto &subtree : subtrees)
+            {
+                *subtree.fillbackPtr = subtree.result.root;
+                result.node_count += subtree.result.node_count;
+            }
+
+            fixupLBVHBounds(result.root);
+        }
+
+        // restructuring a treelet only changes the descendants of its root,
+        // so disjoint subtrees may be optimized in parallel before the
+        // levels above them, as in the serial post-order. the subtrees are
+        // found anew for every pass, since the top levels of the previous
+        // pass may have reparented nodes across them
+
+        for(int pass = 0; pass < settings.treeletPasses; ++pass)
+        {
+            std::vector<BuildNode *> roots;
+            if(threadCount != 1)
+            {
+                roots.push_back(result.root);
+                std::vector<BuildNode *> nextRoots;
+                bool expanded = true;
+                while(expanded &&
+                      static_cast<int>(roots.size()) < 4 * threadCount)
+                {
+                    expanded = false;
+                    nextRoots.clear();
+                    for(BuildNode *node : roots)
+                    {
+                        if(!node->left)
+                        {
+                            nextRoots.push_back(node);
+                            continue;
+                        }
+                        nextRoots.push_back(node->left);
+                        nextRoots.push_back(node->right);
+                        expanded = true;
+                    }
+                    roots.swap(nextRoots);
+                }
+            }
+
+            parallelForRange(
+                0, static_cast<int>(roots.size()), threadCount, [&](int, int i)
+            {
+                optimizeTreelets(roots[i], settings);
+            });
+
+            auto optimizeTop = [&](auto &self, BuildNode *node) -> void
+            {
+                if(std::find(roots.begin(), roots.end(), node) != roots.end())
+                    return;
+                if(node->left)
+                {
+                    self(self, node->left);
+                    self(self, node->right);
+                }
+                restructureTreelet(node, settings);
+            };
+            optimizeTop(optimizeTop, result.root);
+        }
+
+        // treelets near the top may reparent nodes across the subtrees of
+        // the build, which must therefore be linearized as a whole
+        if(settings.treeletPasses > 0)
+            subtrees.clear();
+
+        return result;
+    }
+
+    // triangles of a leaf keep their build order, so leaf build ranges map
+    // directly to triArr. subtree roots listed in stopAt are skipped, and
+    // their assigned node index range is recorded instead
+    void linearizeBVH(
+        const BuildNode           *buildNode,
+        const TriangleSource      &source,
+        const BuildTriangle       *triangles,
+        BVH::Node                 *nodeArr,
+        BVH::Triangle             *triArr,
+        uint32_t                   nodeOffset,
+        std::vector<BuildSubtree> *stopAt = nullptr)
+    {
+        struct CompactingTask
+        {
+            const BuildNode *tree;
+            uint32_t *fillbackPtr;
+        };
+
+        uint32_t nextNodeIdx = nodeOffset;
+
+        std::stack<CompactingTask> tasks;
+        tasks.push({ buildNode, nullptr });
+
+        while(!tasks.empty())
+        {
+            const CompactingTask task = tasks.top();
+            tasks.pop();
+
+            const BuildNode *tree = task.tree;
+
+            if(task.fillbackPtr)
+                *task.fillbackPtr = nextNodeIdx;
+
+            if(stopAt)
+            {
+                auto it = std::find_if(
+                    stopAt->begin(), stopAt->end(),
+                    [&](const BuildSubtree &s) { return s.result.root == tree; });
+                if(it != stopAt->end())
+                {
+                    it->nodeOffset = nextNodeIdx;
+                    nextNodeIdx += it->result.node_count;
+                    continue;
+                }
+            }
+
+            if(tree->left && tree->right)
+            {
+                // split axis: the one separating the child centers most.
+                // children are ordered along it so that traversal can
+                // visit the nearer one first from the ray direction sign
+
+                const Float3 leftCenter =
+                    0.5f * (tree->left->aabb.low + tree->left->aabb.high);
+                const Float3 rightCenter =
+                    0.5f * (tree->right->aabb.low + tree->right->aabb.high);
+
+                int axis = 0;
+                float maxSeparation = -1;
+                for(int i = 0; i < 3; ++i)
+                {
+                    const float separation =
+                        std::abs(rightCenter[i] - leftCenter[i]);
+                    if(separation > maxSeparation)
+                    {
+                        axis = i;
+                        maxSeparation = separation;
+                    }
+                }
+
+                const BuildNode *first  = tree->left;
+                const BuildNode *second = tree->right;
+                if(rightCenter[axis] < leftCenter[axis])
+                    std::swap(first, second);
+
+                auto &node = nodeArr[nextNodeIdx++];
+                node.lower      = tree->aabb.low;
+                node.upper      = tree->aabb.high;
+                node.triBeg     = BVH::Node::INTERIOR_TAG |
+                                  static_cast<uint32_t>(axis);
+                node.rightChild = 0;
+                tasks.push({ second, &node.rightChild});
+                tasks.push({ first, nullptr });
+            }
+            else
+            {
+                auto &node = nodeArr[nextNodeIdx++];
+                node.lower   = tree->aabb.low;
+                node.upper   = tree->aabb.high;
+                node.triBeg  = tree->triBeg;
+                node.triEnd  = tree->triEnd;
+
+                for(uint32_t i = tree->triBeg; i < tree->triEnd; ++i)
+                {
+                    const int index = triangles[i].index;
+                    const Float3 &a = source.get(index, 0);
+                    auto &tri = triArr[i];
+
+                    tri.a     = a;
+                    tri.b_a   = source.get(index, 1) - a;
+                    tri.c_a   = source.get(index, 2) - a;
+                    tri.index = index;
+                }
+            }
+        }
+    }
+
+    bool bboxHasIntersection(
+        const BVH::Node &node,
+        const Float3    &ori,
+        const Float3    &invDir,
+        float            t0,
+        float            t1,
+        float           *tNear = nullptr)
+    {
+        const float nx = invDir[0] * (node.lower[0] - ori[0]);
+        const float ny = invDir[1] * (node.lower[1] - ori[1]);
+        const float nz = invDir[2] * (node.lower[2] - ori[2]);
+
+        const float fx = invDir[0] * (node.upper[0] - ori[0]);
+        const float fy = invDir[1] * (node.upper[1] - ori[1]);
+        const float fz = invDir[2] * (node.upper[2] - ori[2]);
+
+        t0 = (std::max)(t0, (std::min)(nx, fx));
+        t0 = (std::max)(t0, (std::min)(ny, fy));
+        t0 = (std::max)(t0, (std::min)(nz, fz));
+
+        // far distances are scaled up to cover rounding errors, so that
+        // rays through an edge shared by two leaves never miss both
+        // (Pharr et al., 3rd edition, 3.9.2)
+        constexpr float FAR_SCALE = 1 + 2 * 3 * (
+            std::numeric_limits<float>::epsilon() * 0.5f) / (1 - 3 * (
+            std::numeric_limits<float>::epsilon() * 0.5f));
+
+        t1 = (std::min)(t1, FAR_SCALE * (std::max)(nx, fx));
+        t1 = (std::min)(t1, FAR_SCALE * (std::max)(ny, fy));
+        t1 = (std::min)(t1, FAR_SCALE * (std::max)(nz, fz));
+
+        if(tNear)
+            *tNear = t0;
+        return t0 <= t1;
+    }
+
+    bool isLeaf(const BVH::Node &node)
+    {
+        return node.isLeaf();
+    }
+
+    struct ClosestTraversalEntry
+    {
+        uint32_t node;
+        float    tNear;
+    };
+
+    thread_local uint32_t traversalStack[BVH::TRAVERSAL_STACK_SIZE];
+    thread_local ClosestTraversalEntry
+        closestTraversalStack[BVH::TRAVERSAL_STACK_SIZE];
+
+    void buildTriangleBlocks(
+        const TriangleSource             &source,
+        const std::vector<BVH::Node>     &nodes,
+        const std::vector<BVH::Triangle> &triangles,
+        std::vector<TriangleBlock>       &blocks,
+        std::vector<uint32_t>            &blockOffsets)
+    {
+        constexpr int SIZE = TriangleBlock::SIZE;
+
+        blockOffsets.resize(nodes.size() + 1);
+        blockOffsets[0] = 0;
+
+        for(size_t ni = 0; ni < nodes.size(); ++ni)
+        {
+            const BVH::Node &node = nodes[ni];
+
+            uint32_t blockCount = 0;
+            if(isLeaf(node))
+                blockCount = (node.triEnd - node.triBeg + SIZE - 1) / SIZE;
+            blockOffsets[ni + 1] = blockOffsets[ni] + blockCount;
+        }
+
+        blocks.resize(blockOffsets.back());
+
+        for(size_t ni = 0; ni < nodes.size(); ++ni)
+        {
+            const BVH::Node &node = nodes[ni];
+            if(!isLeaf(node))
+                continue;
+
+            for(uint32_t bi = blockOffsets[ni]; bi < blockOffsets[ni + 1]; ++bi)
+            {
+                TriangleBlock &block = blocks[bi];
+                const uint32_t triBeg =
+                    node.triBeg + (bi - blockOffsets[ni]) * SIZE;
+
+                for(int lane = 0; lane < SIZE; ++lane)
+                {
+                    const uint32_t ti = triBeg + lane;
+                    if(ti >= node.triEnd)
+                    {
+                        for(auto &row : block.v)
+                            row[lane] = std::numeric_limits<float>::quiet_NaN();
+                        block.index[lane] = -1;
+                        continue;
+                    }
+
+                    const int index = triangles[ti].index;
+                    for(int i = 0; i < 3; ++i)
+                    {
+                        const Float3 &v = source.get(index, i);
+                        for(int axis = 0; axis < 3; ++axis)
+                            block.v[3 * i + axis][lane] = v[axis];
+                    }
+                    block.index[lane] = index;
+                }
+            }
+        }
+    }
+
+} // namespace anonymous
+
+BVH BVH::create(const Float3 *triangle_vertices, int triangle_count)
+{
+    return create(triangle_vertices, nullptr, triangle_count, BuildSettings{});
+}
+
+BVH BVH::create(
+    const Float3        *triangle_vertices,
+    int                  triangle_count,
+    const BuildSettings &settings)
+{
+    return create(triangle_vertices, nullptr, triangle_count, settings);
+}
+
+BVH BVH::create(
+    const Float3   *vertices,
+    const uint32_t *indices,
+    int             triangle_count)
+{
+    return create(vertices, indices, triangle_count, BuildSettings{});
+}
+
+BVH BVH::create(
+    const Float3        *vertices,
+    const uint32_t      *indices,
+    int                  triangle_count,
+    const BuildSettings &settings)
+{
+    assert(vertices && triangle_count > 0);
+
+    const TriangleSource source = { vertices, indices };
+
+    std::vector<BuildTriangle> build_triangles(triangle_count);
+    for(int i = 0; i < triangle_count; ++i)
+    {
+        const Float3 &a = source.get(i, 0);
+        const Float3 &b = source.get(i, 1);
+        const Float3 &c = source.get(i, 2);
+
+        auto &dst = build_triangles[i];
+        dst.bounds |= a;
+        dst.bounds |= b;
+        dst.bounds |= c;
+        dst.centroid    = (a + b + c) / 3.0f;
+        dst.index       = i;
+    }
+
+    int threadCount = resolveThreadCount(settings.threadCount);
+    if(triangle_count <= PARALLEL_BUILD_GRAIN)
+        threadCount = 1;
+
+    // arenas[0] holds the top levels, arenas[threadIdx + 1] the subtrees
+    // built by each scheduler worker
+    std::vector<Arena> arenas(
+        (threadCount == 1 ? 1 : TaskScheduler::getDefault().getThreadCount()) + 1);
+    std::vector<BuildSubtree> subtrees;
+
+    BuildResult buildResult;
+    if(settings.splitMethod == SplitMethod::SBVH)
+    {
+        buildResult = buildSBVH(source, build_triangles, settings, arenas[0]);
+    }
+    else if(settings.splitMethod == SplitMethod::LBVH)
+    {
+        buildResult = buildLBVH(
+            build_triangles, settings, threadCount, arenas, subtrees);
+    }
+    else if(threadCount > 1)
+    {
+        buildResult = buildLinkedBVHParallel(
+            build_triangles.data(), triangle_count,
+            settings, threadCount, arenas, subtrees);
+    }
+    else
+    {
+        buildResult = buildLinkedBVH(
+            build_triangles.data(), 0, triangle_count, settings, arenas[0]);
+    }
+
+    // SBVH leaves may refer to a triangle more than once
+    std::vector<BVH::Triangle> triangles(build_triangles.size());
+
+    std::vector<BVH::Node> nodes(buildResult.node_count);
+    linearizeBVH(
+        buildResult.root, source, build_triangles.data(),
+        nodes.data(), triangles.data(), 0,
+        subtrees.empty() ? nullptr : &subtrees);
+
+    parallelForRange(
+        0, static_cast<int>(subtrees.size()), threadCount, [&](int, int i)
+    {
+        linearizeBVH(
+            subtrees[i].result.root, source, build_triangles.data(),
+            nodes.data(), triangles.data(),
+            subtrees[i].nodeOffset);
+    });
+
+    // the build tree and references are not needed anymore. releasing them
+    // keeps them from adding to the peak memory of the block arrays
+
+    build_triangles = {};
+    subtrees        = {};
+    arenas          = {};
+
+    std::vector<TriangleBlock> blocks;
+    std::vector<uint32_t> blockOffsets;
+    buildTriangleBlocks(
+        source, nodes, triangles, blocks, blockOffsets);
+
+    // parent links for stackless traversal
+    std::vector<uint32_t> parents(nodes.size());
+    parents[0] = Node::TRI_NIL;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        if(!isLeaf(nodes[i]))
+        {
+            parents[i + 1] = static_cast<uint32_t>(i);
+            parents[nodes[i].rightChild] = static_cast<uint32_t>(i);
+        }
+    }
+
+    BVH bvh;
+    bvh.nodes_        = MappableArray<Node>(std::move(nodes));
+    bvh.triangles_    = MappableArray<Triangle>(std::move(triangles));
+    bvh.blocks_       = MappableArray<TriangleBlock>(std::move(blocks));
+    bvh.blockOffsets_ = MappableArray<uint32_t>(std::move(blockOffsets));
+    bvh.parents_      = MappableArray<uint32_t>(std::move(parents));
+
+    bvh.inputTriangleCount_ = triangle_count;
+
+    return bvh;
+}
+
+int BVH::getNodeCount() const
+{
+    return static_cast<int>(nodes_.size());
+}
+
+int BVH::getTriangleCount() const
+{
+    return static_cast<int>(triangles_.size());
+}
+
+std::span<const BVH::Node> BVH::getNodes() const
+{
+    return nodes_.span();
+}
+
+std::span<const BVH::Triangle> BVH::getTriangles() const
+{
+    return triangles_.span();
+}
+
+bool BVH::empty() const
+{
+    return nodes_.empty();
+}
+
+void BVH::refit(const Float3 *triangleVertices)
+{
+    refit(triangleVertices, nullptr);
+}
+
+void BVH::refit(const Float3 *vertices, const uint32_t *indices)
+{
+    const TriangleSource source = { vertices, indices };
+
+    Node          *nodes     = nodes_.makeMutable();
+    Triangle      *triangles = triangles_.makeMutable();
+    TriangleBlock *blocks    = blocks_.makeMutable();
+
+    for(size_t i = 0; i < triangles_.size(); ++i)
+    {
+        Triangle &tri = triangles[i];
+        const Float3 &a = source.get(tri.index, 0);
+        tri.a   = a;
+        tri.b_a = source.get(tri.index, 1) - a;
+        tri.c_a = source.get(tri.index, 2) - a;
+    }
+
+    for(size_t i = 0; i < blocks_.size(); ++i)
+    {
+        TriangleBlock &block = blocks[i];
+        for(int lane = 0; lane < TriangleBlock::SIZE; ++lane)
+        {
+            if(block.index[lane] < 0)
+                continue;
+
+            for(int j = 0; j < 3; ++j)
+            {
+                const Float3 &v = source.get(block.index[lane], j);
+                for(int axis = 0; axis < 3; ++axis)
+                    block.v[3 * j + axis][lane] = v[axis];
+            }
+        }
+    }
+
+    // children always follow their parent, so a reverse sweep visits
+    // them first
+
+    for(size_t i = nodes_.size(); i-- > 0;)
+    {
+        Node &node = nodes[i];
+
+        AABB aabb;
+        if(isLeaf(node))
+        {
+            for(uint32_t j = node.triBeg; j < node.triEnd; ++j)
+            {
+                for(int k = 0; k < 3; ++k)
+                    aabb |= source.get(triangles[j].index, k);
+            }
+        }
+        else
+        {
+            const Node &left  = nodes[i + 1];
+            const Node &right = nodes[node.rightChild];
+            aabb |= left.lower;
+            aabb |= left.upper;
+            aabb |= right.lower;
+            aabb |= right.upper;
+        }
+
+        node.lower = aabb.low;
+        node.upper = aabb.high;
+    }
+}
+
+size_t BVH::getMemoryUsage() const
+{
+    return sizeof(Node)          * nodes_.size()
+         + sizeof(Triangle)      * triangles_.size()
+         + sizeof(TriangleBlock) * blocks_.size()
+         + sizeof(uint32_t)      * blockOffsets_.size()
+         + sizeof(uint32_t)      * parents_.size();
+}
+
+float BVH::computeSAHCost(float traversalCost, float intersectionCost) const
+{
+    if(nodes_.empty())
+        return 0;
+
+    auto nodeArea = [](const Node &node)
+    {
+        AABB aabb;
+        aabb.low  = node.lower;
+        aabb.high = node.upper;
+        return surfaceArea(aabb);
+    };
+
+    const float rootArea = nodeArea(nodes_[0]);
+    if(rootArea <= 0)
+        return 0;
+
+    float cost = 0;
+    for(auto &node : nodes_)
+    {
+        const float area = nodeArea(node);
+        if(isLeaf(node))
+            cost += intersectionCost * area * (node.triEnd - node.triBeg);
+        else
+            cost += traversalCost * area;
+    }
+
+    return cost / rootArea;
+}
+
+bool BVH::hasIntersection(const Ray &ray) const
+{
+    return hasIntersection<DEFAULT_TRIANGLE_KERNEL>(ray);
+}
+
+bool BVH::findIntersection(const Ray &ray, Intersection *inct) const
+{
+    return findIntersection<DEFAULT_TRIANGLE_KERNEL>(ray, inct);
+}
+
+template<BVH::TriangleKernel K>
+bool BVH::hasIntersectionWithLeaf(
+    uint32_t nodeIdx, const Ray &ray, const TriangleBlockRay &blockRay) const
+{
+    if constexpr(K == TriangleKernel::Scalar)
+    {
+        const Node &node = nodes_[nodeIdx];
+        for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+        {
+            const Triangle &tri = triangles_[i];
+            if(hasIntersectionWithTriangle(ray, tri.a, tri.b_a, tri.c_a))
+                return true;
+        }
+    }
+    else
+    {
+        const uint32_t blockEnd = blockOffsets_[nodeIdx + 1];
+        for(uint32_t i = blockOffsets_[nodeIdx]; i < blockEnd; ++i)
+        {
+            const int mask = K == TriangleKernel::SIMD ?
+                intersectTriangleBlock(
+                    blocks_[i], blockRay, ray.t0, ray.t1,
+                    nullptr, nullptr, nullptr) :
+                intersectTriangleBlockWatertight(
+                    blocks_[i], ray, blockRay, ray.t0, ray.t1,
+                    nullptr, nullptr, nullptr);
+            if(mask)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+template<BVH::TriangleKernel K>
+void BVH::closestIntersectionWithLeaf(
+    uint32_t                nodeIdx,
+    Ray                    &r,
+    const TriangleBlockRay &blockRay,
+    ClosestHit             &hit) const
+{
+    if constexpr(K == TriangleKernel::Scalar)
+    {
+        const Node &node = nodes_[nodeIdx];
+        for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+        {
+            const Triangle &tri = triangles_[i];
+            if(closestIntersectionWithTriangle(
+                r, tri.a, tri.b_a, tri.c_a, &hit.t, &hit.uv))
+            {
+                r.t1 = hit.t;
+                hit.triangle = tri.index;
+            }
+        }
+    }
+    else
+    {
+        alignas(32) float t[TriangleBlock::SIZE];
+        alignas(32) float u[TriangleBlock::SIZE];
+        alignas(32) float v[TriangleBlock::SIZE];
+
+        const uint32_t blockEnd = blockOffsets_[nodeIdx + 1];
+        for(uint32_t i = blockOffsets_[nodeIdx]; i < blockEnd; ++i)
+        {
+            int mask = K == TriangleKernel::SIMD ?
+                intersectTriangleBlock(
+                    blocks_[i], blockRay, r.t0, r.t1, t, u, v) :
+                intersectTriangleBlockWatertight(
+                    blocks_[i], r, blockRay, r.t0, r.t1, t, u, v);
+
+            while(mask)
+            {
+                const int lane = std::countr_zero(static_cast<unsigned>(mask));
+                mask &= mask - 1;
+
+                if(t[lane] <= r.t1)
+                {
+                    r.t1         = t[lane];
+                    hit.t        = t[lane];
+                    hit.uv       = Float2(u[lane], v[lane]);
+                    hit.triangle = blocks_[i].index[lane];
+                }
+            }
+        }
+    }
+}
+
+template<typename VisitLeaf>
+void BVH::traverseStackless(
+    const Ray &ray, const Float3 &invDir, const VisitLeaf &visitLeaf) const
+{
+    // Hapala et al., Efficient Stack-less BVH Traversal for Ray Tracing.
+    // the node last visited and the direction it was entered from are
+    // the whole traversal state: parent links lead back up the tree and
+    // the near/far order is recomputed from the split axis of the parent
+
+    const bool dirIsNeg[4] = { ray.d.x < 0, ray.d.y < 0, ray.d.z < 0, false };
+
+    auto nearChild = [&](uint32_t nodeIdx)
+    {
+        const Node &node = nodes_[nodeIdx];
+        return dirIsNeg[node.getSplitAxis()] ? node.rightChild : nodeIdx + 1;
+    };
+
+    auto farChild = [&](uint32_t nodeIdx)
+    {
+        const Node &node = nodes_[nodeIdx];
+        return dirIsNeg[node.getSplitAxis()] ? nodeIdx + 1 : node.rightChild;
+    };
+
+    if(isLeaf(nodes_[0]))
+    {
+        BVH_STATS(++bvhRayStats.nodes);
+        visitLeaf(0u);
+        return;
+    }
+
+    enum class From { Parent, Sibling, Child };
+
+    uint32_t current = nearChild(0);
+    From from = From::Parent;
+
+    for(;;)
+    {
+        if(from == From::Child)
+        {
+            if(current == 0)
+                return;
+
+            const uint32_t parent = parents_[current];
+            if(current == nearChild(parent))
+            {
+                current = farChild(parent);
+                from = From::Sibling;
+            }
+            else
+            {
+                current = parent;
+                from = From::Child;
+            }
+            continue;
+        }
+
+        // ray.t1 may have been shortened by visitLeaf since the parent was
+        // entered, so far subtrees are culled against the current hit
+
+        const Node &node = nodes_[current];
+        BVH_STATS(++bvhRayStats.boxes);
+        if(bboxHasIntersection(node, ray.o, invDir, ray.t0, ray.t1))
+        {
+            BVH_STATS(++bvhRayStats.nodes);
+            if(!isLeaf(node))
+            {
+                current = nearChild(current);
+                from = From::Parent;
+                continue;
+            }
+
+            if(visitLeaf(current))
+                return;
+        }
+
+        if(from == From::Parent)
+        {
+            current = farChild(parents_[current]);
+            from = From::Sibling;
+        }
+        else
+        {
+            current = parents_[current];
+            from = From::Child;
+        }
+    }
+}
+
+template<BVH::TriangleKernel K, BVH::TraversalMode T>
+bool BVH::hasIntersection(const Ray &ray) const
+{
+    BVH_STATS(BVHRayStatsScope statsScope);
+
+    const Float3 invDir = { 1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z };
+
+    BVH_STATS(++bvhRayStats.boxes);
+    if(!bboxHasIntersection(nodes_[0], ray.o, invDir, ray.t0, ray.t1))
+        return false;
+
+    const TriangleBlockRay blockRay(ray);
+
+    if constexpr(T == TraversalMode::Stackless)
+    {
+        bool result = false;
+        traverseStackless(ray, invDir, [&](uint32_t nodeIdx)
+        {
+            BVH_STATS(bvhRayStats.triangles +=
+                nodes_[nodeIdx].triEnd - nodes_[nodeIdx].triBeg);
+            result = hasIntersectionWithLeaf<K>(nodeIdx, ray, blockRay);
+            BVH_STATS(bvhRayStats.earlyOuts += result);
+            return result;
+        });
+        return result;
+    }
+    else
+    {
+        const bool dirIsNeg[4] = {
+            ray.d.x < 0, ray.d.y < 0, ray.d.z < 0, false
+        };
+
+        uint32_t taskNodeIdx = 0;
+        int top = 0;
+
+        for(;;)
+        {
+            const Node &node = nodes_[taskNodeIdx];
+            BVH_STATS(++bvhRayStats.nodes);
+
+            if(!isLeaf(node))
+            {
+                // descend into the near child, keeping the far one for later
+
+                uint32_t nearIdx = taskNodeIdx + 1, farIdx = node.rightChild;
+                if(dirIsNeg[node.getSplitAxis()])
+                    std::swap(nearIdx, farIdx);
+
+                BVH_STATS(bvhRayStats.boxes += 2);
+                const bool hitNear = bboxHasIntersection(
+                    nodes_[nearIdx], ray.o, invDir, ray.t0, ray.t1);
+                const bool hitFar = bboxHasIntersection(
+                    nodes_[farIdx], ray.o, invDir, ray.t0, ray.t1);
+
+                if(hitNear && hitFar)
+                {
+                    assert(top < TRAVERSAL_STACK_SIZE);
+                    traversalStack[top++] = farIdx;
+                    BVH_STATS(bvhRayStats.onStackDepth(top));
+                    taskNodeIdx = nearIdx;
+                    continue;
+                }
+
+                if(hitNear || hitFar)
+                {
+                    taskNodeIdx = hitNear ? nearIdx : farIdx;
+                    continue;
+                }
+            }
+            else
+            {
+                BVH_STATS(bvhRayStats.triangles += node.triEnd - node.triBeg);
+                if(hasIntersectionWithLeaf<K>(taskNodeIdx, ray, blockRay))
+                {
+                    BVH_STATS(++bvhRayStats.earlyOuts);
+                    return true;
+                }
+            }
+
+            if(!top)
+                break;
+            taskNodeIdx = traversalStack[--top];
+        }
+
+        return false;
+    }
+}
+
+template<BVH::TriangleKernel K, BVH::TraversalMode T>
+bool BVH::findIntersection(const Ray &ray, Intersection *inct) const
+{
+    BVH_STATS(BVHRayStatsScope statsScope);
+
+    auto r = ray;
+    const Float3 invDir = { 1 / r.d.x, 1 / r.d.y, 1 / r.d.z };
+
+    BVH_STATS(++bvhRayStats.boxes);
+    if(!bboxHasIntersection(nodes_[0], r.o, invDir, r.t0, r.t1))
+        return false;
+
+    const TriangleBlockRay blockRay(r);
+
+    ClosestHit hit;
+    hit.t = std::numeric_limits<float>::infinity();
+
+    if constexpr(T == TraversalMode::Stackless)
+    {
+        traverseStackless(r, invDir, [&](uint32_t nodeIdx)
+        {
+            BVH_STATS(bvhRayStats.triangles +=
+                nodes_[nodeIdx].triEnd - nodes_[nodeIdx].triBeg);
+            closestIntersectionWithLeaf<K>(nodeIdx, r, blockRay, hit);
+            return false;
+        });
+    }
+    else
+    {
+        const bool dirIsNeg[4] = { r.d.x < 0, r.d.y < 0, r.d.z < 0, false };
+
+        // the near child is visited directly and only the far one is
+        // pushed. entries remember where the ray enters their box, so that
+        // subtrees behind a hit found after they were pushed are skipped
+
+        uint32_t taskNodeIdx = 0;
+        int top = 0;
+
+        for(;;)
+        {
+            const Node &node = nodes_[taskNodeIdx];
+            BVH_STATS(++bvhRayStats.nodes);
+
+            if(!isLeaf(node))
+            {
+                uint32_t nearIdx = taskNodeIdx + 1, farIdx = node.rightChild;
+                if(dirIsNeg[node.getSplitAxis()])
+                    std::swap(nearIdx, farIdx);
+
+                BVH_STATS(bvhRayStats.boxes += 2);
+                float nearT, farT;
+                const bool hitNear = bboxHasIntersection(
+                    nodes_[nearIdx], r.o, invDir, r.t0, r.t1, &nearT);
+                const bool hitFar = bboxHasIntersection(
+                    nodes_[farIdx], r.o, invDir, r.t0, r.t1, &farT);
+
+                if(hitNear && hitFar)
+                {
+                    assert(top < TRAVERSAL_STACK_SIZE);
+                    closestTraversalStack[top++] = { farIdx, farT };
+                    BVH_STATS(bvhRayStats.onStackDepth(top));
+                    taskNodeIdx = nearIdx;
+                    continue;
+                }
+
+                if(hitNear || hitFar)
+                {
+                    taskNodeIdx = hitNear ? nearIdx : farIdx;
+                    continue;
+                }
+            }
+            else
+            {
+                BVH_STATS(bvhRayStats.triangles += node.triEnd - node.triBeg);
+                closestIntersectionWithLeaf<K>(taskNodeIdx, r, blockRay, hit);
+            }
+
+            while(top && closestTraversalStack[top - 1].tNear > r.t1)
+            {
+                BVH_STATS(++bvhRayStats.earlyOuts);
+                --top;
+            }
+            if(!top)
+                break;
+            taskNodeIdx = closestTraversalStack[--top].node;
+        }
+    }
+
+    if(isinf(hit.t))
+        return false;
+
+    inct->triangle = static_cast<int>(hit.triangle);
+    inct->position = r.at(hit.t); // IMPROVE: better precision
+    inct->t        = hit.t;
+    inct->uv       = hit.uv;
 
     return true;
 }
+
+template bool BVH::hasIntersection<BVH::TriangleKernel::Scalar,     BVH::TraversalMode::Stack>    (const Ray &) const;
+template bool BVH::hasIntersection<BVH::TriangleKernel::SIMD,       BVH::TraversalMode::Stack>    (const Ray &) const;
+template bool BVH::hasIntersection<BVH::TriangleKernel::Watertight, BVH::TraversalMode::Stack>    (const Ray &) const;
+template bool BVH::hasIntersection<BVH::TriangleKernel::Scalar,     BVH::TraversalMode::Stackless>(const Ray &) const;
+template bool BVH::hasIntersection<BVH::TriangleKernel::SIMD,       BVH::TraversalMode::Stackless>(const Ray &) const;
+template bool BVH::hasIntersection<BVH::TriangleKernel::Watertight, BVH::TraversalMode::Stackless>(const Ray &) const;
+
+template bool BVH::findIntersection<BVH::TriangleKernel::Scalar,     BVH::TraversalMode::Stack>    (const Ray &, Intersection *) const;
+template bool BVH::findIntersection<BVH::TriangleKernel::SIMD,       BVH::TraversalMode::Stack>    (const Ray &, Intersection *) const;
+template bool BVH::findIntersection<BVH::TriangleKernel::Watertight, BVH::TraversalMode::Stack>    (const Ray &, Intersection *) const;
+template bool BVH::findIntersection<BVH::TriangleKernel::Scalar,     BVH::TraversalMode::Stackless>(const Ray &, Intersection *) const;
+template bool BVH::findIntersection<BVH::TriangleKernel::SIMD,       BVH::TraversalMode::Stackless>(const Ray &, Intersection *) const;
+template bool BVH::findIntersection<BVH::TriangleKernel::Watertight, BVH::TraversalMode::Stackless>(const Ray &, Intersection *) const;
@@ -1,6 +1,10 @@
 #pragma once
 
-#include <common/ray.h>
+#include <string>
+
+#include <common/mappable_array.h>
+#include <common/ray_packet.h>
+#include <common/triangle_block.h>
 
 class BVH
 {
@@ -17,10 +21,13 @@ public:
         static constexpr uint32_t TRI_NIL =
             (std::numeric_limits<uint32_t>::max)();
 
+        // interior nodes have triBeg = INTERIOR_TAG | splitAxis
+        static constexpr uint32_t INTERIOR_TAG = TRI_NIL & ~3u;
+
         Float3 lower;
         Float3 upper;
 
-        // interior node when prim_beg == TRI_NIL
+        // interior node when triBeg >= INTERIOR_TAG
         // left_child is *(this + 1)
         uint32_t triBeg;
 
@@ -29,6 +36,18 @@ public:
             uint32_t triEnd;
             uint32_t rightChild;
         };
+
+        bool isLeaf() const
+        {
+            return triBeg < INTERIOR_TAG;
+        }
+
+        // axis along which the left child lies before the right one,
+        // or 3 when unknown (triBeg == TRI_NIL)
+        int getSplitAxis() const
+        {
+            return static_cast<int>(triBeg & 3);
+        }
     };
 
     struct Intersection
@@ -39,16 +58,255 @@ public:
         float  t;
     };
 
+    enum class SplitMethod
+    {
+        Middle, // split at the centroid median along the longest axis
+        SAH,    // binned surface area heuristic
+        LBVH,   // linear BVH over sorted morton codes, for fast rebuilds
+        SBVH    // SAH with spatial splits that clip straddling triangles.
+                // slower, single-threaded build for meshes with long,
+                // thin triangles. leaves may share triangles
+    };
+
+    struct BuildSettings
+    {
+        SplitMethod splitMethod = SplitMethod::SAH;
+
+        // Middle/LBVH: nodes with no more triangles than this become leaves
+        int leafSizeThreshold = 4;
+
+        // SAH: leaves are created when they are cheaper than the best split,
+        // but never hold more triangles than this
+        int maxLeafSize = 16;
+        int binCount    = 16;
+
+        // SBVH: spatial splits are only tried where the children of the
+        // best object split overlap by more than this fraction of the
+        // root surface area
+        float spatialSplitAlpha = 1e-5f;
+
+        // SBVH: number of extra triangle references spatial splits may
+        // create, relative to the triangle count
+        float spatialSplitBudget = 0.3f;
+
+        float traversalCost    = 1;
+        float intersectionCost = 1;
+
+        // LBVH: 30 or 63 bit morton codes
+        int mortonBits = 30;
+
+        // LBVH: number of bottom-up treelet restructuring passes, and the
+        // maximal number of leaves (<= 7) of each treelet
+        int treeletPasses = 0;
+        int treeletSize   = 7;
+
+        // parallelism of the build. 1 builds on the calling thread, other
+        // values run on TaskScheduler::getDefault() and split the top
+        // levels into 4 * threadCount subtrees. values <= 0 are added to
+        // the thread count of the scheduler. the built tree is the same
+        // for any value
+        int threadCount = 0;
+    };
+
+    // leaf triangle test used by single-ray traversal
+    enum class TriangleKernel
+    {
+        Scalar,    // Moller-Trumbore, one triangle at a time. for reference
+        SIMD,      // Moller-Trumbore over SoA triangle blocks
+        Watertight // Woop et al. watertight test over SoA triangle blocks
+    };
+
+    static constexpr TriangleKernel DEFAULT_TRIANGLE_KERNEL =
+        TriangleKernel::SIMD;
+
+    // how single-ray queries walk the tree. both visit the child on the
+    // near side of the split first and cull boxes beyond the closest hit
+    enum class TraversalMode
+    {
+        Stack,    // thread_local stack of TRAVERSAL_STACK_SIZE entries
+        Stackless // parent links only. for fibers, coroutines and deep trees
+    };
+
     static constexpr int TRAVERSAL_STACK_SIZE = 256;
 
     static BVH create(const Float3 *triangleVertices, int triangleCount);
 
+    static BVH create(
+        const Float3        *triangleVertices,
+        int                  triangleCount,
+        const BuildSettings &settings);
+
+    // indexed meshes: triangle i has the vertices indices[3i], indices[3i+1]
+    // and indices[3i+2], and is reported as Intersection::triangle i.
+    // the mesh is not copied, and a null indices reads vertices as a
+    // triangle soup
+    static BVH create(
+        const Float3   *vertices,
+        const uint32_t *indices,
+        int             triangleCount);
+
+    static BVH create(
+        const Float3        *vertices,
+        const uint32_t      *indices,
+        int                  triangleCount,
+        const BuildSettings &settings);
+
+    int getNodeCount() const;
+
+    // number of leaf triangle references. exceeds the input triangle count
+    // when an SBVH build split some of them
+    int getTriangleCount() const;
+
+    std::span<const Node> getNodes() const;
+
+    std::span<const Triangle> getTriangles() const;
+
+    bool empty() const;
+
+    size_t getMemoryUsage() const;
+
+    // expected cost of tracing a ray through the tree under the SAH model,
+    // relative to the root bounding box
+    float computeSAHCost(
+        float traversalCost = 1, float intersectionCost = 1) const;
+
+    // recomputes triangles and bounds after the vertices moved, keeping
+    // the topology. triangleVertices has the same layout as in create.
+    // leaves of split references get the bounds of the whole triangles
+    void refit(const Float3 *triangleVertices);
+
+    // refit for a BVH created from an indexed mesh with the same indices
+    void refit(const Float3 *vertices, const uint32_t *indices);
+
+    // hash of the input of create, used to key cache files
+    static uint64_t computeCacheKey(
+        const Float3        *triangleVertices,
+        int                  triangleCount,
+        const BuildSettings &settings);
+
+    static uint64_t computeCacheKey(
+        const Float3        *vertices,
+        int                  vertexCount,
+        const uint32_t      *indices,
+        int                  triangleCount,
+        const BuildSettings &settings);
+
+    // writes the tree into a versioned binary file.
+    // returns false when the file cannot be written
+    bool saveToFile(const std::string &filename, uint64_t key) const;
+
+    // maps a file written by saveToFile and uses its content in place.
+    // returns an empty BVH when the file is missing, corrupted, from another
+    // version or keyed differently. triangle indices are checked against
+    // the input triangle count stored in the file, which createCached also
+    // compares with its own input
+    static BVH loadFromFile(const std::string &filename, uint64_t key);
+
+    // loads cacheFilename when it matches the input, otherwise builds the
+    // tree and writes it to cacheFilename
+    static BVH createCached(
+        const Float3        *triangleVertices,
+        int                  triangleCount,
+        const BuildSettings &settings,
+        const std::string   &cacheFilename);
+
+    static BVH createCached(
+        const Float3        *vertices,
+        int                  vertexCount,
+        const uint32_t      *indices,
+        int                  triangleCount,
+        const BuildSettings &settings,
+        const std::string   &cacheFilename);
+
+    bool hasIntersection(const Ray &ray) const;
+
+    bool findIntersection(const Ray &ray, Intersection *inct) const;
+
+    template<TriangleKernel K, TraversalMode T = TraversalMode::Stack>
     bool hasIntersection(const Ray &ray) const;
 
+    template<TriangleKernel K, TraversalMode T = TraversalMode::Stack>
     bool findIntersection(const Ray &ray, Intersection *inct) const;
 
+    // packet queries. bit i of the result is set when ray i hits.
+    // rays whose bit is cleared in activeMask are skipped
+    template<int N>
+    uint32_t hasIntersection(
+        const RayPacket<N> &packet, uint32_t activeMask) const;
+
+    // incts[i] is only written for rays that hit
+    template<int N>
+    uint32_t findIntersection(
+        const RayPacket<N> &packet,
+        uint32_t            activeMask,
+        Intersection       *incts) const;
+
+    // stream queries over arbitrary ray arrays, traced as packets of
+    // consecutive rays. hitMask must hold (rayCount + 31) / 32 words
+    void hasIntersection(
+        const Ray *rays, int rayCount, uint32_t *hitMask) const;
+
+    void findIntersection(
+        const Ray    *rays,
+        int           rayCount,
+        uint32_t     *hitMask,
+        Intersection *incts) const;
+
+    // occlusion of a batch of rays sharing an origin and [t0, t1], such as
+    // the hemisphere samples of a vertex. the batch walks the tree once,
+    // with a mask of the rays still active at each node.
+    // when visibleMask is given, bit i of it is set when ray i hits
+    // nothing; it must hold (rayCount + 31) / 32 words.
+    // returns the number of unoccluded rays
+    int computeVisibility(
+        const Float3 &origin,
+        const Float3 *directions,
+        int           rayCount,
+        float         t0,
+        float         t1,
+        uint32_t     *visibleMask) const;
+
 private:
 
-    std::vector<Node>     nodes_;
-    std::vector<Triangle> triangles_;
+    struct ClosestHit
+    {
+        uint32_t triangle = 0;
+        Float2   uv;
+        float    t;
+    };
+
+    template<TriangleKernel K>
+    bool hasIntersectionWithLeaf(
+        uint32_t nodeIdx, const Ray &ray, const TriangleBlockRay &blockRay) const;
+
+    // shortens r.t1 to the closest hit found so far
+    template<TriangleKernel K>
+    void closestIntersectionWithLeaf(
+        uint32_t                nodeIdx,
+        Ray                    &r,
+        const TriangleBlockRay &blockRay,
+        ClosestHit             &hit) const;
+
+    // visits the leaves hit by ray in front-to-back order until
+    // visitLeaf(nodeIdx) returns true
+    template<typename VisitLeaf>
+    void traverseStackless(
+        const Ray &ray, const Float3 &invDir, const VisitLeaf &visitLeaf) const;
+
+    // arrays are either built in memory or views of a mapped cache file
+
+    MappableArray<Node>     nodes_;
+    MappableArray<Triangle> triangles_;
+
+    // leaf triangles regrouped into SoA blocks. the blocks of node i are
+    // [blockOffsets_[i], blockOffsets_[i + 1])
+    MappableArray<TriangleBlock> blocks_;
+    MappableArray<uint32_t>      blockOffsets_;
+
+    // parent of each node, TRI_NIL for the root
+    MappableArray<uint32_t> parents_;
+
+    // triangle count passed to create. triangle and block indices are
+    // below it
+    int inputTriangleCount_ = 0;
 };
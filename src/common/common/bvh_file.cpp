@@ -0,0 +1,386 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <common/bvh.h>
+#include <common/mapped_file.h>
+
+namespace
+{
+
+    constexpr char BVH_FILE_MAGIC[8] = { 'G', '2', '0', '2', 'B', 'V', 'H', 0 };
+
+    // bump when the layout of the file or of any stored struct changes
+    constexpr uint32_t BVH_FILE_VERSION = 3;
+
+    // sections are aligned so that mapped arrays can be used in place
+    constexpr uint64_t BVH_FILE_SECTION_ALIGN = 64;
+
+    enum BVHFileSection
+    {
+        NODES,
+        TRIANGLES,
+        BLOCKS,
+        BLOCK_OFFSETS,
+        PARENTS,
+        SECTION_COUNT
+    };
+
+    struct BVHFileHeader
+    {
+        struct Section
+        {
+            uint64_t offset;
+            uint64_t count;
+        };
+
+        char     magic[8];
+        uint32_t version;
+        uint32_t blockSize;
+        uint64_t key;
+        uint64_t inputTriangleCount;
+        Section  sections[SECTION_COUNT];
+    };
+
+    class FNV1a
+    {
+        uint64_t hash_ = 14695981039346656037ull;
+
+    public:
+
+        void update(const void *data, size_t size)
+        {
+            auto bytes = static_cast<const unsigned char *>(data);
+            for(size_t i = 0; i < size; ++i)
+            {
+                hash_ ^= bytes[i];
+                hash_ *= 1099511628211ull;
+            }
+        }
+
+        template<typename T>
+        void update(const T &value)
+        {
+            static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+            update(&value, sizeof(T));
+        }
+
+        uint64_t get() const
+        {
+            return hash_;
+        }
+    };
+
+    uint64_t alignUp(uint64_t offset)
+    {
+        return (offset + BVH_FILE_SECTION_ALIGN - 1)
+             / BVH_FILE_SECTION_ALIGN * BVH_FILE_SECTION_ALIGN;
+    }
+
+    // threadCount is left out: every builder, including the treelet
+    // passes of LBVH, produces the same tree for any thread count.
+    // BVHBench checks this
+    void hashSettings(FNV1a &hash, const BVH::BuildSettings &settings)
+    {
+        hash.update(settings.splitMethod);
+        hash.update(settings.leafSizeThreshold);
+        hash.update(settings.maxLeafSize);
+        hash.update(settings.binCount);
+        hash.update(settings.spatialSplitAlpha);
+        hash.update(settings.spatialSplitBudget);
+        hash.update(settings.traversalCost);
+        hash.update(settings.intersectionCost);
+        hash.update(settings.mortonBits);
+        hash.update(settings.treeletPasses);
+        hash.update(settings.treeletSize);
+    }
+
+    // checks every index that traversals, refits and callers follow
+    // without bounds checks, so that a damaged file is rejected instead of
+    // read out of range. nodes are laid out depth-first: children come
+    // after their parent
+    bool isValidTree(
+        const BVH::Node     *nodes,
+        const BVH::Triangle *triangles,
+        const TriangleBlock *blocks,
+        const uint32_t      *blockOffsets,
+        const uint32_t      *parents,
+        const BVHFileHeader &header)
+    {
+        const uint64_t nodeCount          = header.sections[NODES].count;
+        const uint64_t triangleCount      = header.sections[TRIANGLES].count;
+        const uint64_t blockCount         = header.sections[BLOCKS].count;
+        const uint64_t inputTriangleCount = header.inputTriangleCount;
+
+        for(uint64_t i = 0; i < triangleCount; ++i)
+        {
+            const int index = triangles[i].index;
+            if(index < 0 || static_cast<uint64_t>(index) >= inputTriangleCount)
+                return false;
+        }
+
+        for(uint64_t i = 0; i < blockCount; ++i)
+        {
+            for(int index : blocks[i].index)
+            {
+                if(index < -1 ||
+                   (index >= 0 &&
+                    static_cast<uint64_t>(index) >= inputTriangleCount))
+                    return false;
+            }
+        }
+
+        if(nodeCount && parents[0] != BVH::Node::TRI_NIL)
+            return false;
+
+        for(uint64_t i = 0; i < nodeCount; ++i)
+        {
+            const BVH::Node &node = nodes[i];
+            if(node.isLeaf())
+            {
+                if(node.triBeg > node.triEnd || node.triEnd > triangleCount)
+                    return false;
+            }
+            else if(i + 1 >= nodeCount ||
+                    node.rightChild <= i + 1 || node.rightChild >= nodeCount ||
+                    parents[i + 1] != i || parents[node.rightChild] != i)
+                return false;
+
+            if(blockOffsets[i] > blockOffsets[i + 1])
+                return false;
+
+            // with the checks above, every node but the root is the child
+            // of exactly one interior node before it
+            if(i > 0)
+            {
+                const uint32_t parent = parents[i];
+                if(parent >= i || nodes[parent].isLeaf() ||
+                   (parent + 1 != i && nodes[parent].rightChild != i))
+                    return false;
+            }
+        }
+
+        return blockOffsets[nodeCount] <= blockCount;
+    }
+
+    template<typename T>
+    MappableArray<T> mapSection(
+        const std::shared_ptr<MappedFile> &file,
+        const BVHFileHeader::Section      &section)
+    {
+        auto base = static_cast<const char *>(file->getData());
+        return MappableArray<T>(
+            file, reinterpret_cast<const T *>(base + section.offset),
+            static_cast<size_t>(section.count));
+    }
+
+} // namespace anonymous
+
+uint64_t BVH::computeCacheKey(
+    const Float3        *triangleVertices,
+    int                  triangleCount,
+    const BuildSettings &settings)
+{
+    FNV1a hash;
+    hash.update(triangleCount);
+    hash.update(triangleVertices, sizeof(Float3) * 3 * triangleCount);
+    hashSettings(hash, settings);
+    return hash.get();
+}
+
+uint64_t BVH::computeCacheKey(
+    const Float3        *vertices,
+    int                  vertexCount,
+    const uint32_t      *indices,
+    int                  triangleCount,
+    const BuildSettings &settings)
+{
+    // the vertex count delimits the vertex bytes from the index bytes
+
+    FNV1a hash;
+    hash.update(triangleCount);
+    hash.update(vertexCount);
+    hash.update(vertices, sizeof(Float3) * vertexCount);
+    hash.update(indices, sizeof(uint32_t) * 3 * triangleCount);
+    hashSettings(hash, settings);
+    return hash.get();
+}
+
+bool BVH::saveToFile(const std::string &filename, uint64_t key) const
+{
+    BVHFileHeader header = {};
+    std::memcpy(header.magic, BVH_FILE_MAGIC, sizeof(BVH_FILE_MAGIC));
+    header.version   = BVH_FILE_VERSION;
+    header.blockSize = TriangleBlock::SIZE;
+    header.key       = key;
+
+    header.inputTriangleCount = static_cast<uint64_t>(inputTriangleCount_);
+
+    const std::pair<const void *, uint64_t> sectionData[SECTION_COUNT] = {
+        { nodes_.data(),        sizeof(Node)          * nodes_.size()        },
+        { triangles_.data(),    sizeof(Triangle)      * triangles_.size()    },
+        { blocks_.data(),       sizeof(TriangleBlock) * blocks_.size()       },
+        { blockOffsets_.data(), sizeof(uint32_t)      * blockOffsets_.size() },
+        { parents_.data(),      sizeof(uint32_t)      * parents_.size()      }
+    };
+
+    header.sections[NODES].count         = nodes_.size();
+    header.sections[TRIANGLES].count     = triangles_.size();
+    header.sections[BLOCKS].count        = blocks_.size();
+    header.sections[BLOCK_OFFSETS].count = blockOffsets_.size();
+    header.sections[PARENTS].count       = parents_.size();
+
+    uint64_t offset = alignUp(sizeof(BVHFileHeader));
+    for(int i = 0; i < SECTION_COUNT; ++i)
+    {
+        header.sections[i].offset = offset;
+        offset = alignUp(offset + sectionData[i].second);
+    }
+
+    // write to a temporary file first so that a concurrent or interrupted
+    // save never leaves a truncated cache behind
+
+    const std::filesystem::path path = filename;
+    const std::filesystem::path tempPath = filename + ".tmp";
+
+    std::error_code ec;
+    if(path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+    {
+        std::ofstream fout(tempPath, std::ios::binary | std::ios::trunc);
+        if(!fout)
+            return false;
+
+        fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        uint64_t written = sizeof(header);
+        for(int i = 0; i < SECTION_COUNT; ++i)
+        {
+            static const char padding[BVH_FILE_SECTION_ALIGN] = {};
+            fout.write(padding, header.sections[i].offset - written);
+            fout.write(
+                static_cast<const char *>(sectionData[i].first),
+                static_cast<std::streamsize>(sectionData[i].second));
+            written = header.sections[i].offset + sectionData[i].second;
+        }
+
+        if(!fout)
+            return false;
+    }
+
+    std::filesystem::rename(tempPath, path, ec);
+    if(ec)
+    {
+        std::filesystem::remove(tempPath, ec);
+        return false;
+    }
+
+    return true;
+}
+
+BVH BVH::loadFromFile(const std::string &filename, uint64_t key)
+{
+    auto file = std::make_shared<MappedFile>();
+    if(!file->open(filename) || file->getSize() < sizeof(BVHFileHeader))
+        return {};
+
+    BVHFileHeader header;
+    std::memcpy(&header, file->getData(), sizeof(header));
+
+    if(std::memcmp(header.magic, BVH_FILE_MAGIC, sizeof(BVH_FILE_MAGIC)) ||
+       header.version != BVH_FILE_VERSION ||
+       header.blockSize != TriangleBlock::SIZE ||
+       header.key != key)
+        return {};
+
+    const uint64_t elemSizes[SECTION_COUNT] = {
+        sizeof(Node), sizeof(Triangle), sizeof(TriangleBlock),
+        sizeof(uint32_t), sizeof(uint32_t)
+    };
+
+    for(int i = 0; i < SECTION_COUNT; ++i)
+    {
+        const auto &section = header.sections[i];
+        if(section.offset % BVH_FILE_SECTION_ALIGN ||
+           section.offset > file->getSize() ||
+           section.count > (file->getSize() - section.offset) / elemSizes[i])
+            return {};
+    }
+
+    if(header.sections[BLOCK_OFFSETS].count !=
+       header.sections[NODES].count + 1 ||
+       header.sections[PARENTS].count != header.sections[NODES].count)
+        return {};
+
+    auto base = static_cast<const char *>(file->getData());
+    auto sectionData = [&](BVHFileSection section)
+    {
+        return base + header.sections[section].offset;
+    };
+
+    if(header.inputTriangleCount >
+       static_cast<uint64_t>((std::numeric_limits<int>::max)()) ||
+       !isValidTree(
+           reinterpret_cast<const Node *>(sectionData(NODES)),
+           reinterpret_cast<const Triangle *>(sectionData(TRIANGLES)),
+           reinterpret_cast<const TriangleBlock *>(sectionData(BLOCKS)),
+           reinterpret_cast<const uint32_t *>(sectionData(BLOCK_OFFSETS)),
+           reinterpret_cast<const uint32_t *>(sectionData(PARENTS)),
+           header))
+        return {};
+
+    BVH bvh;
+    bvh.nodes_        = mapSection<Node>(file, header.sections[NODES]);
+    bvh.triangles_    = mapSection<Triangle>(file, header.sections[TRIANGLES]);
+    bvh.blocks_       = mapSection<TriangleBlock>(file, header.sections[BLOCKS]);
+    bvh.blockOffsets_ = mapSection<uint32_t>(file, header.sections[BLOCK_OFFSETS]);
+    bvh.parents_      = mapSection<uint32_t>(file, header.sections[PARENTS]);
+
+    bvh.inputTriangleCount_ = static_cast<int>(header.inputTriangleCount);
+
+    return bvh;
+}
+
+BVH BVH::createCached(
+    const Float3        *triangleVertices,
+    int                  triangleCount,
+    const BuildSettings &settings,
+    const std::string   &cacheFilename)
+{
+    const uint64_t key =
+        computeCacheKey(triangleVertices, triangleCount, settings);
+
+    // the header is not covered by the key, so a damaged triangle count
+    // could let indices beyond the input pass the checks of loadFromFile
+
+    BVH result = loadFromFile(cacheFilename, key);
+    if(!result.empty() && result.inputTriangleCount_ == triangleCount)
+        return result;
+
+    result = create(triangleVertices, triangleCount, settings);
+    result.saveToFile(cacheFilename, key);
+
+    return result;
+}
+
+BVH BVH::createCached(
+    const Float3        *vertices,
+    int                  vertexCount,
+    const uint32_t      *indices,
+    int                  triangleCount,
+    const BuildSettings &settings,
+    const std::string   &cacheFilename)
+{
+    const uint64_t key = computeCacheKey(
+        vertices, vertexCount, indices, triangleCount, settings);
+
+    BVH result = loadFromFile(cacheFilename, key);
+    if(!result.empty() && result.inputTriangleCount_ == triangleCount)
+        return result;
+
+    result = create(vertices, indices, triangleCount, settings);
+    result.saveToFile(cacheFilename, key);
+
+    return result;
+}
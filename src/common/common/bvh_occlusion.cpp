@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <bit>
+
+#include <common/bvh.h>
+#include <common/simd.h>
+
+namespace
+{
+
+    constexpr int GROUP_SIZE = 32;
+
+    // directions of 32 consecutive rays of a batch, matching one word of
+    // the active masks
+    struct alignas(32) RayGroup
+    {
+        float dx[GROUP_SIZE];
+        float dy[GROUP_SIZE];
+        float dz[GROUP_SIZE];
+
+        float ix[GROUP_SIZE];
+        float iy[GROUP_SIZE];
+        float iz[GROUP_SIZE];
+    };
+
+    using L = SIMDLanes<SIMD_WIDTH<GROUP_SIZE>>;
+
+    constexpr int W = SIMD_WIDTH<GROUP_SIZE>;
+
+    uint32_t laneMask(uint32_t mask, int c)
+    {
+        return (mask >> c) & ((1u << W) - 1);
+    }
+
+    // out[w]: rays of active[w] whose [t0, t1] overlaps the node bounds.
+    // the origin is shared, so the box is moved to it once.
+    // returns false when there is none
+    bool intersectBox(
+        const BVH::Node &node,
+        const Float3    &origin,
+        float            t0,
+        float            t1,
+        const RayGroup  *groups,
+        int              groupCount,
+        const uint32_t  *active,
+        uint32_t        *out)
+    {
+        const auto lx = L::set1(node.lower.x - origin.x);
+        const auto ly = L::set1(node.lower.y - origin.y);
+        const auto lz = L::set1(node.lower.z - origin.z);
+        const auto ux = L::set1(node.upper.x - origin.x);
+        const auto uy = L::set1(node.upper.y - origin.y);
+        const auto uz = L::set1(node.upper.z - origin.z);
+
+        const auto vt0 = L::set1(t0);
+        const auto vt1 = L::set1(t1);
+
+        uint32_t any = 0;
+        for(int w = 0; w < groupCount; ++w)
+        {
+            const RayGroup &group = groups[w];
+
+            uint32_t result = 0;
+            for(int c = 0; c < GROUP_SIZE && (active[w] >> c); c += W)
+            {
+                if(!laneMask(active[w], c))
+                    continue;
+
+                const auto ix = L::load(group.ix + c);
+                const auto iy = L::load(group.iy + c);
+                const auto iz = L::load(group.iz + c);
+
+                const auto nx = L::mul(lx, ix);
+                const auto ny = L::mul(ly, iy);
+                const auto nz = L::mul(lz, iz);
+
+                const auto fx = L::mul(ux, ix);
+                const auto fy = L::mul(uy, iy);
+                const auto fz = L::mul(uz, iz);
+
+                auto enter = L::max(vt0, L::min(nx, fx));
+                enter = L::max(enter, L::min(ny, fy));
+                enter = L::max(enter, L::min(nz, fz));
+
+                auto exit = L::min(vt1, L::max(nx, fx));
+                exit = L::min(exit, L::max(ny, fy));
+                exit = L::min(exit, L::max(nz, fz));
+
+                result |= static_cast<uint32_t>(
+                    L::movemask(L::le(enter, exit))) << c;
+            }
+
+            out[w] = result & active[w];
+            any |= out[w];
+        }
+
+        return any != 0;
+    }
+
+    // Moller-Trumbore test of one triangle against the active rays.
+    // hits are removed from active and added to occluded.
+    // cross(o - A, B - A) and the numerator of t only depend on the
+    // shared origin
+    void intersectTriangle(
+        const BVH::Triangle &tri,
+        const Float3        &origin,
+        float                t0,
+        float                t1,
+        const RayGroup      *groups,
+        int                  groupCount,
+        uint32_t            *active,
+        uint32_t            *occluded)
+    {
+        const Float3 oa = origin - tri.a;
+        const Float3 s2 = cross(oa, tri.b_a);
+        const float tNum = dot(tri.c_a, s2);
+
+        const auto bax = L::set1(tri.b_a.x);
+        const auto bay = L::set1(tri.b_a.y);
+        const auto baz = L::set1(tri.b_a.z);
+        const auto cax = L::set1(tri.c_a.x);
+        const auto cay = L::set1(tri.c_a.y);
+        const auto caz = L::set1(tri.c_a.z);
+        const auto oax = L::set1(oa.x);
+        const auto oay = L::set1(oa.y);
+        const auto oaz = L::set1(oa.z);
+        const auto s2x = L::set1(s2.x);
+        const auto s2y = L::set1(s2.y);
+        const auto s2z = L::set1(s2.z);
+        const auto vtNum = L::set1(tNum);
+
+        const auto zero = L::zero();
+        const auto one  = L::set1(1);
+        const auto vt0  = L::set1(t0);
+        const auto vt1  = L::set1(t1);
+
+        for(int w = 0; w < groupCount; ++w)
+        {
+            const RayGroup &group = groups[w];
+
+            uint32_t result = 0;
+            for(int c = 0; c < GROUP_SIZE && (active[w] >> c); c += W)
+            {
+                if(!laneMask(active[w], c))
+                    continue;
+
+                const auto dx = L::load(group.dx + c);
+                const auto dy = L::load(group.dy + c);
+                const auto dz = L::load(group.dz + c);
+
+                // s1 = cross(d, C - A)
+                const auto s1x = L::sub(L::mul(dy, caz), L::mul(dz, cay));
+                const auto s1y = L::sub(L::mul(dz, cax), L::mul(dx, caz));
+                const auto s1z = L::sub(L::mul(dx, cay), L::mul(dy, cax));
+
+                const auto div = L::add(
+                    L::add(L::mul(s1x, bax), L::mul(s1y, bay)), L::mul(s1z, baz));
+                const auto invDiv = L::div(one, div);
+
+                const auto alpha = L::mul(invDiv, L::add(
+                    L::add(L::mul(oax, s1x), L::mul(oay, s1y)), L::mul(oaz, s1z)));
+
+                const auto beta = L::mul(invDiv, L::add(
+                    L::add(L::mul(dx, s2x), L::mul(dy, s2y)), L::mul(dz, s2z)));
+
+                const auto t = L::mul(invDiv, vtNum);
+
+                auto valid = L::neq(div, zero);
+                valid = L::and_(valid, L::le(zero, alpha));
+                valid = L::and_(valid, L::le(zero, beta));
+                valid = L::and_(valid, L::le(L::add(alpha, beta), one));
+                valid = L::and_(valid, L::le(vt0, t));
+                valid = L::and_(valid, L::le(t, vt1));
+
+                result |= static_cast<uint32_t>(L::movemask(valid)) << c;
+            }
+
+            result &= active[w];
+            active[w]   &= ~result;
+            occluded[w] |= result;
+        }
+    }
+
+    float distanceSquared(const BVH::Node &node, const Float3 &p)
+    {
+        float result = 0;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            const float below = node.lower[axis] - p[axis];
+            const float above = p[axis] - node.upper[axis];
+            const float d = (std::max)((std::max)(below, above), 0.0f);
+            result += d * d;
+        }
+        return result;
+    }
+
+    // per-thread scratch, grown to the largest batch seen so far.
+    // stack entry i owns masks [i * wordCount, (i + 1) * wordCount)
+    struct OcclusionScratch
+    {
+        std::vector<RayGroup> groups;
+        std::vector<uint32_t> stackMasks;
+        std::vector<uint32_t> nodeMask;
+        std::vector<uint32_t> occluded;
+        uint32_t              stack[BVH::TRAVERSAL_STACK_SIZE];
+    };
+
+    thread_local OcclusionScratch occlusionScratch;
+
+} // namespace anonymous
+
+int BVH::computeVisibility(
+    const Float3 &origin,
+    const Float3 *directions,
+    int           rayCount,
+    float         t0,
+    float         t1,
+    uint32_t     *visibleMask) const
+{
+    assert(rayCount >= 0);
+
+    const int wordCount = (rayCount + GROUP_SIZE - 1) / GROUP_SIZE;
+
+    auto finish = [&](const uint32_t *occluded)
+    {
+        int visibleCount = 0;
+        for(int w = 0; w < wordCount; ++w)
+        {
+            const int count = (std::min)(GROUP_SIZE, rayCount - w * GROUP_SIZE);
+            const uint32_t all =
+                count == GROUP_SIZE ? ~0u : (1u << count) - 1;
+            const uint32_t visible = all & ~(occluded ? occluded[w] : 0u);
+
+            if(visibleMask)
+                visibleMask[w] = visible;
+            visibleCount += std::popcount(visible);
+        }
+        return visibleCount;
+    };
+
+    if(nodes_.empty() || !rayCount)
+        return finish(nullptr);
+
+    auto &scratch = occlusionScratch;
+    scratch.groups.resize(wordCount);
+    scratch.stackMasks.resize(static_cast<size_t>(TRAVERSAL_STACK_SIZE) * wordCount);
+    scratch.nodeMask.resize(wordCount);
+    scratch.occluded.assign(wordCount, 0u);
+
+    // unused lanes of the last group get a valid direction and are masked
+    // out by the root mask
+
+    for(int w = 0; w < wordCount; ++w)
+    {
+        RayGroup &group = scratch.groups[w];
+        for(int i = 0; i < GROUP_SIZE; ++i)
+        {
+            const int ri = (std::min)(w * GROUP_SIZE + i, rayCount - 1);
+            const Float3 &d = directions[ri];
+
+            group.dx[i] = d.x;
+            group.dy[i] = d.y;
+            group.dz[i] = d.z;
+
+            group.ix[i] = 1 / d.x;
+            group.iy[i] = 1 / d.y;
+            group.iz[i] = 1 / d.z;
+        }
+    }
+
+    uint32_t *occluded = scratch.occluded.data();
+    uint32_t *nodeMask = scratch.nodeMask.data();
+    uint32_t *stack    = scratch.stack;
+
+    auto entryMasks = [&](int entry)
+    {
+        return &scratch.stackMasks[static_cast<size_t>(entry) * wordCount];
+    };
+
+    auto filterNode = [&](uint32_t nodeIdx, const uint32_t *active, uint32_t *out)
+    {
+        return intersectBox(
+            nodes_[nodeIdx], origin, t0, t1,
+            scratch.groups.data(), wordCount, active, out);
+    };
+
+    // the root mask selects the real rays of the last group
+
+    for(int w = 0; w < wordCount; ++w)
+    {
+        const int count = (std::min)(GROUP_SIZE, rayCount - w * GROUP_SIZE);
+        nodeMask[w] = count == GROUP_SIZE ? ~0u : (1u << count) - 1;
+    }
+
+    int top = 0;
+    if(filterNode(0, nodeMask, entryMasks(top)))
+        stack[top++] = 0;
+
+    while(top)
+    {
+        --top;
+        const uint32_t nodeIdx = stack[top];
+        const Node &node = nodes_[nodeIdx];
+
+        // rays occluded since the entry was pushed are dropped
+
+        uint32_t any = 0;
+        const uint32_t *entry = entryMasks(top);
+        for(int w = 0; w < wordCount; ++w)
+        {
+            nodeMask[w] = entry[w] & ~occluded[w];
+            any |= nodeMask[w];
+        }
+
+        if(!any)
+            continue;
+
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            {
+                intersectTriangle(
+                    triangles_[i], origin, t0, t1,
+                    scratch.groups.data(), wordCount, nodeMask, occluded);
+            }
+
+            int occludedCount = 0;
+            for(int w = 0; w < wordCount; ++w)
+                occludedCount += std::popcount(occluded[w]);
+            if(occludedCount == rayCount)
+                break;
+            continue;
+        }
+
+        // occluders tend to lie near the shared origin, so the child box
+        // closer to it is visited first
+
+        uint32_t nearIdx = nodeIdx + 1, farIdx = node.rightChild;
+        if(distanceSquared(nodes_[farIdx], origin) <
+           distanceSquared(nodes_[nearIdx], origin))
+            std::swap(nearIdx, farIdx);
+
+        assert(top + 2 <= TRAVERSAL_STACK_SIZE);
+
+        if(filterNode(farIdx, nodeMask, entryMasks(top)))
+            stack[top++] = farIdx;
+
+        if(filterNode(nearIdx, nodeMask, entryMasks(top)))
+            stack[top++] = nearIdx;
+    }
+
+    return finish(occluded);
+}
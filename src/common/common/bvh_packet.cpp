@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <bit>
+
+#include <common/bvh.h>
+#include <common/simd.h>
+
+namespace
+{
+
+    constexpr int STREAM_PACKET_SIZE = 16;
+
+    template<int N>
+    struct PacketInvDir
+    {
+        alignas(32) float x[N];
+        alignas(32) float y[N];
+        alignas(32) float z[N];
+
+        explicit PacketInvDir(const RayPacket<N> &p)
+        {
+            for(int i = 0; i < N; ++i)
+            {
+                x[i] = 1 / p.dx[i];
+                y[i] = 1 / p.dy[i];
+                z[i] = 1 / p.dz[i];
+            }
+        }
+    };
+
+    template<int W>
+    uint32_t chunkMask(uint32_t mask, int c)
+    {
+        return (mask >> c) & ((1u << W) - 1);
+    }
+
+    // returns the active rays whose [t0, t1] overlaps the node bounds
+    template<int N>
+    uint32_t intersectBox(
+        const BVH::Node       &node,
+        const RayPacket<N>    &p,
+        const PacketInvDir<N> &invDir,
+        const float           *t1,
+        uint32_t               active)
+    {
+        constexpr int W = SIMD_WIDTH<N>;
+        using L = SIMDLanes<W>;
+
+        const auto lx = L::set1(node.lower.x);
+        const auto ly = L::set1(node.lower.y);
+        const auto lz = L::set1(node.lower.z);
+        const auto ux = L::set1(node.upper.x);
+        const auto uy = L::set1(node.upper.y);
+        const auto uz = L::set1(node.upper.z);
+
+        uint32_t result = 0;
+        for(int c = 0; c < N; c += W)
+        {
+            if(!chunkMask<W>(active, c))
+                continue;
+
+            const auto ox = L::load(p.ox + c);
+            const auto oy = L::load(p.oy + c);
+            const auto oz = L::load(p.oz + c);
+
+            const auto ix = L::load(invDir.x + c);
+            const auto iy = L::load(invDir.y + c);
+            const auto iz = L::load(invDir.z + c);
+
+            const auto nx = L::mul(L::sub(lx, ox), ix);
+            const auto ny = L::mul(L::sub(ly, oy), iy);
+            const auto nz = L::mul(L::sub(lz, oz), iz);
+
+            const auto fx = L::mul(L::sub(ux, ox), ix);
+            const auto fy = L::mul(L::sub(uy, oy), iy);
+            const auto fz = L::mul(L::sub(uz, oz), iz);
+
+            auto enter = L::load(p.t0 + c);
+            enter = L::max(enter, L::min(nx, fx));
+            enter = L::max(enter, L::min(ny, fy));
+            enter = L::max(enter, L::min(nz, fz));
+
+            auto exit = L::load(t1 + c);
+            exit = L::min(exit, L::max(nx, fx));
+            exit = L::min(exit, L::max(ny, fy));
+            exit = L::min(exit, L::max(nz, fz));
+
+            result |= static_cast<uint32_t>(
+                L::movemask(L::le(enter, exit))) << c;
+        }
+
+        return result & active;
+    }
+
+    // Moller-Trumbore test of one triangle against all active rays.
+    // when outT is given, the hit distance and barycentric coordinates of
+    // every lane are written to outT/outU/outV
+    template<int N>
+    uint32_t intersectTriangle(
+        const BVH::Triangle &tri,
+        const RayPacket<N>  &p,
+        const float         *t1,
+        uint32_t             active,
+        float               *outT,
+        float               *outU,
+        float               *outV)
+    {
+        constexpr int W = SIMD_WIDTH<N>;
+        using L = SIMDLanes<W>;
+
+        const auto ax  = L::set1(tri.a.x);
+        const auto ay  = L::set1(tri.a.y);
+        const auto az  = L::set1(tri.a.z);
+        const auto bax = L::set1(tri.b_a.x);
+        const auto bay = L::set1(tri.b_a.y);
+        const auto baz = L::set1(tri.b_a.z);
+        const auto cax = L::set1(tri.c_a.x);
+        const auto cay = L::set1(tri.c_a.y);
+        const auto caz = L::set1(tri.c_a.z);
+
+        const auto zero = L::zero();
+        const auto one  = L::set1(1);
+
+        uint32_t result = 0;
+        for(int c = 0; c < N; c += W)
+        {
+            if(!chunkMask<W>(active, c))
+                continue;
+
+            const auto dx = L::load(p.dx + c);
+            const auto dy = L::load(p.dy + c);
+            const auto dz = L::load(p.dz + c);
+
+            // s1 = cross(d, C - A)
+            const auto s1x = L::sub(L::mul(dy, caz), L::mul(dz, cay));
+            const auto s1y = L::sub(L::mul(dz, cax), L::mul(dx, caz));
+            const auto s1z = L::sub(L::mul(dx, cay), L::mul(dy, cax));
+
+            const auto div = L::add(
+                L::add(L::mul(s1x, bax), L::mul(s1y, bay)), L::mul(s1z, baz));
+            const auto invDiv = L::div(one, div);
+
+            const auto oax = L::sub(L::load(p.ox + c), ax);
+            const auto oay = L::sub(L::load(p.oy + c), ay);
+            const auto oaz = L::sub(L::load(p.oz + c), az);
+
+            const auto alpha = L::mul(invDiv, L::add(
+                L::add(L::mul(oax, s1x), L::mul(oay, s1y)), L::mul(oaz, s1z)));
+
+            // s2 = cross(o - A, B - A)
+            const auto s2x = L::sub(L::mul(oay, baz), L::mul(oaz, bay));
+            const auto s2y = L::sub(L::mul(oaz, bax), L::mul(oax, baz));
+            const auto s2z = L::sub(L::mul(oax, bay), L::mul(oay, bax));
+
+            const auto beta = L::mul(invDiv, L::add(
+                L::add(L::mul(dx, s2x), L::mul(dy, s2y)), L::mul(dz, s2z)));
+
+            const auto t = L::mul(invDiv, L::add(
+                L::add(L::mul(cax, s2x), L::mul(cay, s2y)), L::mul(caz, s2z)));
+
+            auto valid = L::neq(div, zero);
+            valid = L::and_(valid, L::le(zero, alpha));
+            valid = L::and_(valid, L::le(zero, beta));
+            valid = L::and_(valid, L::le(L::add(alpha, beta), one));
+            valid = L::and_(valid, L::le(L::load(p.t0 + c), t));
+            valid = L::and_(valid, L::le(t, L::load(t1 + c)));
+
+            const uint32_t hits =
+                static_cast<uint32_t>(L::movemask(valid)) & chunkMask<W>(active, c);
+            if(hits && outT)
+            {
+                L::store(outT + c, t);
+                L::store(outU + c, alpha);
+                L::store(outV + c, beta);
+            }
+
+            result |= hits << c;
+        }
+
+        return result;
+    }
+
+    struct PacketStackEntry
+    {
+        uint32_t node;
+        uint32_t mask;
+    };
+
+    thread_local PacketStackEntry packetStack[BVH::TRAVERSAL_STACK_SIZE];
+
+} // namespace anonymous
+
+template<int N>
+uint32_t BVH::hasIntersection(
+    const RayPacket<N> &packet, uint32_t activeMask) const
+{
+    activeMask &= RayPacket<N>::ALL_ACTIVE;
+    if(nodes_.empty() || !activeMask)
+        return 0;
+
+    const PacketInvDir<N> invDir(packet);
+
+    const uint32_t rootMask = intersectBox(
+        nodes_[0], packet, invDir, packet.t1, activeMask);
+    if(!rootMask)
+        return 0;
+
+    int top = 0;
+    packetStack[top++] = { 0, rootMask };
+
+    uint32_t hits = 0;
+
+    while(top)
+    {
+        const PacketStackEntry entry = packetStack[--top];
+
+        // rays that already hit something are done
+        const uint32_t mask = entry.mask & ~hits;
+        if(!mask)
+            continue;
+
+        const Node &node = nodes_[entry.node];
+
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            {
+                hits |= intersectTriangle(
+                    triangles_[i], packet, packet.t1, mask & ~hits,
+                    nullptr, nullptr, nullptr);
+                if(hits == activeMask)
+                    return hits;
+            }
+        }
+        else
+        {
+            assert(top + 2 < TRAVERSAL_STACK_SIZE);
+
+            const uint32_t leftMask = intersectBox(
+                nodes_[entry.node + 1], packet, invDir, packet.t1, mask);
+            if(leftMask)
+                packetStack[top++] = { entry.node + 1, leftMask };
+
+            const uint32_t rightMask = intersectBox(
+                nodes_[node.rightChild], packet, invDir, packet.t1, mask);
+            if(rightMask)
+                packetStack[top++] = { node.rightChild, rightMask };
+        }
+    }
+
+    return hits;
+}
+
+template<int N>
+uint32_t BVH::findIntersection(
+    const RayPacket<N> &packet,
+    uint32_t            activeMask,
+    Intersection       *incts) const
+{
+    activeMask &= RayPacket<N>::ALL_ACTIVE;
+    if(nodes_.empty() || !activeMask)
+        return 0;
+
+    const PacketInvDir<N> invDir(packet);
+
+    alignas(32) float t1[N];
+    std::copy(packet.t1, packet.t1 + N, t1);
+
+    const uint32_t rootMask = intersectBox(
+        nodes_[0], packet, invDir, t1, activeMask);
+    if(!rootMask)
+        return 0;
+
+    int top = 0;
+    packetStack[top++] = { 0, rootMask };
+
+    alignas(32) float triT[N], triU[N], triV[N];
+    float finalU[N], finalV[N];
+    int finalIndex[N];
+
+    uint32_t hits = 0;
+
+    while(top)
+    {
+        const PacketStackEntry entry = packetStack[--top];
+        const Node &node = nodes_[entry.node];
+
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            {
+                const Triangle &tri = triangles_[i];
+
+                uint32_t triHits = intersectTriangle(
+                    tri, packet, t1, entry.mask, triT, triU, triV);
+                hits |= triHits;
+
+                while(triHits)
+                {
+                    const int r = std::countr_zero(triHits);
+                    triHits &= triHits - 1;
+
+                    t1[r]         = triT[r];
+                    finalU[r]     = triU[r];
+                    finalV[r]     = triV[r];
+                    finalIndex[r] = tri.index;
+                }
+            }
+        }
+        else
+        {
+            assert(top + 2 < TRAVERSAL_STACK_SIZE);
+
+            // box tests use the shrunk t1, so they cull against current hits
+
+            const uint32_t leftMask = intersectBox(
+                nodes_[entry.node + 1], packet, invDir, t1, entry.mask);
+            if(leftMask)
+                packetStack[top++] = { entry.node + 1, leftMask };
+
+            const uint32_t rightMask = intersectBox(
+                nodes_[node.rightChild], packet, invDir, t1, entry.mask);
+            if(rightMask)
+                packetStack[top++] = { node.rightChild, rightMask };
+        }
+    }
+
+    for(uint32_t m = hits; m; m &= m - 1)
+    {
+        const int r = std::countr_zero(m);
+
+        auto &inct = incts[r];
+        inct.triangle = finalIndex[r];
+        inct.position = packet.get(r).at(t1[r]);
+        inct.t        = t1[r];
+        inct.uv       = Float2(finalU[r], finalV[r]);
+    }
+
+    return hits;
+}
+
+void BVH::hasIntersection(
+    const Ray *rays, int rayCount, uint32_t *hitMask) const
+{
+    std::fill(hitMask, hitMask + (rayCount + 31) / 32, 0u);
+
+    RayPacket<STREAM_PACKET_SIZE> packet;
+    for(int beg = 0; beg < rayCount; beg += STREAM_PACKET_SIZE)
+    {
+        const int count = (std::min)(STREAM_PACKET_SIZE, rayCount - beg);
+        for(int i = 0; i < count; ++i)
+            packet.set(i, rays[beg + i]);
+
+        const uint32_t hits = hasIntersection(packet, (1u << count) - 1);
+        hitMask[beg / 32] |= hits << (beg % 32);
+    }
+}
+
+void BVH::findIntersection(
+    const Ray    *rays,
+    int           rayCount,
+    uint32_t     *hitMask,
+    Intersection *incts) const
+{
+    std::fill(hitMask, hitMask + (rayCount + 31) / 32, 0u);
+
+    RayPacket<STREAM_PACKET_SIZE> packet;
+    for(int beg = 0; beg < rayCount; beg += STREAM_PACKET_SIZE)
+    {
+        const int count = (std::min)(STREAM_PACKET_SIZE, rayCount - beg);
+        for(int i = 0; i < count; ++i)
+            packet.set(i, rays[beg + i]);
+
+        const uint32_t hits = findIntersection(
+            packet, (1u << count) - 1, incts + beg);
+        hitMask[beg / 32] |= hits << (beg % 32);
+    }
+}
+
+template uint32_t BVH::hasIntersection<4> (const RayPacket<4>  &, uint32_t) const;
+template uint32_t BVH::hasIntersection<8> (const RayPacket<8>  &, uint32_t) const;
+template uint32_t BVH::hasIntersection<16>(const RayPacket<16> &, uint32_t) const;
+
+template uint32_t BVH::findIntersection<4> (const RayPacket<4>  &, uint32_t, Intersection *) const;
+template uint32_t BVH::findIntersection<8> (const RayPacket<8>  &, uint32_t, Intersection *) const;
+template uint32_t BVH::findIntersection<16>(const RayPacket<16> &, uint32_t, Intersection *) const;
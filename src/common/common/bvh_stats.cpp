@@ -0,0 +1,186 @@
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <common/bvh_stats.h>
+
+namespace
+{
+
+    // records outlive their threads, so that counts of worker threads are
+    // kept after a bake. a finished thread hands its record to the next
+    // new one
+    struct StatsRegistry
+    {
+        std::mutex                                      mutex;
+        std::vector<std::unique_ptr<BVHTraversalStats>> records;
+        std::vector<BVHTraversalStats *>                freeRecords;
+    };
+
+    StatsRegistry &getRegistry()
+    {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    void dumpHistogram(
+        FILE *file, const char *name, const uint64_t *bins, uint64_t rays)
+    {
+        std::fprintf(file, "    %s per ray\n", name);
+        for(int i = 0; i < BVHTraversalStats::HISTOGRAM_BINS; ++i)
+        {
+            if(!bins[i])
+                continue;
+
+            const uint64_t low  = i ? uint64_t(1) << (i - 1) : 0;
+            const uint64_t high = uint64_t(1) << i;
+            const double percent = 100.0 * bins[i] / rays;
+
+            if(i == BVHTraversalStats::HISTOGRAM_BINS - 1)
+            {
+                std::fprintf(
+                    file, "        [%6llu,    inf) %12llu %6.2f%%\n",
+                    static_cast<unsigned long long>(low),
+                    static_cast<unsigned long long>(bins[i]), percent);
+            }
+            else
+            {
+                std::fprintf(
+                    file, "        [%6llu, %6llu) %12llu %6.2f%%\n",
+                    static_cast<unsigned long long>(low),
+                    static_cast<unsigned long long>(high),
+                    static_cast<unsigned long long>(bins[i]), percent);
+            }
+        }
+    }
+
+#ifdef BVH_ENABLE_STATS
+
+    int histogramBin(uint64_t count)
+    {
+        return (std::min)(
+            static_cast<int>(std::bit_width(count)),
+            BVHTraversalStats::HISTOGRAM_BINS - 1);
+    }
+
+    class ThreadRecord
+    {
+    public:
+
+        ThreadRecord()
+        {
+            auto &registry = getRegistry();
+            std::lock_guard lk(registry.mutex);
+
+            if(!registry.freeRecords.empty())
+            {
+                record_ = registry.freeRecords.back();
+                registry.freeRecords.pop_back();
+            }
+            else
+            {
+                record_ = registry.records.emplace_back(
+                    std::make_unique<BVHTraversalStats>()).get();
+            }
+        }
+
+        ~ThreadRecord()
+        {
+            auto &registry = getRegistry();
+            std::lock_guard lk(registry.mutex);
+            registry.freeRecords.push_back(record_);
+        }
+
+        BVHTraversalStats &get()
+        {
+            return *record_;
+        }
+
+    private:
+
+        BVHTraversalStats *record_;
+    };
+
+    thread_local ThreadRecord threadRecord;
+
+#endif // #ifdef BVH_ENABLE_STATS
+
+} // namespace anonymous
+
+void BVHTraversalStats::merge(const BVHTraversalStats &other)
+{
+    rays            += other.rays;
+    nodesVisited    += other.nodesVisited;
+    boxesTested     += other.boxesTested;
+    trianglesTested += other.trianglesTested;
+    earlyOuts       += other.earlyOuts;
+    maxStackDepth    = (std::max)(maxStackDepth, other.maxStackDepth);
+
+    for(int i = 0; i < HISTOGRAM_BINS; ++i)
+    {
+        nodesPerRay[i]     += other.nodesPerRay[i];
+        trianglesPerRay[i] += other.trianglesPerRay[i];
+    }
+}
+
+BVHTraversalStats BVHTraversalStats::collect()
+{
+    auto &registry = getRegistry();
+    std::lock_guard lk(registry.mutex);
+
+    BVHTraversalStats result;
+    for(auto &record : registry.records)
+        result.merge(*record);
+    return result;
+}
+
+void BVHTraversalStats::reset()
+{
+    auto &registry = getRegistry();
+    std::lock_guard lk(registry.mutex);
+
+    for(auto &record : registry.records)
+        *record = {};
+}
+
+void BVHTraversalStats::dump(FILE *file) const
+{
+    std::fprintf(
+        file, "BVH traversal: %llu rays\n",
+        static_cast<unsigned long long>(rays));
+    if(!rays)
+        return;
+
+    const double invRays = 1.0 / rays;
+    std::fprintf(file, "    nodes visited    %10.2f / ray\n", nodesVisited * invRays);
+    std::fprintf(file, "    boxes tested     %10.2f / ray\n", boxesTested * invRays);
+    std::fprintf(file, "    triangles tested %10.2f / ray\n", trianglesTested * invRays);
+    std::fprintf(file, "    early-outs       %10.2f / ray\n", earlyOuts * invRays);
+    std::fprintf(file, "    max stack depth  %10d\n", maxStackDepth);
+
+    dumpHistogram(file, "nodes visited", nodesPerRay, rays);
+    dumpHistogram(file, "triangles tested", trianglesPerRay, rays);
+}
+
+#ifdef BVH_ENABLE_STATS
+
+thread_local BVHRayStats bvhRayStats;
+
+BVHRayStatsScope::~BVHRayStatsScope()
+{
+    const BVHRayStats &ray = bvhRayStats;
+    BVHTraversalStats &record = threadRecord.get();
+
+    ++record.rays;
+    record.nodesVisited    += ray.nodes;
+    record.boxesTested     += ray.boxes;
+    record.trianglesTested += ray.triangles;
+    record.earlyOuts       += ray.earlyOuts;
+    record.maxStackDepth    = (std::max)(record.maxStackDepth, ray.maxDepth);
+
+    ++record.nodesPerRay[histogramBin(ray.nodes)];
+    ++record.trianglesPerRay[histogramBin(ray.triangles)];
+}
+
+#endif // #ifdef BVH_ENABLE_STATS
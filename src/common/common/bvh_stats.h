@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+// traversal statistics of single-ray BVH queries, compiled in when
+// BVH_ENABLE_STATS is defined (CMake option of the same name). otherwise
+// the BVH_STATS statements expand to nothing and collect returns zeros.
+//
+// each thread counts into a record of its own without atomics. collect
+// and reset touch the records of all threads, so they must only be
+// called while no query is running, such as before and after a bake
+
+#ifdef BVH_ENABLE_STATS
+#   define BVH_STATS(...) __VA_ARGS__
+#else
+#   define BVH_STATS(...)
+#endif
+
+struct BVHTraversalStats
+{
+    // bin 0 counts rays with a zero count, bin i > 0 those with a count
+    // in [2^(i-1), 2^i). the last bin is open-ended
+    static constexpr int HISTOGRAM_BINS = 16;
+
+    uint64_t rays            = 0;
+    uint64_t nodesVisited    = 0;
+    uint64_t boxesTested     = 0;
+    uint64_t trianglesTested = 0;
+
+    // any-hit queries that stopped at their first hit, plus stack entries
+    // a closest-hit query dropped because they lie behind its current hit.
+    // stackless traversal counts the latter as box misses
+    uint64_t earlyOuts = 0;
+
+    int maxStackDepth = 0;
+
+    uint64_t nodesPerRay[HISTOGRAM_BINS]     = {};
+    uint64_t trianglesPerRay[HISTOGRAM_BINS] = {};
+
+    void merge(const BVHTraversalStats &other);
+
+    // sums the records of all threads, including finished ones
+    static BVHTraversalStats collect();
+
+    static void reset();
+
+    // summary and histograms in human-readable form
+    void dump(FILE *file) const;
+};
+
+#ifdef BVH_ENABLE_STATS
+
+// counters of the query running on this thread
+struct BVHRayStats
+{
+    uint32_t nodes     = 0;
+    uint32_t boxes     = 0;
+    uint32_t triangles = 0;
+    uint32_t earlyOuts = 0;
+    int      maxDepth  = 0;
+
+    void onStackDepth(int depth)
+    {
+        maxDepth = (std::max)(maxDepth, depth);
+    }
+};
+
+extern thread_local BVHRayStats bvhRayStats;
+
+// starts counting a query, and adds its counters to the record of the
+// thread when it returns
+class BVHRayStatsScope
+{
+public:
+
+    BVHRayStatsScope()
+    {
+        bvhRayStats = {};
+    }
+
+    BVHRayStatsScope(const BVHRayStatsScope &) = delete;
+
+    BVHRayStatsScope &operator=(const BVHRayStatsScope &) = delete;
+
+    ~BVHRayStatsScope();
+};
+
+#endif // #ifdef BVH_ENABLE_STATS
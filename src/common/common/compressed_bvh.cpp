@@ -0,0 +1,488 @@
+#include <bit>
+#include <cmath>
+#include <unordered_map>
+
+#include <common/compressed_bvh.h>
+#include <common/triangle.h>
+
+namespace
+{
+
+    constexpr int MIN_EXPONENT = -126;
+    constexpr int MAX_EXPONENT = 127;
+
+    // 2^e as a float, for normal exponents
+    float exp2i(int e)
+    {
+        return std::bit_cast<float>(static_cast<uint32_t>(e + 127) << 23);
+    }
+
+    // the scale is a power of two, so q * step is exact and decoding
+    // gives the same result with or without fused multiply-add
+    float decode(float origin, float step, uint8_t q)
+    {
+        return origin + static_cast<float>(q) * step;
+    }
+
+    // smallest exponent e with origin + 255 * 2^e >= upper
+    int8_t chooseExponent(float origin, float upper)
+    {
+        const float extent = upper - origin;
+
+        int e = MIN_EXPONENT;
+        if(extent > 0)
+        {
+            e = static_cast<int>(std::ceil(std::log2(extent / 255)));
+            e = (std::clamp)(e, MIN_EXPONENT, MAX_EXPONENT);
+        }
+
+        while(e > MIN_EXPONENT && decode(origin, exp2i(e - 1), 255) >= upper)
+            --e;
+        while(e < MAX_EXPONENT && decode(origin, exp2i(e), 255) < upper)
+            ++e;
+
+        return static_cast<int8_t>(e);
+    }
+
+    // largest q with decode(q) <= lower
+    uint8_t quantizeLower(float origin, float step, float lower)
+    {
+        int q = static_cast<int>(std::floor((lower - origin) / step));
+        q = (std::clamp)(q, 0, 255);
+        while(q > 0 && decode(origin, step, static_cast<uint8_t>(q)) > lower)
+            --q;
+        return static_cast<uint8_t>(q);
+    }
+
+    // smallest q with decode(q) >= upper
+    uint8_t quantizeUpper(float origin, float step, float upper)
+    {
+        int q = static_cast<int>(std::ceil((upper - origin) / step));
+        q = (std::clamp)(q, 0, 255);
+        while(q < 255 && decode(origin, step, static_cast<uint8_t>(q)) < upper)
+            ++q;
+        return static_cast<uint8_t>(q);
+    }
+
+    bool isBinaryLeaf(const BVH::Node &node)
+    {
+        return node.isLeaf();
+    }
+
+    uint32_t compress(
+        std::span<const BVH::Node>        binaryNodes,
+        uint32_t                          binaryIdx,
+        const Float3                     &origin,
+        std::vector<CompressedBVH::Node> &nodes)
+    {
+        using Node = CompressedBVH::Node;
+
+        // a leaf can only get here as the root, where it becomes
+        // the single child of a compressed node
+
+        const BVH::Node &binaryNode = binaryNodes[binaryIdx];
+
+        uint32_t children[2];
+        int childCount = 0;
+        if(isBinaryLeaf(binaryNode))
+            children[childCount++] = binaryIdx;
+        else
+        {
+            children[childCount++] = binaryIdx + 1;
+            children[childCount++] = binaryNode.rightChild;
+        }
+
+        Node node = {};
+        Float3 step;
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            node.exponent[axis] =
+                chooseExponent(origin[axis], binaryNode.upper[axis]);
+            step[axis] = exp2i(node.exponent[axis]);
+        }
+
+        const uint32_t nodeIdx = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        for(int i = 0; i < 2; ++i)
+        {
+            if(i >= childCount)
+            {
+                node.child[i]    = Node::CHILD_NIL;
+                node.triCount[i] = 0;
+                continue;
+            }
+
+            const BVH::Node &c = binaryNodes[children[i]];
+
+            Float3 childOrigin;
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                node.qlower[i][axis] = quantizeLower(
+                    origin[axis], step[axis], c.lower[axis]);
+                node.qupper[i][axis] = quantizeUpper(
+                    origin[axis], step[axis], c.upper[axis]);
+
+                childOrigin[axis] = decode(
+                    origin[axis], step[axis], node.qlower[i][axis]);
+            }
+
+            if(isBinaryLeaf(c))
+            {
+                assert(c.triEnd - c.triBeg <= 0xffff);
+                node.child[i]    = c.triBeg;
+                node.triCount[i] = static_cast<uint16_t>(c.triEnd - c.triBeg);
+            }
+            else
+            {
+                node.child[i]    = compress(
+                    binaryNodes, children[i], childOrigin, nodes);
+                node.triCount[i] = 0;
+            }
+        }
+
+        nodes[nodeIdx] = node;
+        return nodeIdx;
+    }
+
+    struct DecodedChildren
+    {
+        Float3 lower[2];
+        float  tNear[2];
+        bool   hit[2];
+    };
+
+    DecodedChildren intersectChildren(
+        const CompressedBVH::Node &node,
+        const Float3              &origin,
+        const Ray                 &ray,
+        const Float3              &invDir)
+    {
+        const Float3 step = {
+            exp2i(node.exponent[0]),
+            exp2i(node.exponent[1]),
+            exp2i(node.exponent[2])
+        };
+
+        DecodedChildren result;
+        for(int i = 0; i < 2; ++i)
+        {
+            if(node.child[i] == CompressedBVH::Node::CHILD_NIL)
+            {
+                result.hit[i] = false;
+                continue;
+            }
+
+            float t0 = ray.t0, t1 = ray.t1;
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                const float lower = decode(
+                    origin[axis], step[axis], node.qlower[i][axis]);
+                const float upper = decode(
+                    origin[axis], step[axis], node.qupper[i][axis]);
+
+                const float n = invDir[axis] * (lower - ray.o[axis]);
+                const float f = invDir[axis] * (upper - ray.o[axis]);
+
+                t0 = (std::max)(t0, (std::min)(n, f));
+                t1 = (std::min)(t1, (std::max)(n, f));
+
+                result.lower[i][axis] = lower;
+            }
+
+            result.tNear[i] = t0;
+            result.hit[i]   = t0 <= t1;
+        }
+
+        return result;
+    }
+
+    struct StackEntry
+    {
+        uint32_t node;
+        Float3   origin;
+        float    tNear;
+    };
+
+    thread_local StackEntry traversalStack[CompressedBVH::TRAVERSAL_STACK_SIZE];
+
+    struct Float3Hash
+    {
+        size_t operator()(const Float3 &v) const noexcept
+        {
+            size_t h = std::bit_cast<uint32_t>(v.x);
+            h = h * 0x9e3779b97f4a7c15ull + std::bit_cast<uint32_t>(v.y);
+            h = h * 0x9e3779b97f4a7c15ull + std::bit_cast<uint32_t>(v.z);
+            return h;
+        }
+    };
+
+    struct Float3BitEqual
+    {
+        bool operator()(const Float3 &a, const Float3 &b) const noexcept
+        {
+            return std::bit_cast<uint32_t>(a.x) == std::bit_cast<uint32_t>(b.x)
+                && std::bit_cast<uint32_t>(a.y) == std::bit_cast<uint32_t>(b.y)
+                && std::bit_cast<uint32_t>(a.z) == std::bit_cast<uint32_t>(b.z);
+        }
+    };
+
+} // namespace anonymous
+
+CompressedBVH CompressedBVH::create(const BVH &bvh)
+{
+    CompressedBVH result;
+    result.triangles_.assign(
+        bvh.getTriangles().begin(), bvh.getTriangles().end());
+
+    const auto binaryNodes = bvh.getNodes();
+    if(!binaryNodes.empty())
+    {
+        result.rootOrigin_ = binaryNodes[0].lower;
+        compress(binaryNodes, 0, result.rootOrigin_, result.nodes_);
+    }
+
+    return result;
+}
+
+CompressedBVH CompressedBVH::create(
+    const BVH &bvh, const Float3 *triangleVertices)
+{
+    CompressedBVH result;
+
+    std::unordered_map<Float3, uint32_t, Float3Hash, Float3BitEqual>
+        vertexToIndex;
+
+    auto weld = [&](const Float3 &v)
+    {
+        const auto [it, inserted] = vertexToIndex.try_emplace(
+            v, static_cast<uint32_t>(result.vertices_.size()));
+        if(inserted)
+            result.vertices_.push_back(v);
+        return it->second;
+    };
+
+    const auto triangles = bvh.getTriangles();
+    result.indexedTriangles_.reserve(triangles.size());
+    for(auto &tri : triangles)
+    {
+        const Float3 *v = &triangleVertices[3 * tri.index];
+
+        IndexedTriangle indexedTri;
+        indexedTri.index       = tri.index;
+        indexedTri.vertices[0] = weld(v[0]);
+        indexedTri.vertices[1] = weld(v[1]);
+        indexedTri.vertices[2] = weld(v[2]);
+        result.indexedTriangles_.push_back(indexedTri);
+    }
+
+    result.vertices_.shrink_to_fit();
+
+    const auto binaryNodes = bvh.getNodes();
+    if(!binaryNodes.empty())
+    {
+        result.rootOrigin_ = binaryNodes[0].lower;
+        compress(binaryNodes, 0, result.rootOrigin_, result.nodes_);
+    }
+
+    return result;
+}
+
+bool CompressedBVH::hasIntersection(const Ray &ray) const
+{
+    if(nodes_.empty())
+        return false;
+
+    const Float3 invDir = { 1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z };
+
+    int top = 0;
+    traversalStack[top++] = { 0, rootOrigin_, ray.t0 };
+
+    while(top)
+    {
+        const StackEntry entry = traversalStack[--top];
+        const Node &node = nodes_[entry.node];
+
+        const DecodedChildren children =
+            intersectChildren(node, entry.origin, ray, invDir);
+
+        for(int i = 0; i < 2; ++i)
+        {
+            if(!children.hit[i])
+                continue;
+
+            if(node.triCount[i])
+            {
+                if(hasIntersectionWithLeaf(
+                    ray, node.child[i], node.triCount[i]))
+                    return true;
+            }
+            else
+            {
+                assert(top < TRAVERSAL_STACK_SIZE);
+                traversalStack[top++] = {
+                    node.child[i], children.lower[i], children.tNear[i]
+                };
+            }
+        }
+    }
+
+    return false;
+}
+
+bool CompressedBVH::findIntersection(
+    const Ray &ray, BVH::Intersection *inct) const
+{
+    if(nodes_.empty())
+        return false;
+
+    auto r = ray;
+    const Float3 invDir = { 1 / r.d.x, 1 / r.d.y, 1 / r.d.z };
+
+    int top = 0;
+    traversalStack[top++] = { 0, rootOrigin_, r.t0 };
+
+    int finalIndex = 0;
+    Float2 finalUV;
+    bool hit = false;
+
+    while(top)
+    {
+        const StackEntry entry = traversalStack[--top];
+        if(entry.tNear > r.t1)
+            continue;
+
+        const Node &node = nodes_[entry.node];
+
+        const DecodedChildren children =
+            intersectChildren(node, entry.origin, r, invDir);
+
+        // visit the nearer child first: leaves are intersected immediately,
+        // interior nodes are pushed nearest last
+
+        int order[2] = { 0, 1 };
+        if(children.hit[0] && children.hit[1] &&
+           children.tNear[1] < children.tNear[0])
+            std::swap(order[0], order[1]);
+
+        for(int i : order)
+        {
+            if(!children.hit[i] || !node.triCount[i] ||
+               children.tNear[i] > r.t1)
+                continue;
+
+            hit |= closestIntersectionWithLeaf(
+                r, node.child[i], node.triCount[i], &finalIndex, &finalUV);
+        }
+
+        for(int k = 1; k >= 0; --k)
+        {
+            const int i = order[k];
+            if(!children.hit[i] || node.triCount[i] ||
+               children.tNear[i] > r.t1)
+                continue;
+
+            assert(top < TRAVERSAL_STACK_SIZE);
+            traversalStack[top++] = {
+                node.child[i], children.lower[i], children.tNear[i]
+            };
+        }
+    }
+
+    if(!hit)
+        return false;
+
+    inct->triangle = finalIndex;
+    inct->position = r.at(r.t1);
+    inct->t        = r.t1;
+    inct->uv       = finalUV;
+
+    return true;
+}
+
+int CompressedBVH::getNodeCount() const
+{
+    return static_cast<int>(nodes_.size());
+}
+
+bool CompressedBVH::isIndexed() const
+{
+    return !indexedTriangles_.empty();
+}
+
+size_t CompressedBVH::getMemoryUsage() const
+{
+    return sizeof(Node)            * nodes_.size()
+         + sizeof(BVH::Triangle)   * triangles_.size()
+         + sizeof(IndexedTriangle) * indexedTriangles_.size()
+         + sizeof(Float3)          * vertices_.size();
+}
+
+bool CompressedBVH::hasIntersectionWithLeaf(
+    const Ray &ray, uint32_t triBeg, uint32_t triCount) const
+{
+    const uint32_t triEnd = triBeg + triCount;
+
+    if(!isIndexed())
+    {
+        for(uint32_t i = triBeg; i < triEnd; ++i)
+        {
+            const BVH::Triangle &tri = triangles_[i];
+            if(hasIntersectionWithTriangle(ray, tri.a, tri.b_a, tri.c_a))
+                return true;
+        }
+        return false;
+    }
+
+    for(uint32_t i = triBeg; i < triEnd; ++i)
+    {
+        const IndexedTriangle &tri = indexedTriangles_[i];
+        const Float3 &a = vertices_[tri.vertices[0]];
+        const Float3 &b = vertices_[tri.vertices[1]];
+        const Float3 &c = vertices_[tri.vertices[2]];
+        if(hasIntersectionWithTriangle(ray, a, b - a, c - a))
+            return true;
+    }
+    return false;
+}
+
+bool CompressedBVH::closestIntersectionWithLeaf(
+    Ray &ray, uint32_t triBeg, uint32_t triCount,
+    int *triangle, Float2 *uv) const
+{
+    const uint32_t triEnd = triBeg + triCount;
+
+    float t = ray.t1;
+    bool result = false;
+
+    if(!isIndexed())
+    {
+        for(uint32_t i = triBeg; i < triEnd; ++i)
+        {
+            const BVH::Triangle &tri = triangles_[i];
+            if(closestIntersectionWithTriangle(
+                ray, tri.a, tri.b_a, tri.c_a, &t, uv))
+            {
+                ray.t1    = t;
+                *triangle = tri.index;
+                result    = true;
+            }
+        }
+        return result;
+    }
+
+    for(uint32_t i = triBeg; i < triEnd; ++i)
+    {
+        const IndexedTriangle &tri = indexedTriangles_[i];
+        const Float3 &a = vertices_[tri.vertices[0]];
+        const Float3 &b = vertices_[tri.vertices[1]];
+        const Float3 &c = vertices_[tri.vertices[2]];
+        if(closestIntersectionWithTriangle(ray, a, b - a, c - a, &t, uv))
+        {
+            ray.t1    = t;
+            *triangle = tri.index;
+            result    = true;
+        }
+    }
+    return result;
+}
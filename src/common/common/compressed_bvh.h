@@ -0,0 +1,75 @@
+#pragma once
+
+#include <common/bvh.h>
+
+// binary BVH with child bounds quantized to 8 bits relative to the box of
+// their parent. only the root origin is kept in full precision; the origin
+// of every other node is the decoded lower corner of its own box, carried
+// down the traversal stack.
+//
+// triangles can be stored either in full (as BVH::Triangle) or as indices
+// into a shared vertex array, where exactly equal vertices are welded
+class CompressedBVH
+{
+public:
+
+    struct Node
+    {
+        static constexpr uint32_t CHILD_NIL =
+            (std::numeric_limits<uint32_t>::max)();
+
+        // child i covers origin + [qlower, qupper] * 2^exponent
+        uint8_t qlower[2][3];
+        uint8_t qupper[2][3];
+        int8_t  exponent[3];
+        uint8_t pad;
+
+        // child[i] is a node index when triCount[i] == 0,
+        // otherwise the first triangle of a leaf
+        uint32_t child[2];
+        uint16_t triCount[2];
+    };
+
+    struct IndexedTriangle
+    {
+        int      index;
+        uint32_t vertices[3];
+    };
+
+    static constexpr int TRAVERSAL_STACK_SIZE = 256;
+
+    // triangles stored in full
+    static CompressedBVH create(const BVH &bvh);
+
+    // triangles stored as indices into welded vertices.
+    // triangleVertices must be the array bvh was built from
+    static CompressedBVH create(const BVH &bvh, const Float3 *triangleVertices);
+
+    bool hasIntersection(const Ray &ray) const;
+
+    bool findIntersection(const Ray &ray, BVH::Intersection *inct) const;
+
+    int getNodeCount() const;
+
+    bool isIndexed() const;
+
+    size_t getMemoryUsage() const;
+
+private:
+
+    bool hasIntersectionWithLeaf(
+        const Ray &ray, uint32_t triBeg, uint32_t triCount) const;
+
+    // returns true when a closer hit is found. ray.t1 is shrunk to it
+    bool closestIntersectionWithLeaf(
+        Ray &ray, uint32_t triBeg, uint32_t triCount,
+        int *triangle, Float2 *uv) const;
+
+    Float3 rootOrigin_;
+
+    std::vector<Node> nodes_;
+
+    std::vector<BVH::Triangle>   triangles_;
+    std::vector<IndexedTriangle> indexedTriangles_;
+    std::vector<Float3>          vertices_;
+};
@@ -0,0 +1,75 @@
+#include <cstring>
+#include <unordered_map>
+
+#include <common/indexed_mesh.h>
+
+namespace
+{
+
+    struct VertexKey
+    {
+        uint32_t bits[8];
+
+        bool operator==(const VertexKey &other) const
+        {
+            return std::memcmp(bits, other.bits, sizeof(bits)) == 0;
+        }
+    };
+
+    struct VertexKeyHash
+    {
+        size_t operator()(const VertexKey &key) const
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for(uint32_t b : key.bits)
+            {
+                hash ^= b;
+                hash *= 1099511628211ull;
+            }
+            return static_cast<size_t>(hash);
+        }
+    };
+
+    VertexKey makeKey(const agz::mesh::vertex_t &vertex)
+    {
+        const float values[8] = {
+            vertex.position.x, vertex.position.y, vertex.position.z,
+            vertex.normal.x,   vertex.normal.y,   vertex.normal.z,
+            vertex.tex_coord.x, vertex.tex_coord.y
+        };
+
+        VertexKey result;
+        std::memcpy(result.bits, values, sizeof(values));
+        return result;
+    }
+
+} // namespace anonymous
+
+IndexedMesh weldTriangles(const std::vector<agz::mesh::triangle_t> &triangles)
+{
+    IndexedMesh result;
+    result.indices.reserve(3 * triangles.size());
+
+    std::unordered_map<VertexKey, uint32_t, VertexKeyHash> vertexToIndex;
+    vertexToIndex.reserve(triangles.size() * 3);
+
+    for(auto &triangle : triangles)
+    {
+        for(auto &vertex : triangle.vertices)
+        {
+            const auto [it, inserted] = vertexToIndex.try_emplace(
+                makeKey(vertex), static_cast<uint32_t>(result.positions.size()));
+
+            if(inserted)
+            {
+                result.positions.push_back(vertex.position);
+                result.normals.push_back(vertex.normal);
+                result.texCoords.push_back(vertex.tex_coord);
+            }
+
+            result.indices.push_back(it->second);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <agz-utils/mesh.h>
+
+#include <common/common.h>
+
+// shared vertices plus three indices per triangle
+struct IndexedMesh
+{
+    std::vector<Float3>   positions;
+    std::vector<Float3>   normals;
+    std::vector<Float2>   texCoords;
+    std::vector<uint32_t> indices;
+
+    int getTriangleCount() const
+    {
+        return static_cast<int>(indices.size() / 3);
+    }
+};
+
+// merges the corners of triangles whose position, normal and texture
+// coordinate are bitwise equal. triangle i of the result is triangle i of
+// the input, so intersection results index both the same way
+IndexedMesh weldTriangles(const std::vector<agz::mesh::triangle_t> &triangles);
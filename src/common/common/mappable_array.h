@@ -0,0 +1,110 @@
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+
+// read-only array that either owns its elements or views memory kept alive
+// by a shared owner, such as a mapped file. copies of a view share the
+// owner instead of copying the elements
+template<typename T>
+class MappableArray
+{
+public:
+
+    MappableArray() = default;
+
+    explicit MappableArray(std::vector<T> elements)
+        : owned_(std::move(elements))
+    {
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    MappableArray(
+        std::shared_ptr<const void> owner, const T *data, size_t size)
+        : owner_(std::move(owner)), data_(data), size_(size)
+    {
+
+    }
+
+    MappableArray(const MappableArray &other)
+        : owned_(other.owned_), owner_(other.owner_)
+    {
+        bind(other);
+    }
+
+    MappableArray(MappableArray &&other) noexcept
+        : owned_(std::move(other.owned_)), owner_(std::move(other.owner_))
+    {
+        bind(other);
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+
+    MappableArray &operator=(const MappableArray &other)
+    {
+        if(this != &other)
+        {
+            owned_ = other.owned_;
+            owner_ = other.owner_;
+            bind(other);
+        }
+        return *this;
+    }
+
+    MappableArray &operator=(MappableArray &&other) noexcept
+    {
+        if(this != &other)
+        {
+            owned_ = std::move(other.owned_);
+            owner_ = std::move(other.owner_);
+            bind(other);
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        return *this;
+    }
+
+    bool isView() const { return owner_ != nullptr; }
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    const T *data() const { return data_; }
+
+    const T &operator[](size_t i) const { return data_[i]; }
+
+    const T *begin() const { return data_; }
+
+    const T *end() const { return data_ + size_; }
+
+    std::span<const T> span() const { return { data_, size_ }; }
+
+    // copies the elements of a view into owned storage first
+    T *makeMutable()
+    {
+        if(owner_)
+        {
+            owned_.assign(data_, data_ + size_);
+            owner_.reset();
+            data_ = owned_.data();
+        }
+        return owned_.data();
+    }
+
+private:
+
+    void bind(const MappableArray &other)
+    {
+        data_ = owner_ ? other.data_ : owned_.data();
+        size_ = other.size_;
+    }
+
+    std::vector<T>              owned_;
+    std::shared_ptr<const void> owner_;
+
+    const T *data_ = nullptr;
+    size_t   size_ = 0;
+};
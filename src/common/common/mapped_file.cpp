@@ -0,0 +1,164 @@
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <common/mapped_file.h>
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+{
+    swap(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    MappedFile(std::move(other)).swap(*this);
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+
+    const int wideLen = MultiByteToWideChar(
+        CP_UTF8, 0, filename.c_str(), -1, nullptr, 0);
+    std::wstring wideFilename(wideLen, L'\0');
+    MultiByteToWideChar(
+        CP_UTF8, 0, filename.c_str(), -1, wideFilename.data(), wideLen);
+
+    HANDLE file = CreateFileW(
+        wideFilename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingW(
+        file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(!mapping)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(!data)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    file_    = file;
+    mapping_ = mapping;
+    data_    = data;
+    size_    = static_cast<size_t>(size.QuadPart);
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(data_)
+        UnmapViewOfFile(data_);
+    if(mapping_)
+        CloseHandle(mapping_);
+    if(file_)
+        CloseHandle(file_);
+
+    file_    = nullptr;
+    mapping_ = nullptr;
+    data_    = nullptr;
+    size_    = 0;
+}
+
+#else
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(
+        nullptr, static_cast<size_t>(st.st_size),
+        PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    if(data == MAP_FAILED)
+        return false;
+
+    data_ = data;
+    size_ = static_cast<size_t>(st.st_size);
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if(data_)
+        munmap(const_cast<void *>(data_), size_);
+
+    data_ = nullptr;
+    size_ = 0;
+}
+
+#endif
+
+bool MappedFile::isOpen() const
+{
+    return data_ != nullptr;
+}
+
+const void *MappedFile::getData() const
+{
+    return data_;
+}
+
+size_t MappedFile::getSize() const
+{
+    return size_;
+}
+
+void MappedFile::swap(MappedFile &other) noexcept
+{
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+#ifdef _WIN32
+    std::swap(file_,    other.file_);
+    std::swap(mapping_, other.mapping_);
+#endif
+}
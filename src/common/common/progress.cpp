@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <chrono>
+
+#include <common/progress.h>
+
+namespace
+{
+
+    int64_t getNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+} // namespace anonymous
+
+void Progress::begin(int64_t total)
+{
+    done_      = 0;
+    total_     = total;
+    beginTime_ = getNanoseconds();
+}
+
+void Progress::advance(int64_t units)
+{
+    done_.fetch_add(units, std::memory_order_relaxed);
+}
+
+int64_t Progress::getTotal() const
+{
+    return total_;
+}
+
+int64_t Progress::getDone() const
+{
+    return done_.load(std::memory_order_relaxed);
+}
+
+float Progress::getFraction() const
+{
+    const int64_t total = getTotal();
+    if(total <= 0)
+        return 0;
+    return (std::min)(static_cast<float>(getDone()) / total, 1.0f);
+}
+
+double Progress::getElapsedSeconds() const
+{
+    return 1e-9 * static_cast<double>(getNanoseconds() - beginTime_);
+}
+
+double Progress::getRemainingSeconds() const
+{
+    const int64_t done = getDone();
+    if(done <= 0)
+        return -1;
+
+    const int64_t remaining = (std::max)(getTotal() - done, int64_t(0));
+    return getElapsedSeconds() * remaining / done;
+}
+
+void Progress::cancel()
+{
+    cancelled_ = true;
+}
+
+bool Progress::isCancelled() const
+{
+    return cancelled_.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// thread-safe progress of a long computation. the computation announces
+// its amount of work and reports finished units from any of its threads.
+// other threads read the fraction done and an estimate of the remaining
+// time, and may ask the computation to stop early
+class Progress
+{
+public:
+
+    // starts counting total units from zero. times are measured from here
+    void begin(int64_t total);
+
+    void advance(int64_t units = 1);
+
+    int64_t getTotal() const;
+
+    int64_t getDone() const;
+
+    // in [0, 1]
+    float getFraction() const;
+
+    double getElapsedSeconds() const;
+
+    // extrapolated from the rate so far. negative until a unit is done
+    double getRemainingSeconds() const;
+
+    // the computation checks isCancelled() between units and stops
+    void cancel();
+
+    bool isCancelled() const;
+
+private:
+
+    std::atomic<int64_t> total_ = 0;
+    std::atomic<int64_t> done_  = 0;
+
+    // steady_clock time of begin(), in nanoseconds
+    std::atomic<int64_t> beginTime_ = 0;
+
+    std::atomic<bool> cancelled_ = false;
+};
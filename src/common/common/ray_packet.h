@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common/ray.h>
+
+// N rays in SoA layout, traced together by the BVH packet kernels
+template<int N>
+struct RayPacket
+{
+    static_assert(N == 4 || N == 8 || N == 16);
+
+    static constexpr uint32_t ALL_ACTIVE = (1u << N) - 1;
+
+    alignas(32) float ox[N];
+    alignas(32) float oy[N];
+    alignas(32) float oz[N];
+
+    alignas(32) float dx[N];
+    alignas(32) float dy[N];
+    alignas(32) float dz[N];
+
+    alignas(32) float t0[N];
+    alignas(32) float t1[N];
+
+    void set(int i, const Ray &r)
+    {
+        ox[i] = r.o.x; oy[i] = r.o.y; oz[i] = r.o.z;
+        dx[i] = r.d.x; dy[i] = r.d.y; dz[i] = r.d.z;
+        t0[i] = r.t0;
+        t1[i] = r.t1;
+    }
+
+    Ray get(int i) const
+    {
+        return Ray(
+            { ox[i], oy[i], oz[i] }, { dx[i], dy[i], dz[i] }, t0[i], t1[i]);
+    }
+};
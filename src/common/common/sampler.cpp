@@ -0,0 +1,211 @@
+#include <algorithm>
+
+#include <common/sampler.h>
+
+namespace
+{
+
+    constexpr float ONE_MINUS_EPS = 0x1.fffffep-1f;
+
+    constexpr uint32_t HASH_KEY = 0x5A3C9E17u;
+
+    constexpr int HALTON_PRIMES[HALTON_DIMENSION_COUNT] = {
+          2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+         59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131
+    };
+
+    uint32_t reverseBits(uint32_t bits)
+    {
+        bits = (bits << 16u) | (bits >> 16u);
+        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+        return bits;
+    }
+
+    // the first two dimensions of the Sobol sequence are the reversed bits
+    // of the index and of pascalProduct(index), so each power of two prefix
+    // of the pair is a (0, m, 2)-net.
+    // bit i of the product of the index with Pascal's triangle mod 2 is the
+    // parity of the index bits j with C(j, i) odd, which by Lucas' theorem
+    // are those whose bits contain the bits of i
+    uint32_t pascalProduct(uint32_t bits)
+    {
+        bits ^= (bits >> 1)  & 0x55555555u;
+        bits ^= (bits >> 2)  & 0x33333333u;
+        bits ^= (bits >> 4)  & 0x0F0F0F0Fu;
+        bits ^= (bits >> 8)  & 0x00FF00FFu;
+        bits ^= (bits >> 16) & 0x0000FFFFu;
+        return bits;
+    }
+
+    // each bit is flipped depending on the bits below it, which are the
+    // more significant digits once the bits are reversed
+    uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+    {
+        x += seed;
+        x ^= x * 0x6C50B47Cu;
+        x ^= x * 0xB82F1E52u;
+        x ^= x * 0xC7AFE638u;
+        x ^= x * 0x8D22F6E6u;
+        return x;
+    }
+
+    uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+    {
+        return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+    }
+
+    float radicalInverse(int base, uint32_t index)
+    {
+        const double invBase = 1.0 / base;
+
+        uint64_t reversed = 0;
+        double invBaseN = 1;
+        while(index)
+        {
+            const uint32_t next = index / base;
+            reversed = reversed * base + (index - next * base);
+            invBaseN *= invBase;
+            index = next;
+        }
+
+        return static_cast<float>(reversed * invBaseN);
+    }
+
+    // Cranley-Patterson rotation
+    float rotate(float u, uint32_t offsetBits)
+    {
+        u += uintToUnitFloat(offsetBits);
+        if(u >= 1)
+            u -= 1;
+        return (std::min)(u, ONE_MINUS_EPS);
+    }
+
+} // namespace anonymous
+
+SampleStream::SampleStream(SampleSequence sequence, uint64_t stream, uint32_t seed)
+    : sequence_(sequence), stream_(stream), seed_(seed)
+{
+
+}
+
+SampleSequence SampleStream::getSequence() const
+{
+    return sequence_;
+}
+
+float SampleStream::get1D(uint32_t index, int dim) const
+{
+    float result;
+    generate1D(index, 1, dim, &result);
+    return result;
+}
+
+Float2 SampleStream::get2D(uint32_t index, int dim) const
+{
+    Float2 result;
+    generate2D(index, 1, dim, &result.x, &result.y);
+    return result;
+}
+
+void SampleStream::generate1D(
+    uint32_t firstIndex, int count, int dim, float *out) const
+{
+    assert(dim >= 0);
+
+    if(sequence_ == SampleSequence::Halton)
+    {
+        assert(dim < HALTON_DIMENSION_COUNT);
+
+        uint32_t offsets[4];
+        hash(static_cast<uint32_t>(dim), 0, offsets);
+
+        for(int i = 0; i < count; ++i)
+        {
+            out[i] = rotate(
+                radicalInverse(HALTON_PRIMES[dim], firstIndex + i), offsets[0]);
+        }
+        return;
+    }
+
+    // the other sequences generate whole pads
+
+    float other;
+    for(int i = 0; i < count; ++i)
+    {
+        if(dim & 1)
+            generate2D(firstIndex + i, 1, dim - 1, &other, &out[i]);
+        else
+            generate2D(firstIndex + i, 1, dim, &out[i], &other);
+    }
+}
+
+void SampleStream::generate2D(
+    uint32_t firstIndex, int count, int dim, float *u1, float *u2) const
+{
+    assert(dim >= 0 && dim % 2 == 0);
+
+    switch(sequence_)
+    {
+    case SampleSequence::Random:
+        {
+            for(int i = 0; i < count; ++i)
+            {
+                uint32_t bits[4];
+                hash(firstIndex + i, static_cast<uint32_t>(dim / 2), bits);
+                u1[i] = uintToUnitFloat(bits[0]);
+                u2[i] = uintToUnitFloat(bits[1]);
+            }
+        }
+        break;
+    case SampleSequence::Sobol:
+    case SampleSequence::OwenSobol:
+        {
+            // keys[0] shuffles the samples of the pad, keys[1] and keys[2]
+            // shift or scramble its two dimensions. the scrambles work on
+            // reversed bits, so they are applied before the Sobol values
+            // are reversed
+
+            uint32_t keys[4];
+            hash(static_cast<uint32_t>(dim / 2), 0, keys);
+
+            const bool owen = sequence_ == SampleSequence::OwenSobol;
+            for(int i = 0; i < count; ++i)
+            {
+                const uint32_t index = nestedUniformScramble(firstIndex + i, keys[0]);
+                const uint32_t product = pascalProduct(index);
+
+                uint32_t x, y;
+                if(owen)
+                {
+                    x = reverseBits(laineKarrasPermutation(index, keys[1]));
+                    y = reverseBits(laineKarrasPermutation(product, keys[2]));
+                }
+                else
+                {
+                    x = reverseBits(index) ^ keys[1];
+                    y = reverseBits(product) ^ keys[2];
+                }
+
+                u1[i] = uintToUnitFloat(x);
+                u2[i] = uintToUnitFloat(y);
+            }
+        }
+        break;
+    case SampleSequence::Halton:
+        generate1D(firstIndex, count, dim,     u1);
+        generate1D(firstIndex, count, dim + 1, u2);
+        break;
+    }
+}
+
+void SampleStream::hash(uint32_t a, uint32_t b, uint32_t out[4]) const
+{
+    const uint32_t counter[4] = {
+        a, b, static_cast<uint32_t>(stream_), static_cast<uint32_t>(stream_ >> 32)
+    };
+    const uint32_t key[2] = { seed_, HASH_KEY };
+    philox4x32(counter, key, out);
+}
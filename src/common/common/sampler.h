@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+
+#include <common/common.h>
+
+// deterministic sample sequences shared by the precompute code.
+//
+// dimension dim of sample index in a stream is a pure function of
+// (sequence, seed, stream, index, dim), so the values do not depend on how
+// samples are split over threads or in which order they are drawn.
+// independent estimates, e.g. the samples of different vertices, use
+// different streams
+enum class SampleSequence
+{
+    // Philox4x32-10 counter-based random numbers
+    Random,
+
+    // 2D Sobol points, digitally shifted per stream. dimensions 2k and
+    // 2k + 1 form pad k, whose sample order is shuffled per stream and pad
+    // so that pads are not correlated with each other
+    Sobol,
+
+    // padded like Sobol, with the hashed Owen scrambling of Burley,
+    // "Practical Hash-based Owen Scrambling", 2020
+    OwenSobol,
+
+    // radical inverses in the first HALTON_DIMENSION_COUNT primes,
+    // rotated per stream and dimension
+    Halton
+};
+
+constexpr int HALTON_DIMENSION_COUNT = 32;
+
+// the Philox4x32-10 generator of Salmon et al., "Parallel Random Numbers:
+// As Easy as 1, 2, 3", 2011
+inline void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4])
+{
+    uint32_t c[4] = { counter[0], counter[1], counter[2], counter[3] };
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for(int round = 0; round < 10; ++round)
+    {
+        const uint64_t p0 = uint64_t(0xD2511F53u) * c[0];
+        const uint64_t p1 = uint64_t(0xCD9E8D57u) * c[2];
+
+        const uint32_t hi0 = uint32_t(p0 >> 32), lo0 = uint32_t(p0);
+        const uint32_t hi1 = uint32_t(p1 >> 32), lo1 = uint32_t(p1);
+
+        c[0] = hi1 ^ c[1] ^ k0;
+        c[1] = lo1;
+        c[2] = hi0 ^ c[3] ^ k1;
+        c[3] = lo0;
+
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+
+    for(int i = 0; i < 4; ++i)
+        out[i] = c[i];
+}
+
+// maps 32 random bits to [0, 1)
+inline float uintToUnitFloat(uint32_t bits)
+{
+    return static_cast<float>(bits >> 8) * 0x1p-24f;
+}
+
+class SampleStream
+{
+public:
+
+    explicit SampleStream(
+        SampleSequence sequence, uint64_t stream = 0, uint32_t seed = 0);
+
+    SampleSequence getSequence() const;
+
+    float get1D(uint32_t index, int dim) const;
+
+    // dimensions dim and dim + 1. dim must be even
+    Float2 get2D(uint32_t index, int dim) const;
+
+    // out[i] = get1D(firstIndex + i, dim)
+    void generate1D(uint32_t firstIndex, int count, int dim, float *out) const;
+
+    // (u1[i], u2[i]) = get2D(firstIndex + i, dim). the outputs are SoA so
+    // that they can be fed to packet kernels directly
+    void generate2D(
+        uint32_t firstIndex, int count, int dim, float *u1, float *u2) const;
+
+private:
+
+    // philox4x32 of (a, b, stream) under the seed
+    void hash(uint32_t a, uint32_t b, uint32_t out[4]) const;
+
+    SampleSequence sequence_;
+    uint64_t       stream_;
+    uint32_t       seed_;
+};
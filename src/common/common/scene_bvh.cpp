@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <unordered_set>
+
+#include <common/scene_bvh.h>
+
+namespace
+{
+
+    using AABB = agz::math::aabb3f;
+
+    constexpr uint32_t TOP_LEVEL_STACK_SIZE = 64;
+
+    bool bboxHasIntersection(
+        const BVH::Node &node,
+        const Float3    &ori,
+        const Float3    &invDir,
+        float            t0,
+        float            t1)
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            const float n = invDir[axis] * (node.lower[axis] - ori[axis]);
+            const float f = invDir[axis] * (node.upper[axis] - ori[axis]);
+            t0 = (std::max)(t0, (std::min)(n, f));
+            t1 = (std::min)(t1, (std::max)(n, f));
+        }
+        return t0 <= t1;
+    }
+
+    uint32_t buildTopLevel(
+        std::vector<BVH::Node>    &nodes,
+        int                       *order,
+        int                        beg,
+        int                        end,
+        const std::vector<AABB>   &bounds,
+        const std::vector<Float3> &centroids)
+    {
+        const uint32_t nodeIdx = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        AABB aabb, centroidAABB;
+        for(int i = beg; i < end; ++i)
+        {
+            aabb |= bounds[order[i]].low;
+            aabb |= bounds[order[i]].high;
+            centroidAABB |= centroids[order[i]];
+        }
+
+        nodes[nodeIdx].lower = aabb.low;
+        nodes[nodeIdx].upper = aabb.high;
+
+        // one instance per leaf: each of them is a whole bottom-level BVH
+
+        if(end - beg <= 1)
+        {
+            nodes[nodeIdx].triBeg = static_cast<uint32_t>(beg);
+            nodes[nodeIdx].triEnd = static_cast<uint32_t>(end);
+            return nodeIdx;
+        }
+
+        const Float3 extent = centroidAABB.high - centroidAABB.low;
+        const int axis = extent.x > extent.y ?
+                        (extent.x > extent.z ? 0 : 2) :
+                        (extent.y > extent.z ? 1 : 2);
+
+        const int middle = (beg + end) / 2;
+        std::nth_element(
+            order + beg, order + middle, order + end, [&](int a, int b)
+        {
+            return centroids[a][axis] < centroids[b][axis];
+        });
+
+        buildTopLevel(nodes, order, beg, middle, bounds, centroids);
+        const uint32_t right =
+            buildTopLevel(nodes, order, middle, end, bounds, centroids);
+
+        nodes[nodeIdx].triBeg     = BVH::Node::TRI_NIL;
+        nodes[nodeIdx].rightChild = right;
+
+        return nodeIdx;
+    }
+
+} // namespace anonymous
+
+int SceneBVH::addInstance(std::shared_ptr<const BVH> mesh, const Mat4 &world)
+{
+    assert(mesh);
+    Instance instance;
+    instance.mesh = std::move(mesh);
+    updateInstance(instance, world);
+    instances_.push_back(std::move(instance));
+    return static_cast<int>(instances_.size() - 1);
+}
+
+void SceneBVH::setWorld(int instance, const Mat4 &world)
+{
+    updateInstance(instances_[instance], world);
+}
+
+int SceneBVH::getInstanceCount() const
+{
+    return static_cast<int>(instances_.size());
+}
+
+void SceneBVH::build()
+{
+    nodes_.clear();
+    instanceOrder_.clear();
+
+    std::vector<AABB> bounds(instances_.size());
+    std::vector<Float3> centroids(instances_.size());
+    for(int i = 0; i < getInstanceCount(); ++i)
+    {
+        const Instance &instance = instances_[i];
+        if(instance.mesh->empty())
+            continue;
+
+        AABB aabb;
+        aabb.low  = instance.lower;
+        aabb.high = instance.upper;
+
+        instanceOrder_.push_back(i);
+        bounds[i]    = aabb;
+        centroids[i] = 0.5f * (instance.lower + instance.upper);
+    }
+
+    if(instanceOrder_.empty())
+        return;
+
+    nodes_.reserve(2 * instanceOrder_.size());
+    buildTopLevel(
+        nodes_, instanceOrder_.data(),
+        0, static_cast<int>(instanceOrder_.size()), bounds, centroids);
+}
+
+bool SceneBVH::hasIntersection(const Ray &ray) const
+{
+    if(nodes_.empty())
+        return false;
+
+    const Float3 invDir = { 1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z };
+
+    uint32_t stack[TOP_LEVEL_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while(top)
+    {
+        const BVH::Node &node = nodes_[stack[--top]];
+        if(!bboxHasIntersection(node, ray.o, invDir, ray.t0, ray.t1))
+            continue;
+
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            {
+                const Instance &instance = instances_[instanceOrder_[i]];
+                const Affine &m = instance.worldToLocal;
+
+                // the direction is not normalized, so t is the same in
+                // both spaces
+
+                const Ray localRay(
+                    ray.o.x * m.rows[0] + ray.o.y * m.rows[1] +
+                    ray.o.z * m.rows[2] + m.rows[3],
+                    ray.d.x * m.rows[0] + ray.d.y * m.rows[1] +
+                    ray.d.z * m.rows[2],
+                    ray.t0, ray.t1);
+
+                if(instance.mesh->hasIntersection(localRay))
+                    return true;
+            }
+        }
+        else
+        {
+            assert(top + 2 <= static_cast<int>(TOP_LEVEL_STACK_SIZE));
+            stack[top++] = node.rightChild;
+            stack[top++] = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+        }
+    }
+
+    return false;
+}
+
+bool SceneBVH::findIntersection(const Ray &ray, Intersection *inct) const
+{
+    if(nodes_.empty())
+        return false;
+
+    auto r = ray;
+    const Float3 invDir = { 1 / r.d.x, 1 / r.d.y, 1 / r.d.z };
+
+    uint32_t stack[TOP_LEVEL_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    bool result = false;
+
+    while(top)
+    {
+        const BVH::Node &node = nodes_[stack[--top]];
+        if(!bboxHasIntersection(node, r.o, invDir, r.t0, r.t1))
+            continue;
+
+        if(node.isLeaf())
+        {
+            for(uint32_t i = node.triBeg; i < node.triEnd; ++i)
+            {
+                const int instanceIdx = instanceOrder_[i];
+                const Instance &instance = instances_[instanceIdx];
+                const Affine &m = instance.worldToLocal;
+
+                const Ray localRay(
+                    r.o.x * m.rows[0] + r.o.y * m.rows[1] +
+                    r.o.z * m.rows[2] + m.rows[3],
+                    r.d.x * m.rows[0] + r.d.y * m.rows[1] +
+                    r.d.z * m.rows[2],
+                    r.t0, r.t1);
+
+                BVH::Intersection meshInct;
+                if(instance.mesh->findIntersection(localRay, &meshInct))
+                {
+                    r.t1 = meshInct.t;
+
+                    inct->instance          = instanceIdx;
+                    inct->meshInct          = meshInct;
+                    inct->meshInct.position = r.at(meshInct.t);
+
+                    result = true;
+                }
+            }
+        }
+        else
+        {
+            assert(top + 2 <= static_cast<int>(TOP_LEVEL_STACK_SIZE));
+            stack[top++] = node.rightChild;
+            stack[top++] = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+        }
+    }
+
+    return result;
+}
+
+size_t SceneBVH::getMemoryUsage() const
+{
+    size_t result = sizeof(BVH::Node) * nodes_.size()
+                  + sizeof(int)       * instanceOrder_.size()
+                  + sizeof(Instance)  * instances_.size();
+
+    std::unordered_set<const BVH *> meshes;
+    for(auto &instance : instances_)
+    {
+        if(meshes.insert(instance.mesh.get()).second)
+            result += instance.mesh->getMemoryUsage();
+    }
+
+    return result;
+}
+
+void SceneBVH::updateInstance(Instance &instance, const Mat4 &world)
+{
+    Affine localToWorld;
+    for(int r = 0; r < 4; ++r)
+        localToWorld.rows[r] = { world(r, 0), world(r, 1), world(r, 2) };
+
+    // invert the linear part via cofactors: the columns of its inverse are
+    // the cross products of its rows
+
+    const Float3 &r0 = localToWorld.rows[0];
+    const Float3 &r1 = localToWorld.rows[1];
+    const Float3 &r2 = localToWorld.rows[2];
+
+    const Float3 c0 = cross(r1, r2);
+    const Float3 c1 = cross(r2, r0);
+    const Float3 c2 = cross(r0, r1);
+    const float invDet = 1 / dot(r0, c0);
+
+    Affine &inv = instance.worldToLocal;
+    for(int k = 0; k < 3; ++k)
+        inv.rows[k] = invDet * Float3(c0[k], c1[k], c2[k]);
+
+    const Float3 &t = localToWorld.rows[3];
+    inv.rows[3] = -(t.x * inv.rows[0] + t.y * inv.rows[1] + t.z * inv.rows[2]);
+
+    // world bounds from the eight corners of the object-space root box
+
+    AABB aabb;
+    if(!instance.mesh->empty())
+    {
+        const BVH::Node &root = instance.mesh->getNodes()[0];
+        for(int i = 0; i < 8; ++i)
+        {
+            const Float3 p = {
+                (i & 1) ? root.upper.x : root.lower.x,
+                (i & 2) ? root.upper.y : root.lower.y,
+                (i & 4) ? root.upper.z : root.lower.z
+            };
+            aabb |= p.x * localToWorld.rows[0] + p.y * localToWorld.rows[1] +
+                    p.z * localToWorld.rows[2] + localToWorld.rows[3];
+        }
+    }
+
+    instance.lower = aabb.low;
+    instance.upper = aabb.high;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+
+#include <common/bvh.h>
+
+// two-level BVH over mesh instances.
+//
+// bottom levels are ordinary BVHs in object space, shared between all
+// instances of a mesh, so memory scales with the number of unique meshes.
+// the top level is built over the world-space bounds of the instances and
+// is cheap enough to rebuild every frame.
+//
+// after moving instances or refitting a shared bottom level (BVH::refit),
+// call build before tracing again
+class SceneBVH
+{
+public:
+
+    struct Intersection
+    {
+        int instance;
+
+        // position is in world space, triangle and uv refer to the mesh
+        BVH::Intersection meshInct;
+    };
+
+    // world uses the row vector convention of the renderers: the
+    // world-space position is mul(float4(p, 1), world)
+    int addInstance(std::shared_ptr<const BVH> mesh, const Mat4 &world);
+
+    void setWorld(int instance, const Mat4 &world);
+
+    int getInstanceCount() const;
+
+    // rebuilds the top level over the current instance bounds
+    void build();
+
+    bool hasIntersection(const Ray &ray) const;
+
+    bool findIntersection(const Ray &ray, Intersection *inct) const;
+
+    // top level, instances and each unique mesh counted once
+    size_t getMemoryUsage() const;
+
+private:
+
+    // p' = p.x * rows[0] + p.y * rows[1] + p.z * rows[2] + rows[3]
+    struct Affine
+    {
+        Float3 rows[4];
+    };
+
+    struct Instance
+    {
+        std::shared_ptr<const BVH> mesh;
+
+        Affine worldToLocal;
+        Float3 lower;
+        Float3 upper;
+    };
+
+    void updateInstance(Instance &instance, const Mat4 &world);
+
+    std::vector<Instance> instances_;
+
+    // leaves refer to ranges of instanceOrder_
+    std::vector<BVH::Node> nodes_;
+    std::vector<int>       instanceOrder_;
+};
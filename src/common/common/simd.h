@@ -0,0 +1,103 @@
+#pragma once
+
+#include <immintrin.h>
+
+// thin wrappers over SSE/AVX registers shared by the BVH kernels.
+// comparisons return lane masks, which movemask packs into an int
+
+#if defined(__AVX2__) || defined(__AVX__)
+constexpr bool SIMD_HAS_AVX = true;
+#else
+constexpr bool SIMD_HAS_AVX = false;
+#endif
+
+template<int W>
+struct SIMDLanes;
+
+template<>
+struct SIMDLanes<4>
+{
+    using T = __m128;
+
+    static T zero()                  { return _mm_setzero_ps(); }
+    static T set1(float v)           { return _mm_set1_ps(v); }
+    static T load(const float *p)    { return _mm_load_ps(p); }
+    static void store(float *p, T v) { _mm_store_ps(p, v); }
+
+    static T add(T a, T b) { return _mm_add_ps(a, b); }
+    static T sub(T a, T b) { return _mm_sub_ps(a, b); }
+    static T mul(T a, T b) { return _mm_mul_ps(a, b); }
+    static T div(T a, T b) { return _mm_div_ps(a, b); }
+    static T min(T a, T b) { return _mm_min_ps(a, b); }
+    static T max(T a, T b) { return _mm_max_ps(a, b); }
+
+    static T lt (T a, T b) { return _mm_cmplt_ps(a, b); }
+    static T le (T a, T b) { return _mm_cmple_ps(a, b); }
+    static T eq (T a, T b) { return _mm_cmpeq_ps(a, b); }
+    static T neq(T a, T b) { return _mm_cmpneq_ps(a, b); }
+
+    static T and_(T a, T b)   { return _mm_and_ps(a, b); }
+    static T or_ (T a, T b)   { return _mm_or_ps(a, b); }
+    static T andnot(T a, T b) { return _mm_andnot_ps(b, a); } // a & ~b
+
+    // mask ? b : a
+    static T select(T a, T b, T mask) { return or_(and_(mask, b), andnot(a, mask)); }
+
+    static int movemask(T v) { return _mm_movemask_ps(v); }
+
+    // lane i is set when bit i of m is set
+    static T fromBits(int m)
+    {
+        const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+        const __m128i v = _mm_and_si128(_mm_set1_epi32(m), bits);
+        return _mm_castsi128_ps(_mm_cmpeq_epi32(v, bits));
+    }
+};
+
+#if defined(__AVX2__) || defined(__AVX__)
+
+template<>
+struct SIMDLanes<8>
+{
+    using T = __m256;
+
+    static T zero()                  { return _mm256_setzero_ps(); }
+    static T set1(float v)           { return _mm256_set1_ps(v); }
+    static T load(const float *p)    { return _mm256_load_ps(p); }
+    static void store(float *p, T v) { _mm256_store_ps(p, v); }
+
+    static T add(T a, T b) { return _mm256_add_ps(a, b); }
+    static T sub(T a, T b) { return _mm256_sub_ps(a, b); }
+    static T mul(T a, T b) { return _mm256_mul_ps(a, b); }
+    static T div(T a, T b) { return _mm256_div_ps(a, b); }
+    static T min(T a, T b) { return _mm256_min_ps(a, b); }
+    static T max(T a, T b) { return _mm256_max_ps(a, b); }
+
+    static T lt (T a, T b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static T le (T a, T b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static T eq (T a, T b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static T neq(T a, T b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+
+    static T and_(T a, T b)   { return _mm256_and_ps(a, b); }
+    static T or_ (T a, T b)   { return _mm256_or_ps(a, b); }
+    static T andnot(T a, T b) { return _mm256_andnot_ps(b, a); } // a & ~b
+
+    // mask ? b : a
+    static T select(T a, T b, T mask) { return _mm256_blendv_ps(a, b, mask); }
+
+    static int movemask(T v) { return _mm256_movemask_ps(v); }
+
+    // lane i is set when bit i of m is set
+    static T fromBits(int m)
+    {
+        const __m128 lo = SIMDLanes<4>::fromBits(m);
+        const __m128 hi = SIMDLanes<4>::fromBits(m >> 4);
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+};
+
+#endif
+
+// widest available lane count for processing N values
+template<int N>
+constexpr int SIMD_WIDTH = (N >= 8 && SIMD_HAS_AVX) ? 8 : 4;
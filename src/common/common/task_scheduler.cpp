@@ -0,0 +1,340 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <common/task_scheduler.h>
+
+namespace
+{
+
+    // the scheduler and worker index of the current thread, if it is a
+    // worker. parallelFor uses them to tell nested loops from submissions
+    thread_local const TaskScheduler *currentScheduler = nullptr;
+    thread_local int                  currentWorker    = -1;
+
+    // busy time is only measured for the outermost range of a worker, as
+    // nested ranges run inside it
+    thread_local int rangeDepth = 0;
+
+    // yields of a worker waiting for the stolen halves of its nested loop
+    // before it sleeps until they are done
+    constexpr int NESTED_WAIT_SPIN_COUNT = 64;
+
+} // namespace anonymous
+
+struct TaskScheduler::Worker
+{
+    std::mutex        mutex;
+    std::deque<Range> ranges;
+
+    // ranges.size(), readable without the lock
+    std::atomic<int> rangeCount = 0;
+
+    // first victim tried by the next steal
+    int nextVictim = 0;
+
+    std::atomic<int64_t> runCount        = 0;
+    std::atomic<int64_t> stealCount      = 0;
+    std::atomic<int64_t> busyNanoseconds = 0;
+
+    std::thread thread;
+};
+
+TaskScheduler::TaskScheduler(int threadCount)
+{
+    if(threadCount <= 0)
+        threadCount += static_cast<int>(std::thread::hardware_concurrency());
+    threadCount = (std::max)(threadCount, 1);
+
+    workers_.resize(threadCount);
+    for(auto &worker : workers_)
+        worker = std::make_unique<Worker>();
+
+    for(int i = 0; i < threadCount; ++i)
+    {
+        workers_[i]->nextVictim = (i + 1) % threadCount;
+        workers_[i]->thread = std::thread([this, i] { workerMain(i); });
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard lock(sleepMutex_);
+        stop_ = true;
+    }
+    wakeCondition_.notify_all();
+
+    for(auto &worker : workers_)
+        worker->thread.join();
+}
+
+TaskScheduler &TaskScheduler::getDefault()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+int TaskScheduler::getThreadCount() const
+{
+    return static_cast<int>(workers_.size());
+}
+
+TaskScheduler::Statistics TaskScheduler::getStatistics() const
+{
+    Statistics result;
+    for(auto &worker : workers_)
+    {
+        result.rangeCount  += worker->runCount;
+        result.stealCount  += worker->stealCount;
+        result.busySeconds += 1e-9 * static_cast<double>(worker->busyNanoseconds);
+    }
+    return result;
+}
+
+void TaskScheduler::resetStatistics()
+{
+    for(auto &worker : workers_)
+    {
+        worker->runCount        = 0;
+        worker->stealCount      = 0;
+        worker->busyNanoseconds = 0;
+    }
+}
+
+void TaskScheduler::run(Job &job, int beg, int end)
+{
+    job.remaining = end - beg;
+
+    if(currentScheduler == this)
+    {
+        // nested loop: run it here and help until the other workers are
+        // done with the halves they stole
+
+        const int workerIdx = currentWorker;
+        runRange(workerIdx, { &job, beg, end });
+
+        int spinCount = 0;
+        while(job.remaining.load(std::memory_order_acquire) > 0)
+        {
+            Range range;
+            if(popOrSteal(workerIdx, range))
+            {
+                runRange(workerIdx, range);
+                spinCount = 0;
+                continue;
+            }
+
+            if(spinCount++ < NESTED_WAIT_SPIN_COUNT)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // finishIterations decreases remaining before it checks
+            // nestedWaitingCount_, as pushes do with sleepingCount_
+
+            std::unique_lock lock(sleepMutex_);
+            ++sleepingCount_;
+            ++nestedWaitingCount_;
+            wakeCondition_.wait(lock, [&]
+            {
+                return job.remaining == 0 || pendingCount_ > 0;
+            });
+            --nestedWaitingCount_;
+            --sleepingCount_;
+
+            spinCount = 0;
+        }
+    }
+    else
+    {
+        job.external = true;
+
+        {
+            std::lock_guard lock(injectedMutex_);
+            injected_.push_back({ &job, beg, end });
+            ++pendingCount_;
+        }
+        wakeWorker();
+
+        std::unique_lock lock(job.mutex);
+        job.doneCondition.wait(lock, [&] { return job.done; });
+    }
+
+    if(job.exception)
+        std::rethrow_exception(job.exception);
+}
+
+void TaskScheduler::workerMain(int workerIdx)
+{
+    currentScheduler = this;
+    currentWorker    = workerIdx;
+
+    for(;;)
+    {
+        Range range;
+        if(popOrSteal(workerIdx, range))
+        {
+            runRange(workerIdx, range);
+            continue;
+        }
+
+        // pushes increase pendingCount_ before they check sleepingCount_,
+        // so a range pushed after the check below always wakes a worker
+
+        std::unique_lock lock(sleepMutex_);
+        ++sleepingCount_;
+        wakeCondition_.wait(lock, [&] { return stop_ || pendingCount_ > 0; });
+        --sleepingCount_;
+
+        if(stop_)
+            return;
+    }
+}
+
+void TaskScheduler::runRange(int workerIdx, const Range &range)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Worker &worker = *workers_[workerIdx];
+    Job &job = *range.job;
+
+    const auto start = rangeDepth++ ? Clock::time_point() : Clock::now();
+
+    int beg = range.beg, end = range.end;
+    while(beg < end)
+    {
+        if(end - beg > job.grain && !worker.rangeCount)
+        {
+            const int middle = beg + (end - beg) / 2;
+            push(workerIdx, { &job, middle, end });
+            end = middle;
+            continue;
+        }
+
+        const int chunkEnd = (std::min)(beg + job.grain, end);
+        if(!job.failed.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                job.func(job.context, workerIdx, beg, chunkEnd);
+            }
+            catch(...)
+            {
+                std::lock_guard lock(job.mutex);
+                if(!job.failed.exchange(true))
+                    job.exception = std::current_exception();
+            }
+        }
+        beg = chunkEnd;
+    }
+
+    if(!--rangeDepth)
+    {
+        worker.busyNanoseconds += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+    ++worker.runCount;
+
+    finishIterations(job, end - range.beg);
+}
+
+void TaskScheduler::finishIterations(Job &job, int count)
+{
+    // the job lives on the stack of its caller, which may return as soon
+    // as remaining reaches zero. read everything needed before that
+
+    const bool external = job.external;
+    if(job.remaining.fetch_sub(count) != count)
+        return;
+
+    if(external)
+    {
+        std::lock_guard lock(job.mutex);
+        job.done = true;
+        job.doneCondition.notify_one();
+    }
+    else if(nestedWaitingCount_ > 0)
+    {
+        // the owner may be one of several sleepers on the condition
+        std::lock_guard lock(sleepMutex_);
+        wakeCondition_.notify_all();
+    }
+}
+
+void TaskScheduler::push(int workerIdx, const Range &range)
+{
+    Worker &worker = *workers_[workerIdx];
+    {
+        std::lock_guard lock(worker.mutex);
+        worker.ranges.push_back(range);
+        ++worker.rangeCount;
+        ++pendingCount_;
+    }
+    wakeWorker();
+}
+
+void TaskScheduler::wakeWorker()
+{
+    if(sleepingCount_ > 0)
+    {
+        std::lock_guard lock(sleepMutex_);
+        wakeCondition_.notify_one();
+    }
+}
+
+bool TaskScheduler::popOrSteal(int workerIdx, Range &range)
+{
+    if(!pendingCount_)
+        return false;
+
+    Worker &worker = *workers_[workerIdx];
+    if(worker.rangeCount)
+    {
+        std::lock_guard lock(worker.mutex);
+        if(!worker.ranges.empty())
+        {
+            range = worker.ranges.back();
+            worker.ranges.pop_back();
+            --worker.rangeCount;
+            --pendingCount_;
+            return true;
+        }
+    }
+
+    {
+        std::lock_guard lock(injectedMutex_);
+        if(!injected_.empty())
+        {
+            range = injected_.front();
+            injected_.pop_front();
+            --pendingCount_;
+            return true;
+        }
+    }
+
+    const int workerCount = getThreadCount();
+    for(int i = 0; i < workerCount; ++i)
+    {
+        const int victimIdx = worker.nextVictim;
+        worker.nextVictim = (victimIdx + 1) % workerCount;
+
+        Worker &victim = *workers_[victimIdx];
+        if(victimIdx == workerIdx || !victim.rangeCount)
+            continue;
+
+        std::lock_guard lock(victim.mutex);
+        if(!victim.ranges.empty())
+        {
+            range = victim.ranges.front();
+            victim.ranges.pop_front();
+            --victim.rangeCount;
+            --pendingCount_;
+            ++worker.stealCount;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// pool of worker threads shared by the precompute code. BVH builds, bakes
+// and table generation all submit their loops to getDefault(), so loops
+// started inside other loops or from several threads share the cores
+// instead of each spawning a full set of threads.
+//
+// every worker owns a deque of index ranges. it pops from the back of its
+// own deque and steals from the front of the others, so thieves take the
+// oldest and largest ranges. a range runs grain iterations at a time, and
+// whenever the deque of its worker is empty the upper half of the rest is
+// pushed for thieves (lazy binary splitting, Tzannes et al. 2010). ranges
+// are thus only split as far as idle workers ask for
+class TaskScheduler
+{
+public:
+
+    struct Statistics
+    {
+        // ranges run by workers, including split halves
+        int64_t rangeCount = 0;
+
+        // ranges taken from the deque of another worker
+        int64_t stealCount = 0;
+
+        // time spent in loop bodies, summed over workers
+        double busySeconds = 0;
+    };
+
+    // values <= 0 are added to the hardware thread count
+    explicit TaskScheduler(int threadCount = 0);
+
+    TaskScheduler(const TaskScheduler &) = delete;
+
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    ~TaskScheduler();
+
+    // one worker per hardware thread
+    static TaskScheduler &getDefault();
+
+    int getThreadCount() const;
+
+    // calls func(threadIdx, i) for every i in [beg, end) and returns when
+    // all calls are done. threadIdx is the index of the calling worker in
+    // [0, getThreadCount()), so it can select per-thread scratch.
+    //
+    // called from a worker, the loop is nested: the worker runs it itself
+    // and helps with other ranges until it is done, sleeping when there are
+    // none left to help with. such a worker may start another call of an
+    // outer loop with the same threadIdx, so per-thread scratch must not be
+    // held across a nested parallelFor.
+    // called from any other thread, the caller blocks meanwhile.
+    //
+    // the first exception thrown by func skips the remaining iterations and
+    // is rethrown once the running ones are done
+    template<typename Func>
+    void parallelFor(int beg, int end, const Func &func, int grain = 1);
+
+    Statistics getStatistics() const;
+
+    void resetStatistics();
+
+private:
+
+    struct Job
+    {
+        void (*func)(const void *context, int threadIdx, int beg, int end);
+        const void *context;
+        int         grain;
+
+        // iterations not done yet
+        std::atomic<int> remaining;
+
+        std::atomic<bool>  failed = false;
+        std::exception_ptr exception;
+
+        // submitted by a thread outside the pool, which waits for done
+        bool                    external = false;
+        bool                    done     = false;
+        std::mutex              mutex;
+        std::condition_variable doneCondition;
+    };
+
+    struct Range
+    {
+        Job *job;
+        int  beg;
+        int  end;
+    };
+
+    struct Worker;
+
+    void run(Job &job, int beg, int end);
+
+    void workerMain(int workerIdx);
+
+    void runRange(int workerIdx, const Range &range);
+
+    void finishIterations(Job &job, int count);
+
+    void push(int workerIdx, const Range &range);
+
+    void wakeWorker();
+
+    bool popOrSteal(int workerIdx, Range &range);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    // ranges submitted from outside the pool
+    std::mutex        injectedMutex_;
+    std::deque<Range> injected_;
+
+    // ranges in all deques. idle workers sleep while it is zero
+    std::atomic<int> pendingCount_ = 0;
+    std::atomic<int> sleepingCount_ = 0;
+
+    // workers sleeping until their nested loop is done, which also count
+    // in sleepingCount_
+    std::atomic<int> nestedWaitingCount_ = 0;
+
+    std::mutex              sleepMutex_;
+    std::condition_variable wakeCondition_;
+    bool                    stop_ = false;
+};
+
+template<typename Func>
+void TaskScheduler::parallelFor(int beg, int end, const Func &func, int grain)
+{
+    if(beg >= end)
+        return;
+
+    Job job;
+    job.func = [](const void *context, int threadIdx, int rangeBeg, int rangeEnd)
+    {
+        auto &f = *static_cast<const Func *>(context);
+        for(int i = rangeBeg; i < rangeEnd; ++i)
+            f(threadIdx, i);
+    };
+    job.context = &func;
+    job.grain   = grain > 1 ? grain : 1;
+
+    run(job, beg, end);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <common/ray.h>
+
+// Moller-Trumbore ray/triangle tests on precomputed edges B - A and C - A
+
+inline bool hasIntersectionWithTriangle(
+    const Ray    &r,
+    const Float3 &A,
+    const Float3 &B_A,
+    const Float3 &C_A) noexcept
+{
+    const Float3 s1 = cross(r.d, C_A);
+    const float div = dot(s1, B_A);
+    if(div == 0.0f)
+        return false;
+    const float invDiv = 1 / div;
+
+    const Float3 o_A = r.o - A;
+    const float alpha = dot(o_A, s1) * invDiv;
+    if(alpha < 0 || alpha > 1)
+        return false;
+
+    const Float3 s2  = cross(o_A, B_A);
+    const float beta = dot(r.d, s2) * invDiv;
+    if(beta < 0 || alpha + beta > 1)
+        return false;
+
+    const float t = dot(C_A, s2) * invDiv;
+    return r.isBetween(t);
+}
+
+inline bool closestIntersectionWithTriangle(
+    const Ray    &r,
+    const Float3 &A,
+    const Float3 &B_A,
+    const Float3 &C_A,
+    float        *r_t,
+    Float2       *uv) noexcept
+{
+    const Float3 s1 = cross(r.d, C_A);
+    const float div = dot(s1, B_A);
+    if(div == 0.0f)
+        return false;
+    const float invDiv = 1 / div;
+
+    const Float3 o_A = r.o - A;
+    const float alpha = dot(o_A, s1) * invDiv;
+    if(alpha < 0)
+        return false;
+
+    const Float3 s2 = cross(o_A, B_A);
+    const float beta = dot(r.d, s2) * invDiv;
+    if(beta < 0 || alpha + beta > 1)
+        return false;
+
+    const float t = dot(C_A, s2) * invDiv;
+    if(!r.isBetween(t))
+        return false;
+
+    *r_t = t;
+    *uv  = Float2(alpha, beta);
+
+    return true;
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <bit>
+
+#include <common/ray.h>
+#include <common/simd.h>
+
+// SIMD ray/triangle tests over SoA blocks of leaf triangles.
+//
+// blocks store the vertices A, B and C themselves instead of A, B - A and
+// C - A: the watertight test needs them relative to the ray origin, and
+// B - A computed per lane equals the precomputed edge bit for bit.
+// unused lanes are filled with NaN so that they never report a hit
+
+struct alignas(32) TriangleBlock
+{
+    static constexpr int SIZE = SIMD_WIDTH<8>;
+
+    // [0, 3): A, [3, 6): B, [6, 9): C
+    float v[9][SIZE];
+
+    // original triangle index, -1 for unused lanes
+    int index[SIZE];
+};
+
+class TriangleBlockRay
+{
+public:
+
+    using L = SIMDLanes<TriangleBlock::SIZE>;
+    using T = typename L::T;
+
+    T o[3];
+    T d[3];
+
+    // watertight test: axis permutation and shear constants
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    explicit TriangleBlockRay(const Ray &r)
+    {
+        for(int i = 0; i < 3; ++i)
+        {
+            o[i] = L::set1(r.o[i]);
+            d[i] = L::set1(r.d[i]);
+        }
+
+        const float adx = std::abs(r.d.x);
+        const float ady = std::abs(r.d.y);
+        const float adz = std::abs(r.d.z);
+        kz = adx > ady ? (adx > adz ? 0 : 2) : (ady > adz ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if(r.d[kz] < 0)
+            std::swap(kx, ky);
+
+        sx = r.d[kx] / r.d[kz];
+        sy = r.d[ky] / r.d[kz];
+        sz = 1 / r.d[kz];
+    }
+};
+
+// Moller-Trumbore test of all lanes. returns the mask of hit lanes and,
+// when t is not null, the distances and barycentric coordinates of B and C
+inline int intersectTriangleBlock(
+    const TriangleBlock    &block,
+    const TriangleBlockRay &ray,
+    float                   t0,
+    float                   t1,
+    float                  *t,
+    float                  *u,
+    float                  *v)
+{
+    using L = TriangleBlockRay::L;
+
+    const auto ax = L::load(block.v[0]);
+    const auto ay = L::load(block.v[1]);
+    const auto az = L::load(block.v[2]);
+
+    const auto bax = L::sub(L::load(block.v[3]), ax);
+    const auto bay = L::sub(L::load(block.v[4]), ay);
+    const auto baz = L::sub(L::load(block.v[5]), az);
+
+    const auto cax = L::sub(L::load(block.v[6]), ax);
+    const auto cay = L::sub(L::load(block.v[7]), ay);
+    const auto caz = L::sub(L::load(block.v[8]), az);
+
+    const auto &dx = ray.d[0], &dy = ray.d[1], &dz = ray.d[2];
+
+    // s1 = cross(d, C - A)
+    const auto s1x = L::sub(L::mul(dy, caz), L::mul(dz, cay));
+    const auto s1y = L::sub(L::mul(dz, cax), L::mul(dx, caz));
+    const auto s1z = L::sub(L::mul(dx, cay), L::mul(dy, cax));
+
+    const auto div = L::add(
+        L::add(L::mul(s1x, bax), L::mul(s1y, bay)), L::mul(s1z, baz));
+
+    const auto oax = L::sub(ray.o[0], ax);
+    const auto oay = L::sub(ray.o[1], ay);
+    const auto oaz = L::sub(ray.o[2], az);
+
+    // s2 = cross(o - A, B - A)
+    const auto s2x = L::sub(L::mul(oay, baz), L::mul(oaz, bay));
+    const auto s2y = L::sub(L::mul(oaz, bax), L::mul(oax, baz));
+    const auto s2z = L::sub(L::mul(oax, bay), L::mul(oay, bax));
+
+    // one division for the whole block, after the cheap products
+    const auto invDiv = L::div(L::set1(1), div);
+
+    const auto alpha = L::mul(invDiv, L::add(
+        L::add(L::mul(oax, s1x), L::mul(oay, s1y)), L::mul(oaz, s1z)));
+    const auto beta = L::mul(invDiv, L::add(
+        L::add(L::mul(dx, s2x), L::mul(dy, s2y)), L::mul(dz, s2z)));
+    const auto dist = L::mul(invDiv, L::add(
+        L::add(L::mul(cax, s2x), L::mul(cay, s2y)), L::mul(caz, s2z)));
+
+    const auto zero = L::zero();
+
+    auto valid = L::le(zero, alpha);
+    valid = L::and_(valid, L::le(zero, beta));
+    valid = L::and_(valid, L::le(L::add(alpha, beta), L::set1(1)));
+    valid = L::and_(valid, L::le(L::set1(t0), dist));
+    valid = L::and_(valid, L::le(dist, L::set1(t1)));
+
+    const int mask = L::movemask(valid);
+    if(mask && t)
+    {
+        L::store(t, dist);
+        L::store(u, alpha);
+        L::store(v, beta);
+    }
+
+    return mask;
+}
+
+namespace triangle_block_detail
+{
+
+    // double precision fallback for lanes with an edge function of
+    // exactly zero, as suggested by Woop et al.
+    inline bool watertightLaneDouble(
+        const TriangleBlock    &block,
+        int                     lane,
+        const Ray              &r,
+        const TriangleBlockRay &ray,
+        float                   t0,
+        float                   t1,
+        float                  *t,
+        float                  *u,
+        float                  *v)
+    {
+        double p[3][3];
+        for(int i = 0; i < 3; ++i)
+        {
+            for(int axis = 0; axis < 3; ++axis)
+                p[i][axis] = double(block.v[3 * i + axis][lane]) - r.o[axis];
+        }
+
+        double x[3], y[3], z[3];
+        for(int i = 0; i < 3; ++i)
+        {
+            x[i] = p[i][ray.kx] - ray.sx * p[i][ray.kz];
+            y[i] = p[i][ray.ky] - ray.sy * p[i][ray.kz];
+            z[i] = ray.sz * p[i][ray.kz];
+        }
+
+        const double U = x[2] * y[1] - y[2] * x[1];
+        const double V = x[0] * y[2] - y[0] * x[2];
+        const double W = x[1] * y[0] - y[1] * x[0];
+
+        if((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+            return false;
+
+        const double det = U + V + W;
+        if(det == 0)
+            return false;
+
+        const double dist = (U * z[0] + V * z[1] + W * z[2]) / det;
+        if(!(t0 <= dist && dist <= t1))
+            return false;
+
+        *t = static_cast<float>(dist);
+        *u = static_cast<float>(V / det);
+        *v = static_cast<float>(W / det);
+        return true;
+    }
+
+} // namespace triangle_block_detail
+
+// watertight test (Woop, Benthin and Wald 2013): edges shared by two
+// triangles are never missed by both of them
+inline int intersectTriangleBlockWatertight(
+    const TriangleBlock    &block,
+    const Ray              &r,
+    const TriangleBlockRay &ray,
+    float                   t0,
+    float                   t1,
+    float                  *t,
+    float                  *u,
+    float                  *v)
+{
+    using L = TriangleBlockRay::L;
+    constexpr int SIZE = TriangleBlock::SIZE;
+
+    const auto sx = L::set1(ray.sx);
+    const auto sy = L::set1(ray.sy);
+    const auto sz = L::set1(ray.sz);
+
+    // vertices relative to the origin, sheared so that the ray becomes +z
+
+    typename L::T x[3], y[3], z[3];
+    for(int i = 0; i < 3; ++i)
+    {
+        const auto px = L::sub(L::load(block.v[3 * i + ray.kx]), ray.o[ray.kx]);
+        const auto py = L::sub(L::load(block.v[3 * i + ray.ky]), ray.o[ray.ky]);
+        const auto pz = L::sub(L::load(block.v[3 * i + ray.kz]), ray.o[ray.kz]);
+
+        x[i] = L::sub(px, L::mul(sx, pz));
+        y[i] = L::sub(py, L::mul(sy, pz));
+        z[i] = L::mul(sz, pz);
+    }
+
+    const auto U = L::sub(L::mul(x[2], y[1]), L::mul(y[2], x[1]));
+    const auto V = L::sub(L::mul(x[0], y[2]), L::mul(y[0], x[2]));
+    const auto W = L::sub(L::mul(x[1], y[0]), L::mul(y[1], x[0]));
+
+    const auto zero = L::zero();
+
+    const auto allNonNeg = L::and_(
+        L::and_(L::le(zero, U), L::le(zero, V)), L::le(zero, W));
+    const auto allNonPos = L::and_(
+        L::and_(L::le(U, zero), L::le(V, zero)), L::le(W, zero));
+
+    const auto det = L::add(L::add(U, V), W);
+
+    // one division for the whole block, after the sign tests
+    const auto invDet = L::div(L::set1(1), det);
+    const auto dist = L::mul(invDet, L::add(
+        L::add(L::mul(U, z[0]), L::mul(V, z[1])), L::mul(W, z[2])));
+
+    auto valid = L::or_(allNonNeg, allNonPos);
+    valid = L::and_(valid, L::neq(det, zero));
+    valid = L::and_(valid, L::le(L::set1(t0), dist));
+    valid = L::and_(valid, L::le(dist, L::set1(t1)));
+
+    const auto anyZero = L::or_(
+        L::or_(L::eq(U, zero), L::eq(V, zero)), L::eq(W, zero));
+
+    int mask = L::movemask(valid);
+    if(mask && t)
+    {
+        L::store(t, dist);
+        L::store(u, L::mul(V, invDet));
+        L::store(v, L::mul(W, invDet));
+    }
+
+    // recompute lanes on an edge or vertex in double precision
+
+    int fallback = L::movemask(anyZero);
+    while(fallback)
+    {
+        const int lane = std::countr_zero(static_cast<unsigned>(fallback));
+        fallback &= fallback - 1;
+
+        float lt, lu, lv;
+        mask &= ~(1 << lane);
+        if(triangle_block_detail::watertightLaneDouble(
+            block, lane, r, ray, t0, t1, &lt, &lu, &lv))
+        {
+            mask |= 1 << lane;
+            if(t)
+            {
+                t[lane] = lt;
+                u[lane] = lu;
+                v[lane] = lv;
+            }
+        }
+    }
+
+    return mask & ((1 << SIZE) - 1);
+}
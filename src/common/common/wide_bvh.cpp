@@ -0,0 +1,349 @@
+#include <bit>
+
+#include <common/simd.h>
+#include <common/triangle.h>
+#include <common/wide_bvh.h>
+
+namespace
+{
+
+    template<int N>
+    struct TraversalRay
+    {
+        using L = SIMDLanes<SIMD_WIDTH<N>>;
+
+        typename L::T o[3];
+        typename L::T invDir[3];
+
+        // bounds row of the near/far plane of each axis
+        int nearRow[3];
+        int farRow[3];
+
+        TraversalRay(const Ray &r)
+        {
+            for(int i = 0; i < 3; ++i)
+            {
+                o[i]      = L::set1(r.o[i]);
+                invDir[i] = L::set1(1 / r.d[i]);
+
+                nearRow[i] = r.d[i] >= 0 ? i : i + 3;
+                farRow[i]  = r.d[i] >= 0 ? i + 3 : i;
+            }
+        }
+    };
+
+    // returns the hit mask of all children and their entry distances
+    template<int N>
+    int intersectChildren(
+        const typename WideBVH<N>::Node &node,
+        const TraversalRay<N>           &ray,
+        float                            t0,
+        float                            t1,
+        float                           *tNear)
+    {
+        constexpr int W = SIMD_WIDTH<N>;
+        using L = SIMDLanes<W>;
+
+        const auto vt0 = L::set1(t0);
+        const auto vt1 = L::set1(t1);
+
+        int mask = 0;
+        for(int c = 0; c < N; c += W)
+        {
+            auto slab = [&](int row, int axis)
+            {
+                return L::mul(
+                    L::sub(L::load(&node.bounds[row][c]), ray.o[axis]),
+                    ray.invDir[axis]);
+            };
+
+            const auto nx = slab(ray.nearRow[0], 0);
+            const auto ny = slab(ray.nearRow[1], 1);
+            const auto nz = slab(ray.nearRow[2], 2);
+
+            const auto fx = slab(ray.farRow[0], 0);
+            const auto fy = slab(ray.farRow[1], 1);
+            const auto fz = slab(ray.farRow[2], 2);
+
+            const auto enter = L::max(L::max(nx, ny), L::max(nz, vt0));
+            const auto exit  = L::min(L::min(fx, fy), L::min(fz, vt1));
+
+            L::store(tNear + c, enter);
+            mask |= L::movemask(L::le(enter, exit)) << c;
+        }
+
+        return mask;
+    }
+
+    bool isBinaryLeaf(const BVH::Node &node)
+    {
+        return node.isLeaf();
+    }
+
+    float surfaceArea(const BVH::Node &node)
+    {
+        const Float3 d = node.upper - node.lower;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    template<int N>
+    uint32_t collapse(
+        std::span<const BVH::Node>              binaryNodes,
+        uint32_t                                binaryIdx,
+        std::vector<typename WideBVH<N>::Node> &nodes)
+    {
+        using Node = typename WideBVH<N>::Node;
+
+        // open the child with the largest surface area until N children
+        // are gathered or all of them are leaves
+
+        uint32_t children[N];
+        int childCount = 0;
+
+        const BVH::Node &binaryNode = binaryNodes[binaryIdx];
+        if(isBinaryLeaf(binaryNode))
+            children[childCount++] = binaryIdx;
+        else
+        {
+            children[childCount++] = binaryIdx + 1;
+            children[childCount++] = binaryNode.rightChild;
+        }
+
+        while(childCount < N)
+        {
+            int best = -1;
+            float bestArea = -1;
+            for(int i = 0; i < childCount; ++i)
+            {
+                const BVH::Node &c = binaryNodes[children[i]];
+                const float area = surfaceArea(c);
+                if(!isBinaryLeaf(c) && area > bestArea)
+                {
+                    best = i;
+                    bestArea = area;
+                }
+            }
+
+            if(best < 0)
+                break;
+
+            const uint32_t opened = children[best];
+            children[best] = opened + 1;
+            children[childCount++] = binaryNodes[opened].rightChild;
+        }
+
+        const uint32_t nodeIdx = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        {
+            Node &node = nodes[nodeIdx];
+            for(int i = 0; i < N; ++i)
+            {
+                for(int axis = 0; axis < 3; ++axis)
+                {
+                    node.bounds[axis][i]     =  std::numeric_limits<float>::infinity();
+                    node.bounds[axis + 3][i] = -std::numeric_limits<float>::infinity();
+                }
+                node.child[i]    = Node::CHILD_NIL;
+                node.triCount[i] = 0;
+            }
+        }
+
+        for(int i = 0; i < childCount; ++i)
+        {
+            const BVH::Node &c = binaryNodes[children[i]];
+
+            uint32_t child, triCount;
+            if(isBinaryLeaf(c))
+            {
+                child    = c.triBeg;
+                triCount = c.triEnd - c.triBeg;
+            }
+            else
+            {
+                child    = collapse<N>(binaryNodes, children[i], nodes);
+                triCount = 0;
+            }
+
+            // nodes may have been reallocated by the recursive call
+            Node &node = nodes[nodeIdx];
+            for(int axis = 0; axis < 3; ++axis)
+            {
+                node.bounds[axis][i]     = c.lower[axis];
+                node.bounds[axis + 3][i] = c.upper[axis];
+            }
+            node.child[i]    = child;
+            node.triCount[i] = triCount;
+        }
+
+        return nodeIdx;
+    }
+
+    struct StackEntry
+    {
+        uint32_t node;
+        float    tNear;
+    };
+
+} // namespace anonymous
+
+template<int N>
+WideBVH<N> WideBVH<N>::create(const BVH &bvh)
+{
+    WideBVH result;
+    result.triangles_.assign(
+        bvh.getTriangles().begin(), bvh.getTriangles().end());
+    if(!bvh.getNodes().empty())
+        collapse<N>(bvh.getNodes(), 0, result.nodes_);
+    return result;
+}
+
+template<int N>
+bool WideBVH<N>::hasIntersection(const Ray &ray) const
+{
+    if(nodes_.empty())
+        return false;
+
+    thread_local uint32_t stack[TRAVERSAL_STACK_SIZE];
+
+    const TraversalRay<N> tray(ray);
+    alignas(32) float tNear[N];
+
+    int top = 0;
+    stack[top++] = 0;
+
+    while(top)
+    {
+        const Node &node = nodes_[stack[--top]];
+
+        int mask = intersectChildren<N>(node, tray, ray.t0, ray.t1, tNear);
+        while(mask)
+        {
+            const int i = std::countr_zero(static_cast<unsigned>(mask));
+            mask &= mask - 1;
+
+            if(node.triCount[i])
+            {
+                const uint32_t end = node.child[i] + node.triCount[i];
+                for(uint32_t j = node.child[i]; j < end; ++j)
+                {
+                    const BVH::Triangle &tri = triangles_[j];
+                    if(hasIntersectionWithTriangle(
+                        ray, tri.a, tri.b_a, tri.c_a))
+                        return true;
+                }
+            }
+            else
+            {
+                assert(top < TRAVERSAL_STACK_SIZE);
+                stack[top++] = node.child[i];
+            }
+        }
+    }
+
+    return false;
+}
+
+template<int N>
+bool WideBVH<N>::findIntersection(const Ray &ray, BVH::Intersection *inct) const
+{
+    if(nodes_.empty())
+        return false;
+
+    thread_local StackEntry stack[TRAVERSAL_STACK_SIZE];
+
+    auto r = ray;
+    const TraversalRay<N> tray(r);
+    alignas(32) float tNear[N];
+
+    int top = 0;
+    stack[top++] = { 0, r.t0 };
+
+    uint32_t finalIndex = 0;
+    Float2 finalUV;
+    float finalT = std::numeric_limits<float>::infinity();
+
+    while(top)
+    {
+        const StackEntry entry = stack[--top];
+        if(entry.tNear > r.t1)
+            continue;
+
+        const Node &node = nodes_[entry.node];
+
+        int mask = intersectChildren<N>(node, tray, r.t0, r.t1, tNear);
+
+        // visit hit children front to back: leaves are intersected
+        // immediately, interior nodes are pushed nearest last
+
+        int order[N], hitCount = 0;
+        while(mask)
+        {
+            const int i = std::countr_zero(static_cast<unsigned>(mask));
+            mask &= mask - 1;
+
+            int j = hitCount++;
+            while(j > 0 && tNear[order[j - 1]] > tNear[i])
+            {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+
+        for(int k = 0; k < hitCount; ++k)
+        {
+            const int i = order[k];
+            if(!node.triCount[i] || tNear[i] > r.t1)
+                continue;
+
+            const uint32_t end = node.child[i] + node.triCount[i];
+            for(uint32_t j = node.child[i]; j < end; ++j)
+            {
+                const BVH::Triangle &tri = triangles_[j];
+                if(closestIntersectionWithTriangle(
+                    r, tri.a, tri.b_a, tri.c_a, &finalT, &finalUV))
+                {
+                    r.t1 = finalT;
+                    finalIndex = tri.index;
+                }
+            }
+        }
+
+        for(int k = hitCount - 1; k >= 0; --k)
+        {
+            const int i = order[k];
+            if(node.triCount[i] || tNear[i] > r.t1)
+                continue;
+
+            assert(top < TRAVERSAL_STACK_SIZE);
+            stack[top++] = { node.child[i], tNear[i] };
+        }
+    }
+
+    if(isinf(finalT))
+        return false;
+
+    inct->triangle = finalIndex;
+    inct->position = r.at(finalT);
+    inct->t        = finalT;
+    inct->uv       = finalUV;
+
+    return true;
+}
+
+template<int N>
+int WideBVH<N>::getNodeCount() const
+{
+    return static_cast<int>(nodes_.size());
+}
+
+template<int N>
+size_t WideBVH<N>::getMemoryUsage() const
+{
+    return sizeof(Node)          * nodes_.size()
+         + sizeof(BVH::Triangle) * triangles_.size();
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
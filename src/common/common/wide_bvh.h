@@ -0,0 +1,49 @@
+#pragma once
+
+#include <common/bvh.h>
+
+// BVH with up to N (4 or 8) children per node, collapsed from a binary BVH.
+// child bounds are stored as SoA so that one SIMD slab test covers all
+// children of a node
+template<int N>
+class WideBVH
+{
+public:
+
+    static_assert(N == 4 || N == 8);
+
+    struct alignas(32) Node
+    {
+        static constexpr uint32_t CHILD_NIL =
+            (std::numeric_limits<uint32_t>::max)();
+
+        // [0, 3): lower x/y/z, [3, 6): upper x/y/z
+        // empty slots have lower = +inf and upper = -inf
+        float bounds[6][N];
+
+        // child[i] is a node index when triCount[i] == 0,
+        // otherwise the first triangle of a leaf
+        uint32_t child[N];
+        uint32_t triCount[N];
+    };
+
+    static constexpr int TRAVERSAL_STACK_SIZE = 256;
+
+    static WideBVH create(const BVH &bvh);
+
+    bool hasIntersection(const Ray &ray) const;
+
+    bool findIntersection(const Ray &ray, BVH::Intersection *inct) const;
+
+    int getNodeCount() const;
+
+    size_t getMemoryUsage() const;
+
+private:
+
+    std::vector<Node>          nodes_;
+    std::vector<BVH::Triangle> triangles_;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;